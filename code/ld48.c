@@ -16,13 +16,23 @@
  */
 
 
+/* NOTE(omid): glibc hides MAP_ANONYMOUS and madvise under -std=c11. */
+#if !defined(_DEFAULT_SOURCE)
+#define _DEFAULT_SOURCE
+#endif
+
 #include <stdlib.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
 #include <stdbool.h>
 #include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "imp_sdl.h"
 
@@ -30,6 +40,10 @@
 #include <emscripten.h>
 #endif
 
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
 typedef uint8_t u8;
 typedef uint16_t u16;
 typedef uint32_t u32;
@@ -53,9 +67,33 @@ typedef u32 b32;
 #define WINDOW_HEIGHT 720
 #define AUDIO_FREQ 48000
 #define FONT_SIZE 24
+/* NOTE(omid): The simulation always steps at this rate, whatever the display does. */
+#define SIMULATION_HZ 60
+#define SIMULATION_DT (1.0 / SIMULATION_HZ)
+/* NOTE(omid): Most real time simulated in one display frame. After a stall
+   the game slows down rather than stepping for seconds without rendering. */
+#define MAX_FRAME_SECONDS 0.25
 #define SMALL_FONT_SIZE 16
-#define MAX_ENTITY_COUNT 128
 #define MAX_ENTITY_PART_COUNT 32
+/* NOTE(omid): Entity storage starts out with room for MIN_ENTITY_CAPACITY
+   entities and doubles up to the max entity count given at startup. */
+#define MIN_ENTITY_CAPACITY 128
+#define DEFAULT_MAX_ENTITY_COUNT 1024
+#define MAX_ENTITY_COUNT_LIMIT 65536
+#define COLLISION_GRID_CELL_SIZE 64
+#define COLLISION_GRID_WIDTH ((WINDOW_WIDTH + COLLISION_GRID_CELL_SIZE - 1) / COLLISION_GRID_CELL_SIZE)
+#define COLLISION_GRID_HEIGHT ((WINDOW_HEIGHT + COLLISION_GRID_CELL_SIZE - 1) / COLLISION_GRID_CELL_SIZE)
+#define COLLISION_GRID_NONE 0xFFFFFFFF
+/* NOTE(omid): An entity whose parts all stay under these speeds (pixels per
+   step) and accelerations for SLEEP_FRAME_COUNT steps goes to sleep. */
+#define SLEEP_VELOCITY 0.02f
+#define SLEEP_ACCELERATION 0.02f
+#define SLEEP_FRAME_COUNT 30
+/* NOTE(omid): The physics stages run on up to MAX_WORKER_COUNT threads, the
+   main thread included, in jobs of at least PHYSICS_CHUNK_ENTITY_COUNT
+   entities. */
+#define MAX_WORKER_COUNT 16
+#define PHYSICS_CHUNK_ENTITY_COUNT 8
 
 
 #define ARRAY_COUNT(x) (sizeof(x) / sizeof((x)[0]))
@@ -69,15 +107,22 @@ struct memory_arena
 	u32 used;
 };
 
+#define ARENA_ALIGNMENT 16
+#define ARENA_ALIGN(size) (((size) + (ARENA_ALIGNMENT - 1)) & ~(u32)(ARENA_ALIGNMENT - 1))
+
+/* NOTE(omid): Every push starts on an ARENA_ALIGNMENT boundary, so the SIMD
+   kernels can load from arrays pushed here. */
 static void *
 push_size(struct memory_arena *arena, u32 size)
 {
-	u32 remaining = arena->size - arena->used;
+	u32 used = ARENA_ALIGN(arena->used);
+	assert(used <= arena->size);
+	u32 remaining = arena->size - used;
 	assert(remaining >= size);
 
-	umm p = (umm)arena->base + arena->used;
+	umm p = (umm)arena->base + used;
 
-	arena->used += size;
+	arena->used = used + size;
 
 	void *result = (void *)p;
 
@@ -85,6 +130,8 @@ push_size(struct memory_arena *arena, u32 size)
 }
 
 #define PUSH_STRUCT(arena, type) (type *)push_size(arena, sizeof(type))
+#define PUSH_ARRAY(arena, type, count) (type *)push_size(arena, (u32)sizeof(type) * (count))
+#define ARENA_ARRAY_SIZE(type, count) ARENA_ALIGN((u32)sizeof(type) * (count))
 
 static void
 zero_memory(void *base, umm size)
@@ -94,6 +141,76 @@ zero_memory(void *base, umm size)
 
 #define ZERO_STRUCT(source) zero_memory(&source, sizeof(source))
 
+/* NOTE(omid): The game arena is reserved for its worst case as address
+   space only, and committed as it is pushed onto, so memory follows the
+   storage actually grown into. Emscripten cannot reserve without
+   committing, its mmap is a malloc, so there the arena is allocated whole
+   and commit and decommit do nothing. */
+static b32
+reserve_arena(struct memory_arena *arena, u32 size)
+{
+#if defined(__EMSCRIPTEN__)
+	void *base = calloc(1, size);
+	if (!base)
+		return false;
+#else
+	void *base = mmap(0, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED)
+		return false;
+#endif
+	arena->base = base;
+	arena->size = size;
+	arena->used = 0;
+	return true;
+}
+
+/* NOTE(omid): Makes the arena usable from its base up to end. Committing
+   pages again is harmless. */
+static b32
+commit_arena(struct memory_arena *arena, u32 end)
+{
+#if defined(__EMSCRIPTEN__)
+	(void)arena;
+	(void)end;
+	return true;
+#else
+	if (end > arena->size)
+		end = arena->size;
+	return mprotect(arena->base, end, PROT_READ | PROT_WRITE) == 0;
+#endif
+}
+
+/* NOTE(omid): Gives the whole pages between begin and end back to the
+   system. They stay committed and read as zero when touched again. */
+static void
+decommit_arena_range(void *begin, void *end)
+{
+#if defined(__EMSCRIPTEN__)
+	(void)begin;
+	(void)end;
+#else
+	umm page_size = (umm)sysconf(_SC_PAGESIZE);
+	umm first = ((umm)begin + page_size - 1) & ~(page_size - 1);
+	umm last = (umm)end & ~(page_size - 1);
+	if (first < last)
+		madvise((void *)first, last - first, MADV_DONTNEED);
+#endif
+}
+
+static void
+release_arena(struct memory_arena *arena)
+{
+#if defined(__EMSCRIPTEN__)
+	free(arena->base);
+#else
+	if (arena->base)
+		munmap(arena->base, arena->size);
+#endif
+	arena->base = 0;
+	arena->size = 0;
+	arena->used = 0;
+}
+
 static const f64 F64_ZERO = 0;
 static const f32 F32_ZERO = 0;
 
@@ -232,30 +349,96 @@ scale_v2i(struct v2i a, s32 s)
 	return result;
 }
 
+/* NOTE(omid): Topology and gameplay data of a part. The physics state lives in
+   the part_store, see struct part_span. */
 struct entity_part {
 	u16 index;
 	u16 length;
-	u16 size;
 	u16 color;
 	u16 parent_index;
 	u16 render_size;
 	u16 depth;
 	b16 disposed;
+	b16 passthrough;
 	f32 stiffness;
-	f32 mass;
 	u8 max_alpha;
 	b8 suspended_for_frame;
 	b8 internal_collisions;
 	u8 content;
 	u8 hydration;
 	u8 accept;
-	b16 passthrough;
+	u8 collision_layer;
+	u8 collision_mask;
 	u32 content_value;
 	f32 audio_gen;
-	struct v2 p;
-	struct v2 v;
-	struct v2 a;
-	struct v2 force;
+};
+
+/* NOTE(omid): Hot physics data of every part in the game, one array per field,
+   entity_capacity * MAX_ENTITY_PART_COUNT slots long. Each entity owns a span
+   of MAX_ENTITY_PART_COUNT consecutive slots starting at its part_base. Spans
+   of removed entities go on the free list and are handed out first. */
+struct part_store {
+	struct v2 *p;
+	struct v2 *v;
+	struct v2 *a;
+	struct v2 *force;
+	f32 *mass;
+	f32 *inv_mass;
+	u16 *size;
+
+	/* NOTE(omid): Render only. p before the last step, NaN for parts pushed
+	   since, and the positions interpolated between the two for drawing. */
+	struct v2 *prev_p;
+	struct v2 *render_p;
+
+	/* NOTE(omid): Where update_newtonian_physics moves the parts to, written
+	   by the jobs and applied once they are done. */
+	struct v2 *next_p;
+	struct v2 *next_v;
+
+	u32 *free_spans;
+	u32 free_span_count;
+	u32 span_count;
+};
+
+/* NOTE(omid): Every parent/child spring in the game flattened into one list of
+   part store slots, rebuilt only when the part topology changes. The spring
+   kernels write the resulting accelerations into the per-link outputs, which
+   are then applied to the parts in a separate pass. */
+struct spring_links {
+	u32 *child;
+	u32 *parent;
+	f32 *rest_length;
+	f32 *k;
+
+	f32 *child_ax;
+	f32 *child_ay;
+	f32 *parent_ax;
+	f32 *parent_ay;
+
+	/* NOTE(omid): The links of entity i are first_link[i] up to
+	   first_link[i + 1], a parent never lies outside its child's entity. */
+	u32 *first_link;
+
+	u32 count;
+	b32 dirty;
+};
+
+enum spring_kernel {
+	SPRING_KERNEL_SCALAR,
+	SPRING_KERNEL_SSE2,
+	SPRING_KERNEL_AVX2
+};
+
+/* NOTE(omid): Pointers to the first slot of an entity in each part_store array. */
+struct part_span {
+	struct v2 *p;
+	struct v2 *v;
+	struct v2 *a;
+	struct v2 *force;
+	f32 *mass;
+	f32 *inv_mass;
+	u16 *size;
 };
 
 enum entity_type {
@@ -271,11 +454,31 @@ enum entity_type {
 	ENTITY_GEM        = 0x100
 };
 
+/* NOTE(omid): Names an entity for as long as it lives, wherever compaction
+   moves it. A zero generation is the null handle. */
+struct entity_handle {
+	u32 slot;
+	u32 generation;
+};
+
+/* NOTE(omid): index holds where the entity of each slot currently lives.
+   Freeing a slot bumps its generation, so handles to the removed entity
+   stop resolving even after the slot is reused. */
+struct entity_handle_table {
+	u32 *index;
+	u32 *generation;
+	u32 *free_slots;
+	u32 free_slot_count;
+	u32 slot_count;
+};
+
 struct entity {
 	u32 id;
 	u32 index;
+	struct entity_handle handle;
 	u32 seed;
 	u32 type;
+	u32 part_base;
 	u8 part_count;
 	b8 internal_collisions;
 	b8 disposed;
@@ -285,10 +488,14 @@ struct entity {
 	b16 fixed;
 	b16 passthrough;
 
+	/* NOTE(omid): A sleeping entity skips the springs and integration and
+	   only stands in the way of others. */
+	b16 asleep;
+	u16 still_frame_count;
+
 	struct v2 target;
 	f32 pull_of_target;
-	u32 target_entity_index;
-	u32 target_entity_id;
+	struct entity_handle target_entity;
 	b32 has_target;
 	f32 next_target_check_t;
 	f32 expiration_t;
@@ -302,18 +509,119 @@ enum waveform_type {
 	SAW
 };
 
-struct waveform {
-	u16 t;
+/* NOTE(omid): xoshiro128** state, owned by whoever holds it. Never all zero. */
+struct random_series {
+	u32 s[4];
+};
+
+#define RANDOM_LANE_COUNT 8
+
+/* NOTE(omid): RANDOM_LANE_COUNT independent xoshiro128+ streams stepped in
+   lockstep, laid out so that the batch fill vectorizes. */
+struct random_lanes {
+	u32 s0[RANDOM_LANE_COUNT];
+	u32 s1[RANDOM_LANE_COUNT];
+	u32 s2[RANDOM_LANE_COUNT];
+	u32 s3[RANDOM_LANE_COUNT];
+};
+
+/* NOTE(omid): Voices a table holds, whatever the part count. update_audio
+   gathers and culls the candidates in the game's voice scratch first. */
+#define MAX_VOICE_COUNT 4096
+#define VOICE_TABLE_INDEX_MASK 3
+#define VOICE_TABLE_FRESH 4
+
+#define DEFAULT_VOICE_BUDGET 128
+/* NOTE(omid): About -60 dB of full scale. */
+#define MIN_AUDIBLE_VOICE_AMP 0.001f
+
+/* NOTE(omid): slot names the part slot the voice came from and keys the
+   mixer's phase store, so voices keep their phase while the table around
+   them is culled and reordered. */
+struct voice {
+	u32 slot;
 	u16 freq;
+	u16 pad_;
 	f32 amp;
 };
 
+#define OSCILLATOR_LANE_COUNT 4
+
+/* NOTE(omid): Phase accumulators, a full cycle being 2^32. Padded with
+   silent voices to a multiple of OSCILLATOR_LANE_COUNT. */
+struct oscillator_bank {
+	u32 phase[MAX_VOICE_COUNT];
+	u32 increment[MAX_VOICE_COUNT];
+	f32 amp[MAX_VOICE_COUNT];
+	u32 slot[MAX_VOICE_COUNT];
+	u32 voice_count;
+	u32 count;
+};
+
+enum oscillator_kernel {
+	OSCILLATOR_KERNEL_SCALAR,
+	OSCILLATOR_KERNEL_SSE2
+};
+
+struct voice_table {
+	struct voice sine_waves[MAX_VOICE_COUNT];
+	struct voice saw_waves[MAX_VOICE_COUNT];
+	struct voice noise_waves[MAX_VOICE_COUNT];
+	u32 sine_wave_count;
+	u32 saw_wave_count;
+	u32 noise_wave_count;
+	u32 pad_;
+};
+
+/* NOTE(omid): Triple buffer between update_audio and mix_audio. The game
+   thread fills tables[write_index] and swaps it into published; the mixer
+   swaps the published table out for tables[read_index] at the start of a
+   callback when VOICE_TABLE_FRESH is set. Neither side ever waits.
+   Oscillator phases belong to the mixer and are kept per voice slot, so
+   they carry over from one table to the next. */
+struct voice_exchange {
+	struct voice_table tables[3];
+	SDL_atomic_t published;
+
+	/* NOTE(omid): Only used for the contention counters. */
+	SDL_atomic_t mixing;
+	SDL_atomic_t writing;
+	/* NOTE(omid): Callbacks that began while the game thread was writing, the
+	   old audio lock would have stalled them. */
+	SDL_atomic_t mixer_contention_count;
+
+	/* NOTE(omid): Game thread only. */
+	u32 write_index;
+	/* NOTE(omid): Updates that began while the mixer was running, the old
+	   audio lock would have stalled the frame. */
+	u32 game_contention_count;
+	/* NOTE(omid): Tables replaced before the mixer picked them up. */
+	u32 dropped_table_count;
+	/* NOTE(omid): Most sine plus saw voices a table may hold. */
+	u32 voice_budget;
+	/* NOTE(omid): Sine plus saw voices of the last table, before and after culling. */
+	u32 candidate_voice_count;
+	u32 active_voice_count;
+
+	/* NOTE(omid): Audio thread only. The phase stores have a slot for every
+	   part slot the entity storage can ever grow to, so they never move
+	   under the mixer. */
+	u32 read_index;
+	u32 phase_slot_count;
+	u32 *sine_phase;
+	u32 *saw_phase;
+	struct oscillator_bank sine_bank;
+	struct oscillator_bank saw_bank;
+};
+
 enum game_event_type {
 	GAME_EVENT_NONE,
 	GAME_EVENT_SEED_TOUCH_WATER,
 	GAME_EVENT_WORM_EAT_FOOD,
 	GAME_EVENT_WATER_EATER_EAT_WATER,
-	GAME_EVENT_GEM_TOUCH_SOCKET
+	GAME_EVENT_GEM_TOUCH_SOCKET,
+
+	GAME_EVENT_TYPE_COUNT
 };
 
 struct generic_collision_event {
@@ -333,30 +641,127 @@ struct game_event {
 	};
 };
 
+/* NOTE(omid): What a part can do in a collision besides pushing back. Part 0
+   of a worm, water eater or gem is its head, the only part that eats or fits
+   into sockets. Bit 0 of the collision layers is the solid layer instead. */
+enum collision_class {
+	COLLISION_CLASS_NONE,
+	COLLISION_CLASS_SEED,
+	COLLISION_CLASS_WATER,
+	COLLISION_CLASS_FOOD,
+	COLLISION_CLASS_WORM_HEAD,
+	COLLISION_CLASS_WATER_EATER_HEAD,
+	COLLISION_CLASS_GEM_HEAD,
+	COLLISION_CLASS_SOCKET,
+
+	COLLISION_CLASS_COUNT
+};
+
+#define COLLISION_LAYER_SOLID 0x01
+#define COLLISION_LAYER(collision_class) (1u << (collision_class))
+
+#define INTERACTION_SWAPPED 0x80
+
+/* NOTE(omid): The event a part of the first class raises when it touches a
+   part of the second. INTERACTION_SWAPPED means the second part's entity
+   comes first in the event. */
+static const u8 collision_interactions[COLLISION_CLASS_COUNT][COLLISION_CLASS_COUNT] = {
+	[COLLISION_CLASS_SEED][COLLISION_CLASS_WATER] = GAME_EVENT_SEED_TOUCH_WATER,
+	[COLLISION_CLASS_WATER][COLLISION_CLASS_SEED] = GAME_EVENT_SEED_TOUCH_WATER | INTERACTION_SWAPPED,
+
+	[COLLISION_CLASS_WORM_HEAD][COLLISION_CLASS_SEED] = GAME_EVENT_WORM_EAT_FOOD,
+	[COLLISION_CLASS_WORM_HEAD][COLLISION_CLASS_WATER] = GAME_EVENT_WORM_EAT_FOOD,
+	[COLLISION_CLASS_WORM_HEAD][COLLISION_CLASS_FOOD] = GAME_EVENT_WORM_EAT_FOOD,
+	[COLLISION_CLASS_SEED][COLLISION_CLASS_WORM_HEAD] = GAME_EVENT_WORM_EAT_FOOD | INTERACTION_SWAPPED,
+	[COLLISION_CLASS_WATER][COLLISION_CLASS_WORM_HEAD] = GAME_EVENT_WORM_EAT_FOOD | INTERACTION_SWAPPED,
+	[COLLISION_CLASS_FOOD][COLLISION_CLASS_WORM_HEAD] = GAME_EVENT_WORM_EAT_FOOD | INTERACTION_SWAPPED,
+
+	[COLLISION_CLASS_WATER_EATER_HEAD][COLLISION_CLASS_SEED] = GAME_EVENT_WATER_EATER_EAT_WATER,
+	[COLLISION_CLASS_WATER_EATER_HEAD][COLLISION_CLASS_WATER] = GAME_EVENT_WATER_EATER_EAT_WATER,
+	[COLLISION_CLASS_WATER_EATER_HEAD][COLLISION_CLASS_FOOD] = GAME_EVENT_WATER_EATER_EAT_WATER,
+	[COLLISION_CLASS_SEED][COLLISION_CLASS_WATER_EATER_HEAD] = GAME_EVENT_WATER_EATER_EAT_WATER | INTERACTION_SWAPPED,
+	[COLLISION_CLASS_WATER][COLLISION_CLASS_WATER_EATER_HEAD] = GAME_EVENT_WATER_EATER_EAT_WATER | INTERACTION_SWAPPED,
+	[COLLISION_CLASS_FOOD][COLLISION_CLASS_WATER_EATER_HEAD] = GAME_EVENT_WATER_EATER_EAT_WATER | INTERACTION_SWAPPED,
+
+	[COLLISION_CLASS_GEM_HEAD][COLLISION_CLASS_SOCKET] = GAME_EVENT_GEM_TOUCH_SOCKET,
+	[COLLISION_CLASS_SOCKET][COLLISION_CLASS_GEM_HEAD] = GAME_EVENT_GEM_TOUCH_SOCKET | INTERACTION_SWAPPED,
+};
+
+#define GAME_EVENT_BLOCK_SIZE 64
+
+struct game_event_block {
+	struct game_event_block *next;
+	u32 count;
+	u32 pad_;
+	struct game_event events[GAME_EVENT_BLOCK_SIZE];
+};
+
+/* NOTE(omid): The events of one type pushed this step, in blocks taken from
+   the frame arena as they fill up. */
+struct game_event_bucket {
+	struct game_event_block *first;
+	struct game_event_block *last;
+	u32 count;
+	u32 pad_;
+};
+
 struct spawn_item {
 	enum entity_type type;
 	u32 param;
 	f32 time;
 };
 
+/* NOTE(omid): Uniform grid broadphase over the play area. Every part lives in
+   exactly one cell, keyed by the slot (entity_index * MAX_ENTITY_PART_COUNT + part_index).
+   The per-slot arrays grow with the entity storage. */
+/* NOTE(omid): candidates holds one bitset per worker, each (slot_count + 63) / 64
+   words long. */
+struct collision_grid {
+	u64 *candidates;
+	u32 *next_in_cell;
+	u32 *prev_in_cell;
+	u32 *cell_of_slot;
+	u32 first_in_cell[COLLISION_GRID_WIDTH * COLLISION_GRID_HEIGHT];
+	u32 slot_count;
+	f32 max_part_size;
+};
+
 struct game_state {
-	struct entity entities[MAX_ENTITY_COUNT];
+	/* NOTE(omid): Backs every array sized by the entity capacity. */
+	struct memory_arena arena;
+
+	struct entity *entities;
 	u32 entity_count;
+	u32 entity_capacity;
+
+	/* NOTE(omid): Entity indices in draw order, kept from frame to frame.
+	   New entities go on the end and sort_entities_by_z moves them into
+	   place. */
+	u32 *entity_index_by_z;
+	struct entity_handle_table handles;
+
+	/* NOTE(omid): Voice candidates of every part, before culling. */
+	struct voice *sine_scratch;
+	struct voice *saw_scratch;
 
-	u32 entity_index_by_z[MAX_ENTITY_COUNT];
+	struct part_store parts;
+	struct spring_links springs;
 
-	u32 player_index;
-	u32 player_id;
+	/* NOTE(omid): Most entities the storage may grow to. */
+	u32 max_entity_count;
+
+	struct entity_handle player;
 	
-	struct spawn_item spawn_bag[32];
-	u32 spawn_bag_count;
-	u32 spawn_bag_offset;
+	/* NOTE(omid): The current level's span of level_set.spawns, and the
+	   next one to spawn. */
+	u32 first_spawn;
+	u32 next_spawn;
+	u32 end_spawn;
+	u32 pad_;
 
 	u32 frame_index;
 	f32 time;
 
-	f32 last_frame_real_time;
-
 	f32 last_level_end_t;
 	f32 tunnel_begin_t;
 	
@@ -377,19 +782,21 @@ struct game_state {
 	u32 time_speed_up;
 	b16 skip_to_begin;
 	b16 skip_to_end;
-	
-	struct waveform sine_waves[MAX_ENTITY_COUNT * MAX_ENTITY_PART_COUNT];
-	u32 sine_wave_count;
 
-	struct waveform saw_waves[MAX_ENTITY_COUNT * MAX_ENTITY_PART_COUNT];
-	u32 saw_wave_count;
-
-	struct waveform noise_waves[MAX_ENTITY_COUNT * MAX_ENTITY_PART_COUNT];
-	u32 noise_wave_count;
+	/* NOTE(omid): Handled by step_game once the step is over. */
+	b16 level_snapshot_pending;
+	b16 restart_level;
+	
+	struct voice_exchange voices;
 
 	
-	struct game_event events[64];
-	u32 event_count;
+	/* NOTE(omid): Cleared at the start of every step. */
+	struct memory_arena frame_arena;
+	struct game_event_bucket events[GAME_EVENT_TYPE_COUNT];
+	u32 event_totals[GAME_EVENT_TYPE_COUNT];
+
+	u32 awake_entity_count;
+	u32 asleep_entity_count;
 
 	u32 entity_id_seq;
 
@@ -397,8 +804,14 @@ struct game_state {
 
 	b32 game_over;
 
-	b32 pad_;
 	const char *level_instr;
+
+	/* NOTE(omid): The game thread only ever touches random, the audio
+	   callback only ever touches audio_random. */
+	struct random_series random;
+	struct random_lanes audio_random;
+
+	struct collision_grid collision_grid;
 };
 
 struct input_state
@@ -421,6 +834,11 @@ struct input_state
 
 	s8 dspeed_up;
 	s8 dspeed_down;
+
+	u8 mouse_left;
+	s8 dmouse_left;
+	s32 mouse_x;
+	s32 mouse_y;
 };
 
 enum text_align
@@ -432,18 +850,121 @@ enum text_align
 
 
 
+#define DEFAULT_RANDOM_SEED 120
+
+static u32
+rotate_left_u32(u32 x, u32 k)
+{
+	return (x << k) | (x >> (32 - k));
+}
+
+static u64
+splitmix64(u64 *state)
+{
+	u64 z = (*state += 0x9E3779B97F4A7C15ULL);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+static void
+seed_random_series(struct random_series *series, u64 seed)
+{
+	u64 state = seed;
+	u64 a = splitmix64(&state);
+	u64 b = splitmix64(&state);
+	series->s[0] = (u32)a;
+	series->s[1] = (u32)(a >> 32);
+	series->s[2] = (u32)b;
+	series->s[3] = (u32)(b >> 32);
+}
+
+static void
+seed_random_lanes(struct random_lanes *lanes, u64 seed)
+{
+	u64 state = seed;
+	for (u32 lane = 0; lane < RANDOM_LANE_COUNT; ++lane) {
+		u64 a = splitmix64(&state);
+		u64 b = splitmix64(&state);
+		lanes->s0[lane] = (u32)a;
+		lanes->s1[lane] = (u32)(a >> 32);
+		lanes->s2[lane] = (u32)b;
+		lanes->s3[lane] = (u32)(b >> 32);
+	}
+}
+
+static u32
+random_u32(struct random_series *series)
+{
+	u32 *s = series->s;
+	u32 result = rotate_left_u32(s[1] * 5, 7) * 9;
+	u32 t = s[1] << 9;
+
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = rotate_left_u32(s[3], 11);
+
+	return result;
+}
+
 static s32
-random_int(s32 min, s32 max)
+random_int(struct random_series *series, s32 min, s32 max)
 {
-	s32 range = max - min;
-	return min + rand() % range;
+	u32 range = (u32)(max - min);
+	return min + (s32)(random_u32(series) % range);
 }
 
+/* NOTE(omid): In [0, 1), from the top 24 bits. */
 static f32
-random_f32()
+random_f32(struct random_series *series)
+{
+	return (f32)(random_u32(series) >> 8) * (1.0f / 16777216.0f);
+}
+
+static void
+random_lanes_step(struct random_lanes *lanes, f32 *out)
+{
+	for (u32 lane = 0; lane < RANDOM_LANE_COUNT; ++lane) {
+		u32 s0 = lanes->s0[lane];
+		u32 s1 = lanes->s1[lane];
+		u32 s2 = lanes->s2[lane];
+		u32 s3 = lanes->s3[lane];
+
+		u32 result = s0 + s3;
+		u32 t = s1 << 9;
+
+		s2 ^= s0;
+		s3 ^= s1;
+		s1 ^= s2;
+		s0 ^= s3;
+		s2 ^= t;
+		s3 = (s3 << 11) | (s3 >> 21);
+
+		lanes->s0[lane] = s0;
+		lanes->s1[lane] = s1;
+		lanes->s2[lane] = s2;
+		lanes->s3[lane] = s3;
+
+		out[lane] = (f32)(result >> 8) * (1.0f / 16777216.0f);
+	}
+}
+
+/* NOTE(omid): Fills out with count floats in [0, 1). */
+static void
+random_fill_f32(struct random_lanes *lanes, f32 *out, u32 count)
 {
-	u32 r = (u32)(rand());
-	return (f32)r / (f32)RAND_MAX;
+	u32 i = 0;
+	for (; i + RANDOM_LANE_COUNT <= count; i += RANDOM_LANE_COUNT)
+		random_lanes_step(lanes, out + i);
+
+	if (i < count) {
+		f32 tail[RANDOM_LANE_COUNT];
+		random_lanes_step(lanes, tail);
+		memcpy(out + i, tail, (count - i) * sizeof(f32));
+	}
 }
 
 static s32
@@ -460,6 +981,64 @@ max(s32 x, s32 y)
 
 static const struct v2 screen_center = { .x = WINDOW_WIDTH / 2, .y = WINDOW_HEIGHT / 2 };
 static struct game_state *global_game;
+static enum spring_kernel spring_kernel = SPRING_KERNEL_SCALAR;
+
+
+static struct part_span
+get_part_span(struct game_state *game, const struct entity *entity)
+{
+	struct part_store *store = &game->parts;
+	u32 base = entity->part_base;
+
+	struct part_span result;
+	result.p = store->p + base;
+	result.v = store->v + base;
+	result.a = store->a + base;
+	result.force = store->force + base;
+	result.mass = store->mass + base;
+	result.inv_mass = store->inv_mass + base;
+	result.size = store->size + base;
+	return result;
+}
+
+static u32
+alloc_part_span(struct part_store *store)
+{
+	u32 span_index;
+	if (store->free_span_count) {
+		span_index = store->free_spans[--store->free_span_count];
+	} else {
+		span_index = store->span_count++;
+	}
+	return span_index * MAX_ENTITY_PART_COUNT;
+}
+
+static void
+free_part_span(struct part_store *store, u32 part_base)
+{
+	assert(store->free_span_count < store->span_count);
+	store->free_spans[store->free_span_count++] = part_base / MAX_ENTITY_PART_COUNT;
+}
+
+static void
+copy_part_slot(struct part_store *store, u32 dest, u32 source)
+{
+	store->p[dest] = store->p[source];
+	store->v[dest] = store->v[source];
+	store->a[dest] = store->a[source];
+	store->force[dest] = store->force[source];
+	store->mass[dest] = store->mass[source];
+	store->inv_mass[dest] = store->inv_mass[source];
+	store->size[dest] = store->size[source];
+	store->prev_p[dest] = store->prev_p[source];
+}
+
+static void
+set_part_mass(struct part_span parts, u32 part_index, f32 mass)
+{
+	parts.mass[part_index] = mass;
+	parts.inv_mass[part_index] = 1.0f / mass;
+}
 
 
 static inline bool
@@ -561,30 +1140,32 @@ test_collision_against_line(struct v2 P,
 	return(Collision);
 }
 
-__attribute__((always_inline))
-static inline bool
-test_collision_against_box(const struct entity_part *Obstacle,
-			   struct entity_part *Entity,
+/* NOTE(omid): The original narrowphase, kept as the reference the swept box
+   kernel is checked against in the benchmark. */
+static bool
+test_collision_against_box_reference(struct v2 ObstacleP,
+			   u16 ObstacleSize,
+			   u16 EntitySize,
 			   struct v2 P,
 			   struct v2 *NewP,
 			   struct v2 *NewV)
 {
-    struct v2 MinkowskiSize = v2(Obstacle->size + Entity->size, Obstacle->size + Entity->size);
+    struct v2 MinkowskiSize = v2(ObstacleSize + EntitySize, ObstacleSize + EntitySize);
 
-    struct v2 Diff = sub_v2(P, Obstacle->p);
+    struct v2 Diff = sub_v2(P, ObstacleP);
     if (fabsf(Diff.x) > MinkowskiSize.x || fabsf(Diff.y) > MinkowskiSize.y)
         return false;
 
 #if 0
-    struct v2 TopLeft = add_v2(Obstacle->p, scale_v2(v2(-MinkowskiSize.x, MinkowskiSize.y), 0.5f));
-    struct v2 TopRight = add_v2(Obstacle->p, scale_v2(MinkowskiSize, 0.5f));
-    struct v2 BottomRight = add_v2(Obstacle->p, scale_v2(v2(MinkowskiSize.x, -MinkowskiSize.y), 0.5f));
-    struct v2 BottomLeft = add_v2(Obstacle->p, scale_v2(MinkowskiSize, 0.5f));
+    struct v2 TopLeft = add_v2(ObstacleP, scale_v2(v2(-MinkowskiSize.x, MinkowskiSize.y), 0.5f));
+    struct v2 TopRight = add_v2(ObstacleP, scale_v2(MinkowskiSize, 0.5f));
+    struct v2 BottomRight = add_v2(ObstacleP, scale_v2(v2(MinkowskiSize.x, -MinkowskiSize.y), 0.5f));
+    struct v2 BottomLeft = add_v2(ObstacleP, scale_v2(MinkowskiSize, 0.5f));
 #else
-    struct v2 TopLeft = add_v2(Obstacle->p, scale_v2(v2(-MinkowskiSize.x, -MinkowskiSize.y), 0.5f));
-    struct v2 TopRight = add_v2(Obstacle->p, scale_v2(v2(MinkowskiSize.x, -MinkowskiSize.y), 0.5f));
-    struct v2 BottomRight = add_v2(Obstacle->p, scale_v2(v2(MinkowskiSize.x, MinkowskiSize.y), 0.5f));
-    struct v2 BottomLeft = add_v2(Obstacle->p, scale_v2(v2(-MinkowskiSize.x, MinkowskiSize.y), 0.5f));
+    struct v2 TopLeft = add_v2(ObstacleP, scale_v2(v2(-MinkowskiSize.x, -MinkowskiSize.y), 0.5f));
+    struct v2 TopRight = add_v2(ObstacleP, scale_v2(v2(MinkowskiSize.x, -MinkowskiSize.y), 0.5f));
+    struct v2 BottomRight = add_v2(ObstacleP, scale_v2(v2(MinkowskiSize.x, MinkowskiSize.y), 0.5f));
+    struct v2 BottomLeft = add_v2(ObstacleP, scale_v2(v2(-MinkowskiSize.x, MinkowskiSize.y), 0.5f));
 #endif    
     // NOTE(Omid): Check if inside.
     if (P.x > TopLeft.x &&
@@ -614,1890 +1195,6292 @@ test_collision_against_box(const struct entity_part *Obstacle,
     return false;
 }
 
+struct box_sweep {
+	struct v2 normal;
+	f32 t;
+	b32 hit;
+};
 
-
-static void
-fill_rect(SDL_Renderer *renderer, s32 x, s32 y, s32 width, s32 height, struct color color)
+/* NOTE(omid): Where the segment from p along dp first enters the box, by the
+   slab method. On an axis the segment runs parallel to, p only has to lie
+   within the slab, so nothing is ever divided by zero. The normal is the one
+   of the side entered, top or bottom winning at a corner. */
+__attribute__((always_inline))
+static inline struct box_sweep
+sweep_point_against_box(struct v2 p, struct v2 dp, struct v2 min, struct v2 max)
 {
-	SDL_Rect rect = {0};
-	rect.x = x;
-	rect.y = y;
-	rect.w = width;
-	rect.h = height;
-	SDL_SetRenderDrawColor(renderer, color.r, color.g, color.b, color.a);
-	SDL_RenderFillRect(renderer, &rect);
+	f32 enter_x = -INFINITY;
+	f32 exit_x = INFINITY;
+	if (dp.x < 0 || dp.x > 0) {
+		enter_x = ((dp.x > 0 ? min.x : max.x) - p.x) / dp.x;
+		exit_x = ((dp.x > 0 ? max.x : min.x) - p.x) / dp.x;
+	} else if (p.x < min.x || p.x > max.x) {
+		enter_x = INFINITY;
+	}
+
+	f32 enter_y = -INFINITY;
+	f32 exit_y = INFINITY;
+	if (dp.y < 0 || dp.y > 0) {
+		enter_y = ((dp.y > 0 ? min.y : max.y) - p.y) / dp.y;
+		exit_y = ((dp.y > 0 ? max.y : min.y) - p.y) / dp.y;
+	} else if (p.y < min.y || p.y > max.y) {
+		enter_y = INFINITY;
+	}
+
+	struct box_sweep result;
+	bool enter_on_x = enter_x > enter_y;
+	f32 enter = enter_on_x ? enter_x : enter_y;
+	f32 exit = exit_x < exit_y ? exit_x : exit_y;
+	result.t = enter;
+	result.hit = enter <= exit && enter >= 0 && enter <= 1;
+	result.normal = enter_on_x ? v2(dp.x > 0 ? -1.0f : 1.0f, 0) : v2(0, dp.y > 0 ? -1.0f : 1.0f);
+	return result;
 }
 
-static void
-draw_rect(SDL_Renderer *renderer, s32 x, s32 y, s32 width, s32 height, struct color color)
+/* NOTE(omid): The narrowphase. The part moving from p to new_p is tested
+   against the obstacle box grown by the part's size. A part starting inside
+   is pushed out vertically. One that sweeps into the box is stopped a pixel
+   out from the side it entered. One that ends up within a pixel outside a
+   side is pushed out to 1.1 pixels. Matches
+   test_collision_against_box_reference up to rounding, and up to which side
+   wins when a step crosses one side and grazes another. */
+__attribute__((always_inline))
+static inline bool
+collide_part_with_box(struct v2 obstacle_p, f32 obstacle_size, f32 size, struct v2 p, struct v2 *new_p)
 {
-	SDL_Rect rect = {0};
-	rect.x = x;
-	rect.y = y;
-	rect.w = width;
-	rect.h = height;
-	SDL_SetRenderDrawColor(renderer, color.r, color.g, color.b, color.a);
-	SDL_RenderDrawRect(renderer, &rect);
+	f32 minkowski_size = obstacle_size + size;
+	struct v2 diff = sub_v2(p, obstacle_p);
+	if (fabsf(diff.x) > minkowski_size || fabsf(diff.y) > minkowski_size)
+		return false;
+
+	f32 half_size = minkowski_size * 0.5f;
+	struct v2 min = v2(obstacle_p.x - half_size, obstacle_p.y - half_size);
+	struct v2 max = v2(obstacle_p.x + half_size, obstacle_p.y + half_size);
+
+	if (p.x > min.x && p.x < max.x && p.y > min.y && p.y < max.y) {
+		f32 d1 = fabsf(p.y - min.y) + 0.1f;
+		f32 d2 = fabsf(p.y - max.y) + 0.1f;
+		new_p->y -= d1 < d2 ? d1 : -d2;
+		return true;
+	}
+
+	/* NOTE(omid): A part that does not move can only be touching. */
+	struct v2 dp = sub_v2(*new_p, p);
+	if (dp.x < 0 || dp.x > 0 || dp.y < 0 || dp.y > 0) {
+		struct box_sweep sweep = sweep_point_against_box(p, dp, min, max);
+		if (sweep.hit) {
+			*new_p = add_v2(add_v2(p, scale_v2(dp, sweep.t)), sweep.normal);
+			return true;
+		}
+	}
+
+	if (new_p->x >= min.x && new_p->x <= max.x) {
+		if (new_p->y >= min.y - 1 && new_p->y <= min.y) {
+			new_p->y = min.y - 1.1f;
+			return true;
+		}
+		if (new_p->y >= max.y && new_p->y <= max.y + 1) {
+			new_p->y = max.y + 1.1f;
+			return true;
+		}
+	}
+
+	if (new_p->y >= min.y && new_p->y <= max.y) {
+		if (new_p->x >= min.x - 1 && new_p->x <= min.x) {
+			new_p->x = min.x - 1.1f;
+			return true;
+		}
+		if (new_p->x >= max.x && new_p->x <= max.x + 1) {
+			new_p->x = max.x + 1.1f;
+			return true;
+		}
+	}
+
+	return false;
 }
 
+struct box_obstacle {
+	struct v2 p;
+	f32 size;
+	b32 respond;
+};
+
+/* NOTE(omid): A narrowphase call as seen by collide_part_with_boxes, for
+   checking the kernel against the reference on recorded scenes. */
+struct narrowphase_test {
+	struct v2 obstacle_p;
+	struct v2 p;
+	struct v2 new_p;
+	struct v2 v;
+	f32 obstacle_size;
+	f32 size;
+};
+
+struct narrowphase_recording {
+	struct narrowphase_test *tests;
+	u32 count;
+	u32 capacity;
+};
+
+/* NOTE(omid): Only ever filled with a single worker. */
+static struct narrowphase_recording narrowphase_recording;
+
+/* NOTE(omid): One moving part against a run of obstacles, in order. An
+   obstacle that responds moves new_p on for the ones after it, the others
+   only report the touch. */
 static void
-draw_string(SDL_Renderer *renderer,
-            TTF_Font *font,
-            const char *text,
-            s32 x, s32 y,
-            enum text_align alignment,
-            struct color color)
+collide_part_with_boxes(struct v2 p, f32 size, struct v2 v, const struct box_obstacle *obstacles, u32 count, struct v2 *new_p, b32 *hits)
 {
-	SDL_Color sdl_color =  { color.r, color.g, color.b, color.a };
-	SDL_Surface *surface = TTF_RenderText_Solid(font, text, sdl_color);
-	SDL_Texture *texture = SDL_CreateTextureFromSurface(renderer, surface);
+	for (u32 i = 0; i < count; ++i) {
+		const struct box_obstacle *obstacle = obstacles + i;
+		struct narrowphase_recording *recording = &narrowphase_recording;
+		if (recording->count < recording->capacity) {
+			struct narrowphase_test *test = recording->tests + recording->count++;
+			test->obstacle_p = obstacle->p;
+			test->p = p;
+			test->new_p = *new_p;
+			test->v = v;
+			test->obstacle_size = obstacle->size;
+			test->size = size;
+		}
 
-	SDL_Rect rect;
-	rect.y = y;
-	rect.w = surface->w;
-	rect.h = surface->h;
-	switch (alignment) {
-	case TEXT_ALIGN_LEFT:
-		rect.x = x;
-		break;
-	case TEXT_ALIGN_CENTER:
-		rect.x = x - surface->w / 2;
-		break;
-	case TEXT_ALIGN_RIGHT:
-		rect.x = x - surface->w;
-		break;
+		struct v2 hit_p = *new_p;
+		hits[i] = collide_part_with_box(obstacle->p, obstacle->size, size, p, &hit_p);
+		if (hits[i] && obstacle->respond)
+			*new_p = hit_p;
 	}
-
-	SDL_RenderCopy(renderer, texture, 0, &rect);
-	SDL_FreeSurface(surface);
-	SDL_DestroyTexture(texture);
 }
 
-static void
-draw_string_f(SDL_Renderer *renderer, TTF_Font *font, s32 x, s32 y, enum text_align alignment, struct color color, const char *format, ...)
+static s32
+collision_grid_coordinate(f32 x, s32 cell_count)
 {
-	char buffer[4096];
-	
-	va_list args;
-	va_start(args, format);
-	#if defined(__clang__)
-#pragma clang diagnostic push
-#pragma clang diagnostic ignored "-Wformat-nonliteral"
-#endif
-	vsnprintf(buffer, ARRAY_COUNT(buffer), format, args);
-#if defined(__clang__)
-#pragma clang diagnostic pop
-#endif
+	f32 c = x / COLLISION_GRID_CELL_SIZE;
 
-	draw_string(renderer, font, buffer, x, y, alignment, color);
-	
-	va_end(args);
+	/* NOTE(omid): Written so that NaN ends up in the first cell. */
+	if (!(c >= 0))
+		return 0;
+	if (c >= (f32)cell_count)
+		return cell_count - 1;
+	return (s32)c;
 }
 
+static u32
+collision_grid_cell_of(struct v2 p)
+{
+	s32 x = collision_grid_coordinate(p.x, COLLISION_GRID_WIDTH);
+	s32 y = collision_grid_coordinate(p.y, COLLISION_GRID_HEIGHT);
+	return (u32)(y * COLLISION_GRID_WIDTH + x);
+}
 
 static void
-render_cell_(SDL_Renderer *renderer,
-	     u8 value, u8 alpha, s32 offset_x, s32 offset_y, s32 w, s32 h,
-	     b32 outline)
+collision_grid_clear(struct collision_grid *grid)
 {
-	struct color base_color = BASE_COLORS[value];
-	struct color light_color = LIGHT_COLORS[value];
-	struct color dark_color = DARK_COLORS[value];
+	memset(grid->first_in_cell, 0xFF, sizeof(grid->first_in_cell));
+	memset(grid->cell_of_slot, 0xFF, grid->slot_count * sizeof(u32));
+	grid->max_part_size = 0;
+}
 
-	base_color.a = alpha;
-	light_color.a = alpha;
-	dark_color.a = alpha;
-	
-	s32 edge = 4; // GRID_SIZE / 8;
+static void
+collision_grid_insert(struct collision_grid *grid, u32 slot, u32 cell)
+{
+	u32 first = grid->first_in_cell[cell];
+	grid->next_in_cell[slot] = first;
+	grid->prev_in_cell[slot] = COLLISION_GRID_NONE;
+	if (first != COLLISION_GRID_NONE)
+		grid->prev_in_cell[first] = slot;
+	grid->first_in_cell[cell] = slot;
+	grid->cell_of_slot[slot] = cell;
+}
 
-	s32 x = (s32)(round(offset_x - (w / 2.0)));
-	s32 y = (s32)(round(offset_y - (h / 2.0)));
-    
-	if (outline) {
-		draw_rect(renderer, x, y, w, h, base_color);
-		return;
-	}
+static void
+collision_grid_remove(struct collision_grid *grid, u32 slot)
+{
+	u32 cell = grid->cell_of_slot[slot];
+	u32 next = grid->next_in_cell[slot];
+	u32 prev = grid->prev_in_cell[slot];
 
-	fill_rect(renderer, x, y, w, h, base_color);
-	
-	edge = (s32)((f32)w * fabsf((f32)offset_x - WINDOW_WIDTH / 2) / WINDOW_WIDTH);
-	
-	if (offset_x > (WINDOW_WIDTH / 2)) {
-		fill_rect(renderer, x, y, edge, h, light_color);
-		fill_rect(renderer, x + w - edge, y, edge, h, dark_color);
-	} else {
-		fill_rect(renderer, x, y, edge, h, dark_color);
-		fill_rect(renderer, x + w - edge, y, edge, h, light_color);
-	}
+	if (prev != COLLISION_GRID_NONE)
+		grid->next_in_cell[prev] = next;
+	else
+		grid->first_in_cell[cell] = next;
 
-	edge = (s32)((f32)h * fabsf((f32)offset_y - WINDOW_HEIGHT / 2) / WINDOW_HEIGHT);
-		
-	if (offset_y > (WINDOW_HEIGHT / 2)) {
-		fill_rect(renderer, x, y, w, edge, light_color);
-		fill_rect(renderer, x, y + h - edge, w, edge, dark_color);
-	} else {
-		fill_rect(renderer, x, y, w, edge, dark_color);
-		fill_rect(renderer, x, y + h - edge, w, edge, light_color);
-	}
+	if (next != COLLISION_GRID_NONE)
+		grid->prev_in_cell[next] = prev;
 
-	
-#if 0	
-	fill_rect(renderer, x, y, w, h, dark_color);
-	fill_rect(renderer, x + edge, y,
-		  w - edge, h - edge, light_color);
-	fill_rect(renderer, x + edge, y + edge,
-		  w - edge * 2, h - edge * 2, base_color);
-#endif
+	grid->cell_of_slot[slot] = COLLISION_GRID_NONE;
 }
 
+/* NOTE(omid): Keep the grid in sync with a part that just moved. Parts spawned
+   after the grid was built are inserted here the first time they move. */
 static void
-render_cell(SDL_Renderer *renderer,
-	    u8 value, s32 offset_x, s32 offset_y, s32 w, s32 h,
-	    b32 outline)
+collision_grid_move(struct collision_grid *grid, u32 entity_index, u32 part_index, struct v2 p, u16 size)
 {
-	render_cell_(renderer, value, 0xFF, offset_x, offset_y, w, h, outline);
+	u32 slot = entity_index * MAX_ENTITY_PART_COUNT + part_index;
+	u32 cell = collision_grid_cell_of(p);
+	u32 old_cell = grid->cell_of_slot[slot];
+
+	if (old_cell == cell)
+		return;
+
+	if (old_cell != COLLISION_GRID_NONE)
+		collision_grid_remove(grid, slot);
+	collision_grid_insert(grid, slot, cell);
+
+	if (size > grid->max_part_size)
+		grid->max_part_size = size;
 }
 
 static void
-render_rect(SDL_Renderer *renderer, struct color color, s32 offset_x, s32 offset_y, s32 w, s32 h, b32 outline)
+build_collision_grid(struct game_state *game)
 {
-	s32 x = (s32)(round(offset_x - (w / 2.0)));
-	s32 y = (s32)(round(offset_y - (h / 2.0)));
-    
-	if (outline) {
-		draw_rect(renderer, x, y, w, h, color);
-		return;
+	struct collision_grid *grid = &game->collision_grid;
+	collision_grid_clear(grid);
+
+	for (u32 entity_index = 0; entity_index < game->entity_count; ++entity_index) {
+		const struct entity *entity = game->entities + entity_index;
+		struct part_span parts = get_part_span(game, entity);
+		for (u32 part_index = 0; part_index < entity->part_count; ++part_index)
+			collision_grid_move(grid, entity_index, part_index, parts.p[part_index], parts.size[part_index]);
 	}
-    
-	fill_rect(renderer, x, y, w, h, color); 
 }
 
+typedef void job_function(void *data, u32 worker_index, u32 chunk_index);
+
+/* NOTE(omid): The chunks of a run_jobs call are dealt out as one contiguous
+   range per worker. A worker takes chunks from the front of its own range
+   and, once that runs dry, steals from the ranges of the others. Each range
+   sits on its own cache line. */
+struct job_range {
+	SDL_atomic_t next;
+	s32 end;
+	u8 pad_[56];
+};
+
+struct job_worker {
+	struct job_pool *pool;
+	u32 index;
+	u32 pad_;
+};
+
+struct job_pool {
+	struct job_range ranges[MAX_WORKER_COUNT];
+	struct job_worker workers[MAX_WORKER_COUNT];
+	SDL_Thread *threads[MAX_WORKER_COUNT];
+	SDL_sem *start;
+	SDL_sem *done;
+
+	job_function *function;
+	void *data;
+
+	SDL_atomic_t quit;
+	/* NOTE(omid): Worker 0 is the thread calling run_jobs. */
+	u32 worker_count;
+};
+
+static struct job_pool job_pool;
+/* NOTE(omid): 0 picks one thread per core. */
+static u32 thread_count;
+
 static void
-fill_cell_(SDL_Renderer *renderer,
-	   u8 value, u8 alpha, s32 x, s32 y, s32 w, s32 h)
+run_job_chunks(struct job_pool *pool, u32 worker_index)
 {
-	render_cell_(renderer, value, alpha, x, y, w, h, 0);
+	for (u32 i = 0; i < pool->worker_count; ++i) {
+		struct job_range *range = pool->ranges + (worker_index + i) % pool->worker_count;
+		for (;;) {
+			s32 chunk_index = SDL_AtomicAdd(&range->next, 1);
+			if (chunk_index >= range->end)
+				break;
+			pool->function(pool->data, worker_index, (u32)chunk_index);
+		}
+	}
 }
 
-static void
-fill_cell(SDL_Renderer *renderer,
-          u8 value, s32 x, s32 y, s32 w, s32 h)
+static int
+job_worker_main(void *data)
 {
-	fill_cell_(renderer, value, 0xFF, x, y, w, h);
+	struct job_worker *worker = (struct job_worker *)data;
+	struct job_pool *pool = worker->pool;
+	for (;;) {
+		SDL_SemWait(pool->start);
+		if (SDL_AtomicGet(&pool->quit))
+			break;
+		run_job_chunks(pool, worker->index);
+		SDL_SemPost(pool->done);
+	}
+	return 0;
 }
 
+/* NOTE(omid): Calls function once for every chunk index below chunk_count,
+   spread over the workers, and returns when all of them are done. Which
+   worker runs a chunk changes from call to call, so a job only writes what
+   its chunk owns or what is kept per worker. */
 static void
-draw_cell(SDL_Renderer *renderer,
-          u8 value, s32 x, s32 y, s32 w, s32 h)
+run_jobs(struct job_pool *pool, u32 chunk_count, job_function *function, void *data)
 {
-	render_cell(renderer, value, x, y, w, h, 1);
+	if (pool->worker_count <= 1 || chunk_count <= 1) {
+		for (u32 chunk_index = 0; chunk_index < chunk_count; ++chunk_index)
+			function(data, 0, chunk_index);
+		return;
+	}
+
+	pool->function = function;
+	pool->data = data;
+	for (u32 worker_index = 0; worker_index < pool->worker_count; ++worker_index) {
+		struct job_range *range = pool->ranges + worker_index;
+		SDL_AtomicSet(&range->next, (s32)(chunk_count * worker_index / pool->worker_count));
+		range->end = (s32)(chunk_count * (worker_index + 1) / pool->worker_count);
+	}
+
+	for (u32 worker_index = 1; worker_index < pool->worker_count; ++worker_index)
+		SDL_SemPost(pool->start);
+	run_job_chunks(pool, 0);
+	for (u32 worker_index = 1; worker_index < pool->worker_count; ++worker_index)
+		SDL_SemWait(pool->done);
+}
+
+static u32
+default_thread_count(void)
+{
+#ifdef __EMSCRIPTEN__
+	return 1;
+#else
+	s32 cpu_count = SDL_GetCPUCount();
+	if (cpu_count < 1)
+		return 1;
+	if (cpu_count > MAX_WORKER_COUNT)
+		return MAX_WORKER_COUNT;
+	return (u32)cpu_count;
+#endif
 }
 
+/* NOTE(omid): Runs single threaded when threads can't be had. */
 static void
-special_fill_cell_(SDL_Renderer *renderer,
-		  u8 value, u8 alpha, s32 x, s32 y, s32 w, s32 h)
+init_job_pool(struct job_pool *pool, u32 count)
 {
-	if (w < 80) {
-		fill_cell_(renderer, value, alpha, x, y, w, h);
+	zero_memory(pool, sizeof(*pool));
+	pool->worker_count = 1;
+	if (count <= 1)
 		return;
-	} else if (w < 120) {
-		struct color c = BASE_COLORS[value];
-		c.a = alpha;
-		render_rect(renderer, c, x, y, w, h, false);	
-	} else {
-		struct color c = DARK_COLORS[value];
-		c.a = alpha;
-		render_rect(renderer, c, x, y, w, h, false);
+
+	pool->start = SDL_CreateSemaphore(0);
+	pool->done = SDL_CreateSemaphore(0);
+	if (!pool->start || !pool->done) {
+		printf("Could not create job semaphores: %s\n", SDL_GetError());
+		return;
+	}
+
+	for (u32 worker_index = 1; worker_index < count && worker_index < MAX_WORKER_COUNT; ++worker_index) {
+		struct job_worker *worker = pool->workers + worker_index;
+		worker->pool = pool;
+		worker->index = worker_index;
+		pool->threads[worker_index] = SDL_CreateThread(job_worker_main, "physics", worker);
+		if (!pool->threads[worker_index]) {
+			printf("Could not create worker thread: %s\n", SDL_GetError());
+			break;
+		}
+		++pool->worker_count;
 	}
 }
 
+static void
+shutdown_job_pool(struct job_pool *pool)
+{
+	SDL_AtomicSet(&pool->quit, 1);
+	for (u32 worker_index = 1; worker_index < pool->worker_count; ++worker_index)
+		SDL_SemPost(pool->start);
+	for (u32 worker_index = 1; worker_index < pool->worker_count; ++worker_index)
+		SDL_WaitThread(pool->threads[worker_index], 0);
+
+	if (pool->start)
+		SDL_DestroySemaphore(pool->start);
+	if (pool->done)
+		SDL_DestroySemaphore(pool->done);
+	zero_memory(pool, sizeof(*pool));
+	pool->worker_count = 1;
+}
+
+#define RENDER_BATCH_QUAD_COUNT 4096
+
+/* NOTE(omid): Coloured quads are collected here and submitted with a single
+   draw call per flush. Anything that is not a coloured quad (clears, text,
+   blend mode changes, presents) flushes first, so the draw order is kept.
+   SDL_RenderSetScale is emulated by scaling the vertices. Without
+   SDL_RenderGeometry, runs of equally coloured quads go through
+   SDL_RenderFillRectsF instead. */
+struct render_batch {
+#if SDL_VERSION_ATLEAST(2, 0, 18)
+	SDL_Vertex vertices[RENDER_BATCH_QUAD_COUNT * 4];
+	s32 indices[RENDER_BATCH_QUAD_COUNT * 6];
+#else
+	SDL_FRect rects[RENDER_BATCH_QUAD_COUNT];
+	struct color colors[RENDER_BATCH_QUAD_COUNT];
+#endif
+	SDL_Texture *texture;
+	u32 quad_count;
+	f32 scale;
+
+	u32 draw_call_count;
+	u32 last_frame_draw_call_count;
+	b32 indices_ready;
+	u32 pad_;
+};
+
+static struct render_batch render_batch;
+static b32 show_render_stats;
+
+
+enum profile_stage {
+	PROFILE_BEGIN_FRAME,
+	PROFILE_SCENARIO,
+	PROFILE_INPUT,
+	PROFILE_AI,
+	PROFILE_SPRINGS,
+	PROFILE_NEWTONIAN,
+	PROFILE_EVENTS,
+	PROFILE_AUDIO_UPDATE,
+	PROFILE_SORT,
+	PROFILE_RENDER_TUNNEL,
+	PROFILE_RENDER_SHADOWS,
+	PROFILE_RENDER_ENTITIES,
+	PROFILE_RENDER_LIGHTNING,
+	PROFILE_RENDER_TEXT,
+	PROFILE_RENDER_PRESENT,
+
+	PROFILE_STAGE_COUNT
+};
+
+static const char *profile_stage_names[PROFILE_STAGE_COUNT] = {
+	"begin_frame",
+	"scenario",
+	"input",
+	"ai",
+	"springs",
+	"newtonian",
+	"events",
+	"audio_update",
+	"sort",
+	"render_tunnel",
+	"render_shadows",
+	"render_entities",
+	"render_lightning",
+	"render_text",
+	"render_present",
+};
+
+#define PROFILE_FRAME_COUNT 512
+#define PROFILE_AUDIO_CALLBACK_COUNT 512
+#define PROFILE_STATS_FRAME_COUNT 120
 
+/* NOTE(omid): In performance counter ticks. begin is zero for a stage that
+   did not run that frame; a stage that runs more than once, as with
+   time_speed_up, adds up. */
+struct profile_sample {
+	u64 begin;
+	u64 duration;
+};
 
+struct profile_frame {
+	struct profile_sample stages[PROFILE_STAGE_COUNT];
+};
 
+struct profiler {
+	struct profile_frame frames[PROFILE_FRAME_COUNT];
+	/* NOTE(omid): Written by the audio thread only. */
+	struct profile_sample audio_callbacks[PROFILE_AUDIO_CALLBACK_COUNT];
+	SDL_atomic_t audio_callback_count;
 
+	/* NOTE(omid): Frames begun so far, the current one being
+	   frames[(frame_count - 1) % PROFILE_FRAME_COUNT]. */
+	u32 frame_count;
+	u64 epoch;
+};
 
+static struct profiler profiler;
+static b32 show_profiler;
+static const char *profile_csv_path;
+static const char *profile_trace_path;
 
+static int
+compare_f64(const void *a, const void *b)
+{
+	f64 x = *(const f64 *)a;
+	f64 y = *(const f64 *)b;
+	return (x > y) - (x < y);
+}
 
 static void
-end_level(struct game_state *game)
+profile_begin_frame(void)
 {
-	game->level_end_t = game->time;
-	
-	for (u32 i = 0; i < game->entity_count; ++i) {
-		struct entity *entity = game->entities + i;
-		if (entity->expiration_t > 0)
-			entity->expiration_t = game->level_end_t;
-	}
-	
-	
+	if (!profiler.epoch)
+		profiler.epoch = SDL_GetPerformanceCounter();
+
+	struct profile_frame *frame = profiler.frames + (profiler.frame_count++ % PROFILE_FRAME_COUNT);
+	ZERO_STRUCT(*frame);
 }
 
-static struct game_event *
-push_game_event(struct game_state *game)
+static u64
+profile_begin(void)
 {
-	assert(game->event_count < ARRAY_COUNT(game->events));
-	struct game_event *result = game->events + (game->event_count++);
-	ZERO_STRUCT(*result);
-	return result;
+	return SDL_GetPerformanceCounter();
 }
 
-static bool
-check_suspension(struct entity *e1, struct entity_part *p1, struct entity *e2, struct entity_part *p2)
+/* NOTE(omid): Returns the end time, so that consecutive stages can chain
+   off each other with one counter read. */
+static u64
+profile_end(enum profile_stage stage, u64 begin)
 {
-	bool result = !e1->suspended_for_frame && !p1->suspended_for_frame && !e2->suspended_for_frame && !p2->suspended_for_frame;
-	return result;
+	u64 end = SDL_GetPerformanceCounter();
+	if (!profiler.frame_count)
+		return end;
+
+	struct profile_sample *sample = profiler.frames[(profiler.frame_count - 1) % PROFILE_FRAME_COUNT].stages + stage;
+	if (!sample->begin)
+		sample->begin = begin;
+	sample->duration += end - begin;
+	return end;
 }
 
-static struct game_event *
-seed_touch_water(struct game_state *game, struct entity *seed, struct entity *water, struct entity_part *droplet)
+static void
+profile_audio_callback(u64 begin)
 {
-	struct game_event *e = push_game_event(game);
-	e->type = GAME_EVENT_SEED_TOUCH_WATER;
-	
-	seed->suspended_for_frame = true;
-	droplet->suspended_for_frame = true;
-	e->seed_touch_water.e1 = seed->index;
-	e->seed_touch_water.e2 = water->index;
-	e->seed_touch_water.p2 = droplet->index;
+	u64 end = SDL_GetPerformanceCounter();
+	u32 index = (u32)SDL_AtomicGet(&profiler.audio_callback_count);
 
-	return e;
+	struct profile_sample *sample = profiler.audio_callbacks + (index % PROFILE_AUDIO_CALLBACK_COUNT);
+	sample->begin = begin;
+	sample->duration = end - begin;
+	SDL_AtomicSet(&profiler.audio_callback_count, (s32)(index + 1));
 }
 
-static bool
-try_seed_touch_water(struct game_state *game, struct entity *e1, struct entity_part *p1, struct entity *e2, struct entity_part *p2)
+static void
+flush_render_batch(SDL_Renderer *renderer)
 {
-	if (!check_suspension(e1, p1, e2, p2))
-		return false;
-	
-	if ((e1->type & ENTITY_SEED) && (e2->type & ENTITY_WATER))
-		return seed_touch_water(game, e1, e2, p2);
-	else if ((e1->type & ENTITY_WATER) && (e2->type & ENTITY_SEED))
-		return seed_touch_water(game, e2, e1, p1);
-	else
-		return false;
-}
+	struct render_batch *batch = &render_batch;
+	if (!batch->quad_count)
+		return;
 
+#if SDL_VERSION_ATLEAST(2, 0, 18)
+	SDL_RenderGeometry(renderer, batch->texture, batch->vertices, (s32)batch->quad_count * 4, batch->indices, (s32)batch->quad_count * 6);
+	batch->draw_call_count++;
+#else
+	u32 run_begin = 0;
+	for (u32 i = 1; i <= batch->quad_count; ++i) {
+		struct color c = batch->colors[run_begin];
+		if (i < batch->quad_count && memcmp(batch->colors + i, &c, sizeof(c)) == 0)
+			continue;
 
-static struct game_event *
-worm_eat_food(struct game_state *game, struct entity *worm, struct entity *food, struct entity_part *part)
-{
-	struct game_event *e = push_game_event(game);
-	e->type = GAME_EVENT_WORM_EAT_FOOD;
+		SDL_SetRenderDrawColor(renderer, c.r, c.g, c.b, c.a);
+		SDL_RenderFillRectsF(renderer, batch->rects + run_begin, (s32)(i - run_begin));
+		batch->draw_call_count++;
+		run_begin = i;
+	}
+#endif
 
-	food->suspended_for_frame = true;
-	part->suspended_for_frame = true;
-	
-	e->worm_eat_food.e1 = worm->index;
-	e->worm_eat_food.e2 = food->index;
-	e->worm_eat_food.p2 = part->index;
-	return e;
+	batch->quad_count = 0;
 }
 
-static bool
-try_worm_eat_food(struct game_state *game, struct entity *e1, struct entity_part *p1, struct entity *e2, struct entity_part *p2)
+static void
+begin_render_batch(SDL_Renderer *renderer)
 {
-	if (!check_suspension(e1, p1, e2, p2))
-		return false;
-	
-	if (e1->type == ENTITY_WORM && (e2->type & ENTITY_FOOD) > 0 && p1->index == 0)
-		return worm_eat_food(game, e1, e2, p2);
-	else if ((e1->type & ENTITY_FOOD) > 0 && e2->type == ENTITY_WORM && p2->index == 0)
-		return worm_eat_food(game, e2, e1, p1);
-	else
-		return false;
+	struct render_batch *batch = &render_batch;
+	batch->quad_count = 0;
+	batch->scale = 1;
+	batch->draw_call_count = 0;
+
+#if SDL_VERSION_ATLEAST(2, 0, 18)
+	if (!batch->indices_ready) {
+		for (s32 i = 0; i < RENDER_BATCH_QUAD_COUNT; ++i) {
+			s32 *index = batch->indices + i * 6;
+			index[0] = i * 4 + 0;
+			index[1] = i * 4 + 1;
+			index[2] = i * 4 + 2;
+			index[3] = i * 4 + 2;
+			index[4] = i * 4 + 3;
+			index[5] = i * 4 + 0;
+		}
+		batch->indices_ready = true;
+	}
+#endif
+
+	SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
+	SDL_RenderClear(renderer);
+	batch->draw_call_count++;
 }
 
-static struct game_event *
-water_eater_eat_water(struct game_state *game, struct entity *water_eater, struct entity *water, struct entity_part *droplet)
+static void
+end_render_batch(SDL_Renderer *renderer)
 {
-	struct game_event *e = push_game_event(game);
-	e->type = GAME_EVENT_WATER_EATER_EAT_WATER;
-	
-	water_eater->suspended_for_frame = true;
-	droplet->suspended_for_frame = true;
-
-	e->water_eater_eat_water.e1 = water_eater->index;
-	e->water_eater_eat_water.e2 = water->index;
-	e->water_eater_eat_water.p2 = droplet->index;
-	
-	return e;
+	struct render_batch *batch = &render_batch;
+	flush_render_batch(renderer);
+	batch->last_frame_draw_call_count = batch->draw_call_count;
 }
 
-static bool
-try_water_eater_eat_water(struct game_state *game, struct entity *e1, struct entity_part *p1, struct entity *e2, struct entity_part *p2)
+static void
+set_render_blend_mode(SDL_Renderer *renderer, SDL_BlendMode blend_mode)
 {
-	if (!check_suspension(e1, p1, e2, p2))
-		return false;
-
-	if (e1->type == ENTITY_WATER_EATER && (e2->type & ENTITY_FOOD) && p1->index == 0)
-		return water_eater_eat_water(game, e1, e2, p2);
-	else if ((e1->type & ENTITY_FOOD) && e2->type == ENTITY_WATER_EATER && p2->index == 0)
-		return water_eater_eat_water(game, e2, e1, p1);
-	else
-		return false;	
+	flush_render_batch(renderer);
+	SDL_SetRenderDrawBlendMode(renderer, blend_mode);
 }
 
+static void
+set_render_scale(f32 scale)
+{
+	render_batch.scale = scale;
+}
 
-static struct game_event *
-gem_touch_socket(struct game_state *game, struct entity *gem, struct entity *socket, struct entity_part *socket_part) {
-	struct game_event *e = push_game_event(game);
-	e->type = GAME_EVENT_GEM_TOUCH_SOCKET;
+#if SDL_VERSION_ATLEAST(2, 0, 18)
+static void
+push_render_quad_(SDL_Renderer *renderer, SDL_Texture *texture,
+                  f32 x0, f32 y0, f32 x1, f32 y1,
+                  f32 u0, f32 v0, f32 u1, f32 v1,
+                  struct color color)
+{
+	struct render_batch *batch = &render_batch;
+	if (batch->texture != texture) {
+		flush_render_batch(renderer);
+		batch->texture = texture;
+	}
 
-	gem->suspended_for_frame = true;
-	socket->suspended_for_frame = true;
+	if (batch->quad_count == RENDER_BATCH_QUAD_COUNT)
+		flush_render_batch(renderer);
+
+	x0 *= batch->scale;
+	y0 *= batch->scale;
+	x1 *= batch->scale;
+	y1 *= batch->scale;
+
+	SDL_Color c = { color.r, color.g, color.b, color.a };
+	SDL_Vertex *v = batch->vertices + batch->quad_count * 4;
+	v[0].position.x = x0;
+	v[0].position.y = y0;
+	v[0].tex_coord.x = u0;
+	v[0].tex_coord.y = v0;
+	v[1].position.x = x1;
+	v[1].position.y = y0;
+	v[1].tex_coord.x = u1;
+	v[1].tex_coord.y = v0;
+	v[2].position.x = x1;
+	v[2].position.y = y1;
+	v[2].tex_coord.x = u1;
+	v[2].tex_coord.y = v1;
+	v[3].position.x = x0;
+	v[3].position.y = y1;
+	v[3].tex_coord.x = u0;
+	v[3].tex_coord.y = v1;
+	for (u32 i = 0; i < 4; ++i)
+		v[i].color = c;
+
+	batch->quad_count++;
+}
+#endif
 
-	e->gem_touch_socket.e1 = gem->index;
-	e->gem_touch_socket.e2 = socket->index;
-	e->gem_touch_socket.p2 = socket_part->index;
+static void
+push_render_quad(SDL_Renderer *renderer, s32 x, s32 y, s32 width, s32 height, struct color color)
+{
+	if (width <= 0 || height <= 0)
+		return;
 
-	return e;
+#if SDL_VERSION_ATLEAST(2, 0, 18)
+	push_render_quad_(renderer, 0, (f32)x, (f32)y, (f32)(x + width), (f32)(y + height), 0, 0, 0, 0, color);
+#else
+	struct render_batch *batch = &render_batch;
+	if (batch->quad_count == RENDER_BATCH_QUAD_COUNT)
+		flush_render_batch(renderer);
+
+	SDL_FRect *rect = batch->rects + batch->quad_count;
+	rect->x = (f32)x * batch->scale;
+	rect->y = (f32)y * batch->scale;
+	rect->w = (f32)(x + width) * batch->scale - rect->x;
+	rect->h = (f32)(y + height) * batch->scale - rect->y;
+	batch->colors[batch->quad_count] = color;
+	batch->quad_count++;
+#endif
 }
 
-
-static bool
-try_gem_touch_socket(struct game_state *game, struct entity *e1, struct entity_part *p1, struct entity *e2, struct entity_part *p2)
+static void
+fill_rect(SDL_Renderer *renderer, s32 x, s32 y, s32 width, s32 height, struct color color)
 {
-	if (!check_suspension(e1, p1, e2, p2))
-		return false;
+	push_render_quad(renderer, x, y, width, height, color);
+}
 
-	if ((e1->type & ENTITY_GEM) && (e2->type & ENTITY_SOCKET) && p1->index == 0)
-		return gem_touch_socket(game, e1, e2, p2);
-	else if ((e1->type & ENTITY_SOCKET) && (e2->type & ENTITY_GEM) && p2->index == 0)
-		return gem_touch_socket(game, e2, e1, p1);
-	else
-		return false;	
+static void
+draw_rect(SDL_Renderer *renderer, s32 x, s32 y, s32 width, s32 height, struct color color)
+{
+	/* NOTE(omid): Same pixels as SDL_RenderDrawRect, as four one pixel wide quads. */
+	push_render_quad(renderer, x, y, width, 1, color);
+	if (height > 1)
+		push_render_quad(renderer, x, y + height - 1, width, 1, color);
+	push_render_quad(renderer, x, y + 1, 1, height - 2, color);
+	if (width > 1)
+		push_render_quad(renderer, x + width - 1, y + 1, 1, height - 2, color);
 }
 
+#define GLYPH_ATLAS_FIRST_CHAR ' '
+#define GLYPH_ATLAS_LAST_CHAR '~'
+#define GLYPH_ATLAS_WIDTH 512
 
+struct glyph {
+	s16 x, y;
+	s16 w, h;
+	s16 advance;
+	s16 pad_;
+};
 
-static struct entity *
-push_entity(struct game_state *game)
+struct glyph_atlas {
+	SDL_Texture *texture;
+	s32 width, height;
+	u32 pad_;
+	struct glyph glyphs[GLYPH_ATLAS_LAST_CHAR - GLYPH_ATLAS_FIRST_CHAR + 1];
+};
+
+static struct glyph *
+get_glyph(struct glyph_atlas *atlas, char c)
 {
-	u32 index = game->entity_count++;
-	struct entity *result = game->entities + index;
-	ZERO_STRUCT(*result);
-	result->id = ++game->entity_id_seq;
-	result->index = index;
-	result->seed = (u32)(rand());
-	return result;
+	if (c < GLYPH_ATLAS_FIRST_CHAR || c > GLYPH_ATLAS_LAST_CHAR)
+		c = '?';
+	return atlas->glyphs + (c - GLYPH_ATLAS_FIRST_CHAR);
 }
 
-static struct entity_part *
-push_entity_part_(struct entity *entity, u16 parent_index)
+/* NOTE(omid): Rasterizes every printable ASCII glyph once, in white, so that
+   text can be drawn as tinted quads without touching SDL_ttf per frame. */
+static b32
+build_glyph_atlas(struct glyph_atlas *atlas, SDL_Renderer *renderer, TTF_Font *font)
 {
-	assert(entity->part_count < ARRAY_COUNT(entity->parts));
-	u16 index = entity->part_count++;
-	struct entity_part *result = entity->parts + index;
-	ZERO_STRUCT(*result);
-	result->index = index;
-	result->p = v2(WINDOW_WIDTH / 2, WINDOW_HEIGHT / 2);
-	result->parent_index = parent_index;
+	ZERO_STRUCT(*atlas);
+
+	s32 pen_x = 0, pen_y = 0, row_height = 0;
+	for (char c = GLYPH_ATLAS_FIRST_CHAR; c <= GLYPH_ATLAS_LAST_CHAR; ++c) {
+		char text[2] = { c, 0 };
+		struct glyph *glyph = get_glyph(atlas, c);
+
+		s32 w = 0, h = 0, advance = 0;
+		TTF_SizeText(font, text, &w, &h);
+		if (TTF_GlyphMetrics(font, (u16)c, 0, 0, 0, 0, &advance) < 0)
+			advance = w;
+
+		if (pen_x + w > GLYPH_ATLAS_WIDTH) {
+			pen_x = 0;
+			pen_y += row_height + 1;
+			row_height = 0;
+		}
 
-	if (parent_index != index)
-		result->depth = entity->parts[parent_index].depth + 1;
-	
-	return result;
-}
+		glyph->x = (s16)pen_x;
+		glyph->y = (s16)pen_y;
+		glyph->w = (s16)w;
+		glyph->h = (s16)h;
+		glyph->advance = (s16)advance;
 
-static struct entity_part *
-push_entity_part(struct entity *entity, u16 length, u16 size, u16 color, u16 parent_index)
-{
-	struct entity_part *p = push_entity_part_(entity, parent_index);
-	p->length = length;
-	p->size = size;
-	p->render_size = p->size;
-	p->mass = p->size * p->size;
-	p->color = color;	
-	return p;
-}
+		pen_x += w + 1;
+		if (h > row_height)
+			row_height = h;
+	}
 
+	atlas->width = GLYPH_ATLAS_WIDTH;
+	atlas->height = pen_y + row_height;
 
-static void
-add_squid_leg(struct entity *entity, u16 parent_index, u16 color, u16 length, u16 spacing, u16 size, f32 stiffness)
-{
-	struct entity_part *p;
+	SDL_Surface *surface = SDL_CreateRGBSurfaceWithFormat(0, atlas->width, atlas->height, 32, SDL_PIXELFORMAT_RGBA32);
+	if (!surface)
+		return false;
+	SDL_FillRect(surface, 0, 0);
 
-	for (u16 i = 0; i < length; ++i) {
-		p = push_entity_part(entity, spacing, size - i, color, parent_index);
-		p->stiffness = stiffness;
-		parent_index = p->index;
-	}
-	
-	/* p = add_part(entity); */
-	/* p->length = 25; */
-	/* p->size = 25; */
-	/* p->color = 2; */
-	/* p->p = v2(-40, 20); */
-	/* p->parent_index = parent_index; */
-		
-	/* parent_index = p->index; */
+	SDL_Color white = { 0xFF, 0xFF, 0xFF, 0xFF };
+	for (char c = GLYPH_ATLAS_FIRST_CHAR; c <= GLYPH_ATLAS_LAST_CHAR; ++c) {
+		char text[2] = { c, 0 };
+		struct glyph *glyph = get_glyph(atlas, c);
 
-	/* p = add_part(entity); */
-	/* p->length = 25; */
-	/* p->size = 20; */
-	/* p->color = 4; */
-	/* p->parent_index = parent_index; */
+		SDL_Surface *glyph_surface = TTF_RenderText_Solid(font, text, white);
+		if (!glyph_surface)
+			continue;
 
-	/* parent_index = p->index; */
+		SDL_Rect dest = { glyph->x, glyph->y, glyph->w, glyph->h };
+		SDL_SetSurfaceBlendMode(glyph_surface, SDL_BLENDMODE_NONE);
+		SDL_BlitSurface(glyph_surface, 0, surface, &dest);
+		SDL_FreeSurface(glyph_surface);
+	}
 
-	/* p = add_part(entity); */
-	/* p->length = 25; */
-	/* p->size = 20; */
-	/* p->color = 5; */
-	/* p->parent_index = parent_index; */
+	atlas->texture = SDL_CreateTextureFromSurface(renderer, surface);
+	SDL_FreeSurface(surface);
+	if (!atlas->texture)
+		return false;
 
-	/* parent_index = p->index; */
+	SDL_SetTextureBlendMode(atlas->texture, SDL_BLENDMODE_BLEND);
+	return true;
+}
 
-	/* p = add_part(entity); */
-	/* p->length = 25; */
-	/* p->size = 20; */
-	/* p->color = 6; */
-	/* p->parent_index = parent_index; */
+static void
+destroy_glyph_atlas(struct glyph_atlas *atlas)
+{
+	if (atlas->texture)
+		SDL_DestroyTexture(atlas->texture);
+	ZERO_STRUCT(*atlas);
 }
 
-static struct entity *
-init_socket(struct entity *entity)
+static void
+draw_string(SDL_Renderer *renderer,
+            struct glyph_atlas *atlas,
+            const char *text,
+            s32 x, s32 y,
+            enum text_align alignment,
+            struct color color)
 {
-	entity->type = ENTITY_SOCKET;
-	struct entity_part *p;
-	p = push_entity_part(entity, 0, 40, 0, 0);
+	if (!atlas->texture)
+		return;
 
-	/* p = push_entity_part(entity, 0, 10, 80, 0); */
-	/* p->passthrough = true; */
-	/* p->render_size = 0; */
-	
-	/* entity->fixed = true; */
-	/* entity->passthrough = true; */
-	return entity;	
+	s32 width = 0;
+	for (const char *c = text; *c; ++c)
+		width += get_glyph(atlas, *c)->advance;
+
+	switch (alignment) {
+	case TEXT_ALIGN_LEFT:
+		break;
+	case TEXT_ALIGN_CENTER:
+		x -= width / 2;
+		break;
+	case TEXT_ALIGN_RIGHT:
+		x -= width;
+		break;
+	}
+
+#if SDL_VERSION_ATLEAST(2, 0, 18)
+	f32 inv_w = 1.0f / (f32)atlas->width;
+	f32 inv_h = 1.0f / (f32)atlas->height;
+	for (const char *c = text; *c; ++c) {
+		struct glyph *glyph = get_glyph(atlas, *c);
+		if (*c != ' ')
+			push_render_quad_(renderer, atlas->texture,
+			                  (f32)x, (f32)y, (f32)(x + glyph->w), (f32)(y + glyph->h),
+			                  (f32)glyph->x * inv_w, (f32)glyph->y * inv_h,
+			                  (f32)(glyph->x + glyph->w) * inv_w, (f32)(glyph->y + glyph->h) * inv_h,
+			                  color);
+		x += glyph->advance;
+	}
+#else
+	/* NOTE(omid): No textured geometry before 2.0.18, copy glyph by glyph. */
+	flush_render_batch(renderer);
+	SDL_SetTextureColorMod(atlas->texture, color.r, color.g, color.b);
+	SDL_SetTextureAlphaMod(atlas->texture, color.a);
+	f32 scale = render_batch.scale;
+	for (const char *c = text; *c; ++c) {
+		struct glyph *glyph = get_glyph(atlas, *c);
+		if (*c != ' ') {
+			SDL_Rect src = { glyph->x, glyph->y, glyph->w, glyph->h };
+			SDL_Rect dest;
+			dest.x = (s32)((f32)x * scale);
+			dest.y = (s32)((f32)y * scale);
+			dest.w = (s32)((f32)(x + glyph->w) * scale) - dest.x;
+			dest.h = (s32)((f32)(y + glyph->h) * scale) - dest.y;
+			SDL_RenderCopy(renderer, atlas->texture, &src, &dest);
+			render_batch.draw_call_count++;
+		}
+		x += glyph->advance;
+	}
+#endif
 }
 
-static struct entity *
-init_seed(struct entity *entity)
+static void
+draw_string_f(SDL_Renderer *renderer, struct glyph_atlas *font, s32 x, s32 y, enum text_align alignment, struct color color, const char *format, ...)
 {
-	entity->type = (ENTITY_FOOD | ENTITY_SEED);
-	struct entity_part *p;
-	p = push_entity_part(entity, 0, 25, 2, 0);
-	p->content_value = 8;
-	return entity;
+	char buffer[4096];
+	
+	va_list args;
+	va_start(args, format);
+	#if defined(__clang__)
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wformat-nonliteral"
+#endif
+	vsnprintf(buffer, ARRAY_COUNT(buffer), format, args);
+#if defined(__clang__)
+#pragma clang diagnostic pop
+#endif
+
+	draw_string(renderer, font, buffer, x, y, alignment, color);
+	
+	va_end(args);
 }
 
-static struct entity *
-init_liquid(struct entity *entity, u32 type, u8 color, u16 count)
+
+static void
+render_cell_(SDL_Renderer *renderer,
+	     u8 value, u8 alpha, s32 offset_x, s32 offset_y, s32 w, s32 h,
+	     b32 outline)
 {
-	entity->type = type;
+	struct color base_color = BASE_COLORS[value];
+	struct color light_color = LIGHT_COLORS[value];
+	struct color dark_color = DARK_COLORS[value];
 
-	struct entity_part *p;
-	p = push_entity_part(entity, 0, 10, color, 0);
-	p->render_size = 20;
-	p->max_alpha = 0xa0;
+	base_color.a = alpha;
+	light_color.a = alpha;
+	dark_color.a = alpha;
+	
+	s32 edge = 4; // GRID_SIZE / 8;
 
-	for (u32 i = 0; i < count; ++i) {
-		p = push_entity_part(entity, 20, 10, color, 0);
-		p->render_size = 20;
-		p->max_alpha = 0xa0;
-		p->p = add_v2(entity->parts[0].p, v2(20 * cosf((f32)i * 2 * 3.14f / 8), 20 * sinf((f32)i * 2 * 3.14f / 8)));
-		p->content_value = 0;
+	s32 x = (s32)(round(offset_x - (w / 2.0)));
+	s32 y = (s32)(round(offset_y - (h / 2.0)));
+    
+	if (outline) {
+		draw_rect(renderer, x, y, w, h, base_color);
+		return;
 	}
 
-	return entity;
-}
+	fill_rect(renderer, x, y, w, h, base_color);
+	
+	edge = (s32)((f32)w * fabsf((f32)offset_x - WINDOW_WIDTH / 2) / WINDOW_WIDTH);
+	
+	if (offset_x > (WINDOW_WIDTH / 2)) {
+		fill_rect(renderer, x, y, edge, h, light_color);
+		fill_rect(renderer, x + w - edge, y, edge, h, dark_color);
+	} else {
+		fill_rect(renderer, x, y, edge, h, dark_color);
+		fill_rect(renderer, x + w - edge, y, edge, h, light_color);
+	}
 
+	edge = (s32)((f32)h * fabsf((f32)offset_y - WINDOW_HEIGHT / 2) / WINDOW_HEIGHT);
+		
+	if (offset_y > (WINDOW_HEIGHT / 2)) {
+		fill_rect(renderer, x, y, w, edge, light_color);
+		fill_rect(renderer, x, y + h - edge, w, edge, dark_color);
+	} else {
+		fill_rect(renderer, x, y, w, edge, dark_color);
+		fill_rect(renderer, x, y + h - edge, w, edge, light_color);
+	}
 
-static struct entity *
-init_water(struct entity *entity, u16 count)
-{
-	return init_liquid(entity, (ENTITY_FOOD | ENTITY_WATER), 8, count);
+	
+#if 0	
+	fill_rect(renderer, x, y, w, h, dark_color);
+	fill_rect(renderer, x + edge, y,
+		  w - edge, h - edge, light_color);
+	fill_rect(renderer, x + edge, y + edge,
+		  w - edge * 2, h - edge * 2, base_color);
+#endif
 }
 
-static struct entity *
-init_slime(struct entity *entity, u16 count)
+static void
+render_cell(SDL_Renderer *renderer,
+	    u8 value, s32 offset_x, s32 offset_y, s32 w, s32 h,
+	    b32 outline)
 {
-	return init_liquid(entity, (ENTITY_FOOD | ENTITY_WATER), 4, count);
+	render_cell_(renderer, value, 0xFF, offset_x, offset_y, w, h, outline);
 }
 
-static struct entity *
-init_food(struct entity *entity)
+static void
+render_rect(SDL_Renderer *renderer, struct color color, s32 offset_x, s32 offset_y, s32 w, s32 h, b32 outline)
 {
-	entity->type = ENTITY_FOOD;
-	entity->part_count = 0;
-
-	struct entity_part *p;
-	p = push_entity_part(entity, 0, 25, 4, 0);
-	p->content_value = 16;
+	s32 x = (s32)(round(offset_x - (w / 2.0)));
+	s32 y = (s32)(round(offset_y - (h / 2.0)));
+    
+	if (outline) {
+		draw_rect(renderer, x, y, w, h, color);
+		return;
+	}
+    
+	fill_rect(renderer, x, y, w, h, color); 
+}
 
-	return entity;
+static void
+fill_cell_(SDL_Renderer *renderer,
+	   u8 value, u8 alpha, s32 x, s32 y, s32 w, s32 h)
+{
+	render_cell_(renderer, value, alpha, x, y, w, h, 0);
 }
 
-static struct entity *
-init_gem(struct entity *entity, u8 color)
+static void
+fill_cell(SDL_Renderer *renderer,
+          u8 value, s32 x, s32 y, s32 w, s32 h)
 {
-	entity->type = ENTITY_GEM;
-	struct entity_part *p;
-	p = push_entity_part(entity, 0, 25, color, 0);
-	return entity;
+	fill_cell_(renderer, value, 0xFF, x, y, w, h);
 }
 
+static void
+draw_cell(SDL_Renderer *renderer,
+          u8 value, s32 x, s32 y, s32 w, s32 h)
+{
+	render_cell(renderer, value, x, y, w, h, 1);
+}
 
 static void
-push_worm_tail(struct entity *entity)
+special_fill_cell_(SDL_Renderer *renderer,
+		  u8 value, u8 alpha, s32 x, s32 y, s32 w, s32 h)
 {
-	if (entity->part_count >= ARRAY_COUNT(entity->parts))
+	if (w < 80) {
+		fill_cell_(renderer, value, alpha, x, y, w, h);
 		return;
-
-	u16 parent_index = entity->part_count ? (entity->part_count - 1) : 0;
-	
-	struct entity_part *p;
-	p = push_entity_part(entity, 25, (u16)(40 - entity->part_count), 2, parent_index);
-	p->p = entity->parts[p->index - 1].p;
+	} else if (w < 120) {
+		struct color c = BASE_COLORS[value];
+		c.a = alpha;
+		render_rect(renderer, c, x, y, w, h, false);	
+	} else {
+		struct color c = DARK_COLORS[value];
+		c.a = alpha;
+		render_rect(renderer, c, x, y, w, h, false);
+	}
 }
 
-static struct entity *
-init_worm(struct entity *entity)
-{
-	entity->type = ENTITY_WORM;
-	entity->part_count = 0;
 
-	struct entity_part *p;
-	p = push_entity_part(entity, 0, 40, 2, 0);
 
-	for (u32 i = 1; i < 2; ++i)
-		push_worm_tail(entity);
 
-	return entity;
-}
 
-static struct entity *
-init_water_eater(struct entity *entity)
-{
-	entity->type = ENTITY_WATER_EATER;
-	entity->part_count = 0;
-	entity->internal_collisions = true;
 
-	struct entity_part *p;
-	p = push_entity_part(entity, 0, 25, 5, 0);
-	p->mass = 50 * 50;
 
-	struct entity_part *l1;
-	struct entity_part *l2;
-	l1 = push_entity_part(entity, 25, 20, 2, 0);
-	l2 = push_entity_part(entity, 25, 20, 2, 0);
-	l1->internal_collisions = l2->internal_collisions = true;
-	l1->stiffness = 2;
-	l2->stiffness = 2;
-	l1->render_size = l2->render_size = 15;
 
-	add_squid_leg(entity, l1->index, 7, 4, 30, 20, 2);
-	add_squid_leg(entity, l2->index, 7, 4, 30, 20, 2);
+static void
+end_level(struct game_state *game)
+{
+	game->level_end_t = game->time;
+	
+	for (u32 i = 0; i < game->entity_count; ++i) {
+		struct entity *entity = game->entities + i;
+		if (entity->expiration_t > 0)
+			entity->expiration_t = game->level_end_t;
+	}
+	
+	
+}
 
-	return entity;
+/* NOTE(omid): Every event suspends a part or an entity that can then take
+   part in no other event until the next step, so a step never has more
+   events than there are parts and entities. */
+static u32
+frame_arena_size(u32 max_entities)
+{
+	u32 block_count = max_entities * (MAX_ENTITY_PART_COUNT + 1) / GAME_EVENT_BLOCK_SIZE + GAME_EVENT_TYPE_COUNT;
+	return ARENA_ARRAY_SIZE(struct game_event_block, block_count);
+}
+
+static void
+clear_game_events(struct game_state *game)
+{
+	game->frame_arena.used = 0;
+	for (u32 type = 0; type < GAME_EVENT_TYPE_COUNT; ++type) {
+		struct game_event_bucket *bucket = game->events + type;
+		bucket->first = 0;
+		bucket->last = 0;
+		bucket->count = 0;
+	}
+}
+
+static struct game_event *
+push_game_event(struct game_state *game, enum game_event_type type)
+{
+	struct game_event_bucket *bucket = game->events + type;
+	struct game_event_block *block = bucket->last;
+	if (!block || block->count == GAME_EVENT_BLOCK_SIZE) {
+		block = PUSH_ARRAY(&game->frame_arena, struct game_event_block, 1);
+		block->next = 0;
+		block->count = 0;
+		if (bucket->last)
+			bucket->last->next = block;
+		else
+			bucket->first = block;
+		bucket->last = block;
+	}
+
+	struct game_event *result = block->events + block->count++;
+	ZERO_STRUCT(*result);
+	result->type = type;
+	++bucket->count;
+	++game->event_totals[type];
+	return result;
+}
+
+static bool
+check_suspension(struct entity *e1, struct entity_part *p1, struct entity *e2, struct entity_part *p2)
+{
+	bool result = !e1->suspended_for_frame && !p1->suspended_for_frame && !e2->suspended_for_frame && !p2->suspended_for_frame;
+	return result;
+}
+
+static struct game_event *
+seed_touch_water(struct game_state *game, struct entity *seed, struct entity *water, struct entity_part *droplet)
+{
+	struct game_event *e = push_game_event(game, GAME_EVENT_SEED_TOUCH_WATER);
+	
+	seed->suspended_for_frame = true;
+	droplet->suspended_for_frame = true;
+	e->seed_touch_water.e1 = seed->index;
+	e->seed_touch_water.e2 = water->index;
+	e->seed_touch_water.p2 = droplet->index;
+
+	return e;
+}
+
+
+
+static struct game_event *
+worm_eat_food(struct game_state *game, struct entity *worm, struct entity *food, struct entity_part *part)
+{
+	struct game_event *e = push_game_event(game, GAME_EVENT_WORM_EAT_FOOD);
+
+	food->suspended_for_frame = true;
+	part->suspended_for_frame = true;
+	
+	e->worm_eat_food.e1 = worm->index;
+	e->worm_eat_food.e2 = food->index;
+	e->worm_eat_food.p2 = part->index;
+	return e;
+}
+
+
+static struct game_event *
+water_eater_eat_water(struct game_state *game, struct entity *water_eater, struct entity *water, struct entity_part *droplet)
+{
+	struct game_event *e = push_game_event(game, GAME_EVENT_WATER_EATER_EAT_WATER);
+	
+	water_eater->suspended_for_frame = true;
+	droplet->suspended_for_frame = true;
+
+	e->water_eater_eat_water.e1 = water_eater->index;
+	e->water_eater_eat_water.e2 = water->index;
+	e->water_eater_eat_water.p2 = droplet->index;
+	
+	return e;
+}
+
+
+
+static struct game_event *
+gem_touch_socket(struct game_state *game, struct entity *gem, struct entity *socket, struct entity_part *socket_part) {
+	struct game_event *e = push_game_event(game, GAME_EVENT_GEM_TOUCH_SOCKET);
+
+	gem->suspended_for_frame = true;
+	socket->suspended_for_frame = true;
+
+	e->gem_touch_socket.e1 = gem->index;
+	e->gem_touch_socket.e2 = socket->index;
+	e->gem_touch_socket.p2 = socket_part->index;
+
+	return e;
+}
+
+typedef struct game_event *interaction_function(struct game_state *game, struct entity *e1, struct entity *e2, struct entity_part *p2);
+
+static interaction_function *const interaction_functions[GAME_EVENT_TYPE_COUNT] = {
+	[GAME_EVENT_SEED_TOUCH_WATER] = seed_touch_water,
+	[GAME_EVENT_WORM_EAT_FOOD] = worm_eat_food,
+	[GAME_EVENT_WATER_EATER_EAT_WATER] = water_eater_eat_water,
+	[GAME_EVENT_GEM_TOUCH_SOCKET] = gem_touch_socket,
+};
+
+/* NOTE(omid): None of the entity types in the game has more than one of
+   these roles. */
+static enum collision_class
+collision_class_of(u32 type, u32 part_index)
+{
+	if (type & ENTITY_SEED)
+		return COLLISION_CLASS_SEED;
+	if (type & ENTITY_WATER)
+		return COLLISION_CLASS_WATER;
+	if (type & ENTITY_FOOD)
+		return COLLISION_CLASS_FOOD;
+	if (part_index == 0) {
+		if (type == ENTITY_WORM)
+			return COLLISION_CLASS_WORM_HEAD;
+		if (type == ENTITY_WATER_EATER)
+			return COLLISION_CLASS_WATER_EATER_HEAD;
+		if (type & ENTITY_GEM)
+			return COLLISION_CLASS_GEM_HEAD;
+	}
+	if (type & ENTITY_SOCKET)
+		return COLLISION_CLASS_SOCKET;
+	return COLLISION_CLASS_NONE;
+}
+
+static enum collision_class
+collision_class_of_layer(u8 layer)
+{
+	u32 class_bits = layer & ~(u32)COLLISION_LAYER_SOLID;
+	return class_bits ? (enum collision_class)__builtin_ctz(class_bits) : COLLISION_CLASS_NONE;
+}
+
+/* NOTE(omid): Has to be called again whenever the entity type, the part index
+   or a passthrough flag changes. A part whose mask shares no bit with the
+   layer of another part neither pushes nor interacts with it. */
+static void
+update_part_collision_bits(const struct entity *entity, struct entity_part *part)
+{
+	enum collision_class collision_class = collision_class_of(entity->type, part->index);
+	bool solid = !entity->passthrough && !part->passthrough;
+
+	u32 layer = COLLISION_LAYER(collision_class) & ~(u32)COLLISION_LAYER_SOLID;
+	u32 mask = 0;
+	if (solid) {
+		layer |= COLLISION_LAYER_SOLID;
+		mask |= COLLISION_LAYER_SOLID;
+	}
+	for (u32 other_class = 1; other_class < COLLISION_CLASS_COUNT; ++other_class)
+		if (collision_interactions[collision_class][other_class])
+			mask |= COLLISION_LAYER(other_class);
+
+	part->collision_layer = (u8)layer;
+	part->collision_mask = (u8)mask;
+}
+
+static void
+seed_game_random(struct game_state *game, u64 seed)
+{
+	seed_random_series(&game->random, seed);
+	seed_random_lanes(&game->audio_random, seed ^ 0xA0D10A0D10A0D10AULL);
+}
+
+/* NOTE(omid): Arena bytes grow_entity_storage takes for capacity entities,
+   keep the two in sync. */
+static u32
+entity_storage_size(u32 capacity)
+{
+	u32 slot_count = capacity * MAX_ENTITY_PART_COUNT;
+	u32 result = 0;
+	result += ARENA_ARRAY_SIZE(struct entity, capacity);
+	result += ARENA_ARRAY_SIZE(u32, capacity);
+	result += 3 * ARENA_ARRAY_SIZE(u32, capacity);
+	result += ARENA_ARRAY_SIZE(u32, capacity);
+	result += 8 * ARENA_ARRAY_SIZE(struct v2, slot_count);
+	result += 2 * ARENA_ARRAY_SIZE(f32, slot_count);
+	result += ARENA_ARRAY_SIZE(u16, slot_count);
+	result += 8 * ARENA_ARRAY_SIZE(u32, slot_count);
+	result += ARENA_ARRAY_SIZE(u32, capacity + 1);
+	result += ARENA_ARRAY_SIZE(u64, MAX_WORKER_COUNT * ((slot_count + 63) / 64));
+	result += 3 * ARENA_ARRAY_SIZE(u32, slot_count);
+	result += 2 * ARENA_ARRAY_SIZE(struct voice, slot_count);
+	return result;
+}
+
+static u32
+next_entity_capacity(u32 capacity, u32 max_entity_count)
+{
+	u32 result = capacity ? capacity * 2 : MIN_ENTITY_CAPACITY;
+	if (result > max_entity_count)
+		result = max_entity_count;
+	return result;
+}
+
+/* NOTE(omid): Moves everything sized by the entity capacity into bigger
+   arrays pushed on the game arena. The arena is reserved for every
+   capacity on the way to max_entity_count, but only the new arrays are
+   committed, and the pages of the old ones go back to the system once
+   copied, so memory is about the storage for the current capacity. Entity
+   and part pointers taken before a push_entity are stale after it. */
+static void
+grow_entity_storage(struct game_state *game, u32 capacity)
+{
+	struct memory_arena *arena = &game->arena;
+	u32 old_slot_count = game->entity_capacity * MAX_ENTITY_PART_COUNT;
+	u32 slot_count = capacity * MAX_ENTITY_PART_COUNT;
+	assert(capacity > game->entity_capacity);
+
+	/* NOTE(omid): The old storage starts at the entities, the first array
+	   pushed, and ends where the new storage starts. */
+	void *old_storage = game->entity_capacity ? (void *)game->entities : 0;
+	b32 committed = commit_arena(arena, ARENA_ALIGN(arena->used) + entity_storage_size(capacity));
+	assert(committed);
+	(void)committed;
+
+	struct entity *entities = PUSH_ARRAY(arena, struct entity, capacity);
+	u32 *entity_index_by_z = PUSH_ARRAY(arena, u32, capacity);
+	if (game->entity_count) {
+		memcpy(entities, game->entities, game->entity_count * sizeof(struct entity));
+		memcpy(entity_index_by_z, game->entity_index_by_z, game->entity_count * sizeof(u32));
+	}
+	game->entities = entities;
+	game->entity_index_by_z = entity_index_by_z;
+
+	/* NOTE(omid): Slots past the old ones come zeroed, the first allocation
+	   of a slot starts it at generation 1. */
+	struct entity_handle_table *handles = &game->handles;
+	u32 *handle_index = PUSH_ARRAY(arena, u32, capacity);
+	u32 *handle_generation = PUSH_ARRAY(arena, u32, capacity);
+	u32 *free_slots = PUSH_ARRAY(arena, u32, capacity);
+	if (handles->slot_count) {
+		memcpy(handle_index, handles->index, handles->slot_count * sizeof(u32));
+		memcpy(handle_generation, handles->generation, handles->slot_count * sizeof(u32));
+		memcpy(free_slots, handles->free_slots, handles->free_slot_count * sizeof(u32));
+	}
+	handles->index = handle_index;
+	handles->generation = handle_generation;
+	handles->free_slots = free_slots;
+
+	struct part_store *store = &game->parts;
+	u32 *free_spans = PUSH_ARRAY(arena, u32, capacity);
+	struct v2 *p = PUSH_ARRAY(arena, struct v2, slot_count);
+	struct v2 *v = PUSH_ARRAY(arena, struct v2, slot_count);
+	struct v2 *a = PUSH_ARRAY(arena, struct v2, slot_count);
+	struct v2 *force = PUSH_ARRAY(arena, struct v2, slot_count);
+	f32 *mass = PUSH_ARRAY(arena, f32, slot_count);
+	f32 *inv_mass = PUSH_ARRAY(arena, f32, slot_count);
+	u16 *size = PUSH_ARRAY(arena, u16, slot_count);
+	struct v2 *prev_p = PUSH_ARRAY(arena, struct v2, slot_count);
+	struct v2 *render_p = PUSH_ARRAY(arena, struct v2, slot_count);
+	struct v2 *next_p = PUSH_ARRAY(arena, struct v2, slot_count);
+	struct v2 *next_v = PUSH_ARRAY(arena, struct v2, slot_count);
+	if (old_slot_count) {
+		memcpy(free_spans, store->free_spans, store->free_span_count * sizeof(u32));
+		memcpy(p, store->p, old_slot_count * sizeof(struct v2));
+		memcpy(v, store->v, old_slot_count * sizeof(struct v2));
+		memcpy(a, store->a, old_slot_count * sizeof(struct v2));
+		memcpy(force, store->force, old_slot_count * sizeof(struct v2));
+		memcpy(mass, store->mass, old_slot_count * sizeof(f32));
+		memcpy(inv_mass, store->inv_mass, old_slot_count * sizeof(f32));
+		memcpy(size, store->size, old_slot_count * sizeof(u16));
+		memcpy(prev_p, store->prev_p, old_slot_count * sizeof(struct v2));
+	}
+	store->free_spans = free_spans;
+	store->p = p;
+	store->v = v;
+	store->a = a;
+	store->force = force;
+	store->mass = mass;
+	store->inv_mass = inv_mass;
+	store->size = size;
+	store->prev_p = prev_p;
+	store->render_p = render_p;
+	store->next_p = next_p;
+	store->next_v = next_v;
+
+	/* NOTE(omid): Links are rebuilt from the entities, nothing to copy. */
+	struct spring_links *links = &game->springs;
+	links->child = PUSH_ARRAY(arena, u32, slot_count);
+	links->parent = PUSH_ARRAY(arena, u32, slot_count);
+	links->rest_length = PUSH_ARRAY(arena, f32, slot_count);
+	links->k = PUSH_ARRAY(arena, f32, slot_count);
+	links->child_ax = PUSH_ARRAY(arena, f32, slot_count);
+	links->child_ay = PUSH_ARRAY(arena, f32, slot_count);
+	links->parent_ax = PUSH_ARRAY(arena, f32, slot_count);
+	links->parent_ay = PUSH_ARRAY(arena, f32, slot_count);
+	links->first_link = PUSH_ARRAY(arena, u32, capacity + 1);
+	links->dirty = true;
+
+	/* NOTE(omid): The candidate bitsets are all clear between queries. */
+	struct collision_grid *grid = &game->collision_grid;
+	u64 *candidates = PUSH_ARRAY(arena, u64, MAX_WORKER_COUNT * ((slot_count + 63) / 64));
+	u32 *next_in_cell = PUSH_ARRAY(arena, u32, slot_count);
+	u32 *prev_in_cell = PUSH_ARRAY(arena, u32, slot_count);
+	u32 *cell_of_slot = PUSH_ARRAY(arena, u32, slot_count);
+	if (old_slot_count) {
+		memcpy(next_in_cell, grid->next_in_cell, old_slot_count * sizeof(u32));
+		memcpy(prev_in_cell, grid->prev_in_cell, old_slot_count * sizeof(u32));
+		memcpy(cell_of_slot, grid->cell_of_slot, old_slot_count * sizeof(u32));
+	}
+	memset(cell_of_slot + old_slot_count, 0xFF, (slot_count - old_slot_count) * sizeof(u32));
+	grid->candidates = candidates;
+	grid->next_in_cell = next_in_cell;
+	grid->prev_in_cell = prev_in_cell;
+	grid->cell_of_slot = cell_of_slot;
+	grid->slot_count = slot_count;
+
+	game->sine_scratch = PUSH_ARRAY(arena, struct voice, slot_count);
+	game->saw_scratch = PUSH_ARRAY(arena, struct voice, slot_count);
+
+	if (old_storage)
+		decommit_arena_range(old_storage, game->entities);
+
+	game->entity_capacity = capacity;
+}
+
+static void
+wake_entity(struct entity *entity)
+{
+	entity->asleep = false;
+	entity->still_frame_count = 0;
+}
+
+static bool
+can_push_entity(const struct game_state *game)
+{
+	return game->entity_count < game->max_entity_count;
+}
+
+static struct entity_handle
+alloc_entity_handle(struct entity_handle_table *table, u32 entity_index)
+{
+	u32 slot;
+	if (table->free_slot_count)
+		slot = table->free_slots[--table->free_slot_count];
+	else
+		slot = table->slot_count++;
+
+	if (table->generation[slot] == 0)
+		table->generation[slot] = 1;
+	table->index[slot] = entity_index;
+
+	struct entity_handle result;
+	result.slot = slot;
+	result.generation = table->generation[slot];
+	return result;
+}
+
+static void
+free_entity_handle(struct entity_handle_table *table, struct entity_handle handle)
+{
+	assert(table->generation[handle.slot] == handle.generation);
+	if (++table->generation[handle.slot] == 0)
+		table->generation[handle.slot] = 1;
+	table->free_slots[table->free_slot_count++] = handle.slot;
+}
+
+static struct entity *
+get_entity(struct game_state *game, struct entity_handle handle)
+{
+	const struct entity_handle_table *table = &game->handles;
+	if (handle.generation == 0 || handle.slot >= table->slot_count)
+		return 0;
+	if (table->generation[handle.slot] != handle.generation)
+		return 0;
+	return game->entities + table->index[handle.slot];
+}
+
+static struct entity *
+push_entity(struct game_state *game)
+{
+	assert(can_push_entity(game));
+	if (game->entity_count == game->entity_capacity)
+		grow_entity_storage(game, next_entity_capacity(game->entity_capacity, game->max_entity_count));
+
+	u32 index = game->entity_count++;
+	struct entity *result = game->entities + index;
+	ZERO_STRUCT(*result);
+	result->id = ++game->entity_id_seq;
+	result->index = index;
+	result->handle = alloc_entity_handle(&game->handles, index);
+	game->entity_index_by_z[index] = index;
+	result->seed = random_u32(&game->random);
+	result->part_base = alloc_part_span(&game->parts);
+	game->springs.dirty = true;
+	return result;
+}
+
+static struct entity_part *
+push_entity_part_(struct game_state *game, struct entity *entity, u16 parent_index)
+{
+	assert(entity->part_count < ARRAY_COUNT(entity->parts));
+	u16 index = entity->part_count++;
+	struct entity_part *result = entity->parts + index;
+	ZERO_STRUCT(*result);
+	result->index = index;
+	result->parent_index = parent_index;
+	game->springs.dirty = true;
+	wake_entity(entity);
+
+	struct part_span parts = get_part_span(game, entity);
+	parts.p[index] = v2(WINDOW_WIDTH / 2, WINDOW_HEIGHT / 2);
+	parts.v[index] = v2(0, 0);
+	parts.a[index] = v2(0, 0);
+	parts.force[index] = v2(0, 0);
+	game->parts.prev_p[entity->part_base + index] = v2(NAN, NAN);
+
+	if (parent_index != index)
+		result->depth = entity->parts[parent_index].depth + 1;
+
+	update_part_collision_bits(entity, result);
+	
+	return result;
+}
+
+static struct entity_part *
+push_entity_part(struct game_state *game, struct entity *entity, u16 length, u16 size, u16 color, u16 parent_index)
+{
+	struct entity_part *p = push_entity_part_(game, entity, parent_index);
+	p->length = length;
+	p->render_size = size;
+	p->color = color;	
+
+	struct part_span parts = get_part_span(game, entity);
+	parts.size[p->index] = size;
+	set_part_mass(parts, p->index, (f32)(size * size));
+	return p;
+}
+
+
+static void
+add_squid_leg(struct game_state *game, struct entity *entity, u16 parent_index, u16 color, u16 length, u16 spacing, u16 size, f32 stiffness)
+{
+	struct entity_part *p;
+
+	/* NOTE(omid): Tapers by one per part, but never to nothing; a zero size
+	   part would have no mass. Long legs end in a run of size 1 parts. */
+	for (u16 i = 0; i < length; ++i) {
+		p = push_entity_part(game, entity, spacing, (u16)(size > i + 1 ? size - i : 1), color, parent_index);
+		p->stiffness = stiffness;
+		parent_index = p->index;
+	}
+	
+	/* p = add_part(entity); */
+	/* p->length = 25; */
+	/* p->size = 25; */
+	/* p->color = 2; */
+	/* p->p = v2(-40, 20); */
+	/* p->parent_index = parent_index; */
+		
+	/* parent_index = p->index; */
+
+	/* p = add_part(entity); */
+	/* p->length = 25; */
+	/* p->size = 20; */
+	/* p->color = 4; */
+	/* p->parent_index = parent_index; */
+
+	/* parent_index = p->index; */
+
+	/* p = add_part(entity); */
+	/* p->length = 25; */
+	/* p->size = 20; */
+	/* p->color = 5; */
+	/* p->parent_index = parent_index; */
+
+	/* parent_index = p->index; */
+
+	/* p = add_part(entity); */
+	/* p->length = 25; */
+	/* p->size = 20; */
+	/* p->color = 6; */
+	/* p->parent_index = parent_index; */
+}
+
+static struct entity *
+init_socket(struct game_state *game, struct entity *entity)
+{
+	entity->type = ENTITY_SOCKET;
+	struct entity_part *p;
+	p = push_entity_part(game, entity, 0, 40, 0, 0);
+
+	/* p = push_entity_part(game, entity, 0, 10, 80, 0); */
+	/* p->passthrough = true; */
+	/* p->render_size = 0; */
+	
+	/* entity->fixed = true; */
+	/* entity->passthrough = true; */
+	return entity;	
 }
 
 static struct entity *
-init_squid(struct entity *entity, u16 leg_count)
+init_seed(struct game_state *game, struct entity *entity)
 {
+	entity->type = (ENTITY_FOOD | ENTITY_SEED);
 	struct entity_part *p;
+	p = push_entity_part(game, entity, 0, 25, 2, 0);
+	p->content_value = 8;
+	return entity;
+}
+
+static struct entity *
+init_liquid(struct game_state *game, struct entity *entity, u32 type, u8 color, u16 count)
+{
+	entity->type = type;
+
+	struct entity_part *p;
+	p = push_entity_part(game, entity, 0, 10, color, 0);
+	p->render_size = 20;
+	p->max_alpha = 0xa0;
+
+	struct part_span parts = get_part_span(game, entity);
+	for (u32 i = 0; i < count; ++i) {
+		p = push_entity_part(game, entity, 20, 10, color, 0);
+		p->render_size = 20;
+		p->max_alpha = 0xa0;
+		parts.p[p->index] = add_v2(parts.p[0], v2(20 * cosf((f32)i * 2 * 3.14f / 8), 20 * sinf((f32)i * 2 * 3.14f / 8)));
+		p->content_value = 0;
+	}
+
+	return entity;
+}
+
+
+static struct entity *
+init_water(struct game_state *game, struct entity *entity, u16 count)
+{
+	return init_liquid(game, entity, (ENTITY_FOOD | ENTITY_WATER), 8, count);
+}
+
+static struct entity *
+init_slime(struct game_state *game, struct entity *entity, u16 count)
+{
+	return init_liquid(game, entity, (ENTITY_FOOD | ENTITY_WATER), 4, count);
+}
+
+static struct entity *
+init_food(struct game_state *game, struct entity *entity)
+{
+	entity->type = ENTITY_FOOD;
+	entity->part_count = 0;
+
+	struct entity_part *p;
+	p = push_entity_part(game, entity, 0, 25, 4, 0);
+	p->content_value = 16;
+
+	return entity;
+}
+
+static struct entity *
+init_gem(struct game_state *game, struct entity *entity, u8 color)
+{
+	entity->type = ENTITY_GEM;
+	struct entity_part *p;
+	p = push_entity_part(game, entity, 0, 25, color, 0);
+	return entity;
+}
+
+
+static void
+push_worm_tail(struct game_state *game, struct entity *entity)
+{
+	if (entity->part_count >= ARRAY_COUNT(entity->parts))
+		return;
+
+	u16 parent_index = entity->part_count ? (entity->part_count - 1) : 0;
+	
+	struct entity_part *p;
+	p = push_entity_part(game, entity, 25, (u16)(40 - entity->part_count), 2, parent_index);
+
+	struct part_span parts = get_part_span(game, entity);
+	parts.p[p->index] = parts.p[p->index - 1];
+}
+
+static struct entity *
+init_worm(struct game_state *game, struct entity *entity)
+{
+	entity->type = ENTITY_WORM;
+	entity->part_count = 0;
+
+	struct entity_part *p;
+	p = push_entity_part(game, entity, 0, 40, 2, 0);
+
+	for (u32 i = 1; i < 2; ++i)
+		push_worm_tail(game, entity);
+
+	return entity;
+}
+
+static struct entity *
+init_water_eater(struct game_state *game, struct entity *entity)
+{
+	entity->type = ENTITY_WATER_EATER;
+	entity->part_count = 0;
+	entity->internal_collisions = true;
+
+	struct entity_part *p;
+	p = push_entity_part(game, entity, 0, 25, 5, 0);
+	set_part_mass(get_part_span(game, entity), p->index, 50 * 50);
+
+	struct entity_part *l1;
+	struct entity_part *l2;
+	l1 = push_entity_part(game, entity, 25, 20, 2, 0);
+	l2 = push_entity_part(game, entity, 25, 20, 2, 0);
+	l1->internal_collisions = l2->internal_collisions = true;
+	l1->stiffness = 2;
+	l2->stiffness = 2;
+	l1->render_size = l2->render_size = 15;
+
+	add_squid_leg(game, entity, l1->index, 7, 4, 30, 20, 2);
+	add_squid_leg(game, entity, l2->index, 7, 4, 30, 20, 2);
+
+	return entity;
+}
+
+static struct entity *
+init_squid(struct game_state *game, struct entity *entity, u16 leg_count)
+{
+	struct entity_part *p;
+
+	entity->type = ENTITY_PLAYER;
+	
+	p = push_entity_part(game, entity, 0, 50, 1, 0);
+	set_part_mass(get_part_span(game, entity), p->index, 10000);
+
+	add_squid_leg(game, entity, 0, 6, leg_count, 20, 25, 0);
+
+	return entity;
+}
+
+static u32
+count_entity_of_type(const struct game_state *game, enum entity_type type)
+{
+	u32 result = 0;
+	for (u32 i = 0; i < game->entity_count; ++i)
+		result += (game->entities[i].type & type) > 0;
+	return result;
+}
+
+static u16
+compute_entity_part_depth(const struct entity *entity, const struct entity_part *part)
+{
+	u16 depth = 0;
+	const struct entity_part *p = part;
+	while (p->parent_index != p->index) {
+		depth++;
+
+		p = entity->parts + p->parent_index;
+	}
+
+	return depth;
+}
+
+static f32
+compute_entity_mass(struct game_state *game, const struct entity *entity)
+{
+	struct part_span parts = get_part_span(game, entity);
+	f32 mass = 0;
+	for (u32 i = 0; i < entity->part_count; ++i)
+		mass += parts.mass[i];
+
+	return mass;
+}
+
+static f32
+compute_relative_mass_of_entity_head(struct game_state *game, const struct entity *entity)
+{
+	f32 total_mass = compute_entity_mass(game, entity);
+	return get_part_span(game, entity).mass[0] / total_mass;
+}
+
+/* NOTE(omid): The levels as shipped, in the format load_level_set reads.
+   One block per level: "level" and the instruction shown at its start,
+   "length" and its seconds of play, then one "spawn <type> <param>
+   <delay>" line per entity, delay being the seconds after the spawn before
+   it (or after the tunnel begins, for the first). The param is the
+   tentacle count of a player, the gem a socket accepts and the drop count
+   of water. */
+static const char default_level_text[] =
+	"level FEED THE WORM\n"
+	"length 45\n"
+	"spawn player 0 0\n"
+	"spawn socket 3 0\n"
+	"spawn worm 0 0\n"
+	"spawn water 2 5\n"
+	"spawn seed 0 5\n"
+	"spawn seed 0 2\n"
+	"\n"
+	"level WATER THE SEEDS\n"
+	"length 45\n"
+	"spawn player 0 0\n"
+	"spawn socket 5 0\n"
+	"spawn seed 0 1\n"
+	"spawn seed 0 2\n"
+	"spawn water 4 5\n"
+	"spawn worm 0 10\n"
+	"\n"
+	"level HERD THE WORM\n"
+	"length 75\n"
+	"spawn player 4 0\n"
+	"spawn socket 3 0\n"
+	"spawn worm 0 0\n"
+	"spawn seed 0 5\n"
+	"spawn seed 0 2\n"
+	"spawn water 4 5\n"
+	"spawn socket 5 10\n"
+	"spawn water 4 5\n"
+	"spawn seed 0 0\n"
+	"spawn seed 0 0\n"
+	"spawn water 2 10\n"
+	"spawn seed 0 0\n"
+	"spawn seed 0 1\n"
+	"\n"
+	"level HERD THE WORM, AGAIN\n"
+	"length 90\n"
+	"spawn player 8 0\n"
+	"spawn socket 3 0\n"
+	"spawn socket 3 0\n"
+	"spawn worm 0 0\n"
+	"spawn seed 0 5\n"
+	"spawn seed 0 2\n"
+	"spawn water 8 5\n"
+	"spawn socket 5 10\n"
+	"spawn water 8 5\n"
+	"spawn seed 0 0\n"
+	"spawn seed 0 0\n"
+	"spawn water 8 5\n"
+	"spawn seed 0 0\n"
+	"spawn seed 0 1\n"
+	"\n"
+	"level YOU ARE THE SHEPHERD\n"
+	"length 30\n"
+	"spawn player 0 0\n"
+	"spawn socket 3 0\n"
+	"spawn worm 0 0\n"
+	"spawn seed 0 5\n"
+	"spawn seed 0 2\n"
+	"spawn water_eater 0 5\n"
+	"spawn water 8 5\n";
+
+struct level_def {
+	u32 instruction;
+	f32 length;
+	u32 first_spawn;
+	u32 spawn_count;
+};
+
+/* NOTE(omid): Every level's spawns in one timeline, times relative to the
+   tunnel of their level beginning. Instructions are NUL terminated in
+   strings, levels refer to them by offset. */
+struct level_set {
+	struct level_def *levels;
+	struct spawn_item *spawns;
+	char *strings;
+	u32 level_count;
+	u32 level_capacity;
+	u32 spawn_count;
+	u32 spawn_capacity;
+	u32 string_count;
+	u32 string_capacity;
+};
+
+static struct level_set level_set;
+
+/* NOTE(omid): max_param bounds what spawn_next can build from the param:
+   player legs and water drops come on top of one root part, a socket's
+   accepted colour indexes BASE_COLORS when it is drawn. The rest ignore
+   it. */
+struct spawn_type_name {
+	const char *name;
+	enum entity_type type;
+	u32 max_param;
+};
+
+static const struct spawn_type_name spawn_type_names[] = {
+	{ "player", ENTITY_PLAYER, MAX_ENTITY_PART_COUNT - 1 },
+	{ "worm", ENTITY_WORM, ~0u },
+	{ "socket", ENTITY_SOCKET, ARRAY_COUNT(BASE_COLORS) - 1 },
+	{ "seed", ENTITY_SEED, ~0u },
+	{ "water", ENTITY_WATER, MAX_ENTITY_PART_COUNT - 1 },
+	{ "water_eater", ENTITY_WATER_EATER, ~0u },
+};
+
+static u32
+push_level_string(struct level_set *set, const char *text, u32 length)
+{
+	if (set->string_count + length + 1 > set->string_capacity) {
+		while (set->string_count + length + 1 > set->string_capacity)
+			set->string_capacity = set->string_capacity ? set->string_capacity * 2 : 256;
+		set->strings = (char *)realloc(set->strings, set->string_capacity);
+		assert(set->strings);
+	}
+	u32 result = set->string_count;
+	memcpy(set->strings + result, text, length);
+	set->strings[result + length] = 0;
+	set->string_count += length + 1;
+	return result;
+}
+
+static struct level_def *
+push_level_def(struct level_set *set)
+{
+	if (set->level_count == set->level_capacity) {
+		set->level_capacity = set->level_capacity ? set->level_capacity * 2 : 8;
+		set->levels = (struct level_def *)realloc(set->levels, set->level_capacity * sizeof(struct level_def));
+		assert(set->levels);
+	}
+	struct level_def *level = set->levels + set->level_count++;
+	ZERO_STRUCT(*level);
+	level->length = 45;
+	level->first_spawn = set->spawn_count;
+	return level;
+}
+
+static struct spawn_item *
+push_level_spawn(struct level_set *set)
+{
+	if (set->spawn_count == set->spawn_capacity) {
+		set->spawn_capacity = set->spawn_capacity ? set->spawn_capacity * 2 : 64;
+		set->spawns = (struct spawn_item *)realloc(set->spawns, set->spawn_capacity * sizeof(struct spawn_item));
+		assert(set->spawns);
+	}
+	return set->spawns + set->spawn_count++;
+}
+
+static void
+free_level_set(struct level_set *set)
+{
+	free(set->levels);
+	free(set->spawns);
+	free(set->strings);
+	ZERO_STRUCT(*set);
+}
+
+/* NOTE(omid): text need not be NUL terminated, it comes straight out of a
+   mapped file. Lines starting with '#' are skipped. */
+static b32
+parse_level_set(struct level_set *set, const char *text, umm size, const char *name)
+{
+	ZERO_STRUCT(*set);
+	struct level_def *level = 0;
+	u32 line_number = 0;
+
+	for (umm at = 0; at < size;) {
+		umm end = at;
+		while (end < size && text[end] != '\n')
+			++end;
+		++line_number;
+
+		/* NOTE(omid): Blank lines and comments are skipped before the
+		   length check, so comments can be as long as they like. */
+		umm first = at;
+		while (first < end && (text[first] == ' ' || text[first] == '\t' || text[first] == '\r'))
+			++first;
+		if (first == end || text[first] == '#') {
+			at = end + 1;
+			continue;
+		}
+
+		char line[256];
+		umm length = end - at;
+		if (length >= sizeof(line)) {
+			fprintf(stderr, "%s:%u: line too long\n", name, line_number);
+			return false;
+		}
+		memcpy(line, text + at, length);
+		line[length] = 0;
+		if (length && line[length - 1] == '\r')
+			line[length - 1] = 0;
+		at = end + 1;
+
+		char *rest = line;
+		while (*rest == ' ' || *rest == '\t')
+			++rest;
+		if (!*rest || *rest == '#')
+			continue;
+
+		char keyword[16];
+		s32 consumed = 0;
+		if (sscanf(rest, "%15s %n", keyword, &consumed) != 1)
+			continue;
+		rest += consumed;
+
+		if (strcmp(keyword, "level") == 0) {
+			level = push_level_def(set);
+			level->instruction = push_level_string(set, rest, (u32)strlen(rest));
+		} else if (!level) {
+			fprintf(stderr, "%s:%u: %s before the first level\n", name, line_number, keyword);
+			return false;
+		} else if (strcmp(keyword, "length") == 0) {
+			if (sscanf(rest, "%f", &level->length) != 1 || !(level->length > 0)) {
+				fprintf(stderr, "%s:%u: bad length\n", name, line_number);
+				return false;
+			}
+		} else if (strcmp(keyword, "spawn") == 0) {
+			char type_name[16];
+			u32 param;
+			f32 delay;
+			if (sscanf(rest, "%15s %u %f", type_name, &param, &delay) != 3 || !(delay >= 0)) {
+				fprintf(stderr, "%s:%u: expected spawn <type> <param> <delay>\n", name, line_number);
+				return false;
+			}
+
+			const struct spawn_type_name *spawn_type = 0;
+			for (u32 i = 0; i < ARRAY_COUNT(spawn_type_names); ++i)
+				if (strcmp(type_name, spawn_type_names[i].name) == 0)
+					spawn_type = spawn_type_names + i;
+			if (!spawn_type) {
+				fprintf(stderr, "%s:%u: unknown spawn type %s\n", name, line_number, type_name);
+				return false;
+			}
+			if (param > spawn_type->max_param) {
+				fprintf(stderr, "%s:%u: %s param is at most %u\n", name, line_number, type_name, spawn_type->max_param);
+				return false;
+			}
+			enum entity_type type = spawn_type->type;
+
+			struct spawn_item *item = push_level_spawn(set);
+			item->type = type;
+			item->param = param;
+			item->time = level->spawn_count ? item[-1].time + delay : delay;
+			++level->spawn_count;
+		} else {
+			fprintf(stderr, "%s:%u: unknown keyword %s\n", name, line_number, keyword);
+			return false;
+		}
+	}
+
+	if (!set->level_count) {
+		fprintf(stderr, "%s: no levels\n", name);
+		return false;
+	}
+	return true;
+}
+
+/* NOTE(omid): Maps path and parses it into level_set, or the levels as
+   shipped without one. */
+static b32
+load_level_set(const char *path)
+{
+	struct level_set set;
+	ZERO_STRUCT(set);
+	b32 result = false;
+	if (!path) {
+		result = parse_level_set(&set, default_level_text, sizeof(default_level_text) - 1, "default levels");
+	} else {
+		s32 fd = open(path, O_RDONLY);
+		struct stat file_stat;
+		if (fd >= 0 && fstat(fd, &file_stat) == 0 && file_stat.st_size > 0) {
+			void *mapping = mmap(0, (size_t)file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (mapping != MAP_FAILED) {
+				result = parse_level_set(&set, (const char *)mapping, (umm)file_stat.st_size, path);
+				munmap(mapping, (size_t)file_stat.st_size);
+			}
+		}
+		if (fd >= 0)
+			close(fd);
+	}
+
+	if (!result) {
+		free_level_set(&set);
+		return false;
+	}
+
+	free_level_set(&level_set);
+	level_set = set;
+	return true;
+}
+
+static const char *
+level_instruction(u32 level)
+{
+	return level < level_set.level_count ? level_set.strings + level_set.levels[level].instruction : 0;
+}
+
+static void
+goto_level(struct game_state *game, u32 level)
+{
+	f32 level_length = 45;
+	if (level < level_set.level_count) {
+		const struct level_def *def = level_set.levels + level;
+		game->first_spawn = def->first_spawn;
+		game->next_spawn = def->first_spawn;
+		game->end_spawn = def->first_spawn + def->spawn_count;
+		level_length = def->length;
+	} else {
+		game->first_spawn = 0;
+		game->next_spawn = 0;
+		game->end_spawn = 0;
+		game->game_over = true;
+	}
+
+	game->current_level = level;
+	game->level_instr = level_instruction(level);
+	game->level_snapshot_pending = true;
+	game->last_level_end_t = game->level_end_t;
+
+	game->tunnel_begin_t = game->level_end_t + 5;
+	game->level_begin_t = game->tunnel_begin_t + 10;
+	game->level_end_t = game->level_begin_t + level_length;
+
+	game->next_spawn_t = game->tunnel_begin_t;
+	
+	game->tunnel_size = 0;
+
+	game->counter_1 = 0;
+
+	game->skip_to_begin = false;
+	game->skip_to_end = false;
+	game->time_speed_up = 0;
+}
+
+
+/* NOTE(omid): Drops entity_index from the draw order and renames the last
+   entity, which swap-removal is about to move there. Keeps the order of
+   everything else. */
+static void
+remove_entity_z_order(struct game_state *game, u32 entity_index)
+{
+	u32 *order = game->entity_index_by_z;
+	u32 last_index = game->entity_count - 1;
+	u32 count = 0;
+	for (u32 i = 0; i < game->entity_count; ++i) {
+		u32 index = order[i];
+		if (index == entity_index)
+			continue;
+		if (index == last_index)
+			index = entity_index;
+		order[count++] = index;
+	}
+}
+
+/* NOTE(omid): Insertion sort, stable. z moves a little per frame, so last
+   frame's order is nearly sorted and this is close to a single pass. */
+static void
+sort_entities_by_z(struct game_state *game)
+{
+	const struct entity *entities = game->entities;
+	u32 *order = game->entity_index_by_z;
+	for (u32 i = 1; i < game->entity_count; ++i) {
+		u32 index = order[i];
+		f32 z = entities[index].z;
+		u32 j = i;
+		while (j > 0 && entities[order[j - 1]].z > z) {
+			order[j] = order[j - 1];
+			--j;
+		}
+		order[j] = index;
+	}
+}
+
+static void
+begin_game_frame(struct game_state *game)
+{
+	clear_game_events(game);
+
+	/* NOTE(omid): Clean-up dead entities and initialize the live ones. */
+	
+	u32 entity_index = 0;
+	while (entity_index < game->entity_count) {
+		struct entity *entity = game->entities + entity_index;
+		entity->suspended_for_frame = false;
+
+		if (entity->part_count == 0)
+			entity->disposed = true;
+			
+		if (entity->disposed) {
+			remove_entity_z_order(game, entity_index);
+			free_part_span(&game->parts, entity->part_base);
+			free_entity_handle(&game->handles, entity->handle);
+			game->springs.dirty = true;
+			game->entities[entity_index] = game->entities[--game->entity_count];
+			game->entities[entity_index].index = entity_index;
+			game->handles.index[game->entities[entity_index].handle.slot] = entity_index;
+			continue;
+		}
+
+		/* NOTE(omid): Recursively dispose child parts of disposed parents. */
+		for (;;) {
+			bool found_child_to_dispose = false;
+			for (u32 i = 0; i < entity->part_count; ++i) {
+				struct entity_part *part = entity->parts + i;
+				if (part->disposed)
+					continue;
+
+				if (part->parent_index != part->index)
+					continue;
+
+				if (entity->parts[part->parent_index].disposed)
+					found_child_to_dispose = part->disposed = true;
+			}
+
+			if (!found_child_to_dispose)
+				break;
+		}
+
+		struct part_span parts = get_part_span(game, entity);
+		u16 part_index = 0;
+		while (part_index < entity->part_count) {
+			struct entity_part *part = entity->parts + part_index;
+			if (part->disposed) {
+				for (u32 i = 0; i < entity->part_count; ++i)
+					if (entity->parts[i].parent_index == (entity->part_count - 1))
+						entity->parts[i].parent_index = part_index;
+
+				entity->parts[part_index] = entity->parts[--entity->part_count];
+				entity->parts[part_index].index = part_index;
+				update_part_collision_bits(entity, entity->parts + part_index);
+				copy_part_slot(&game->parts, entity->part_base + part_index, entity->part_base + entity->part_count);
+				game->springs.dirty = true;
+				wake_entity(entity);
+			} else {
+				/* NOTE(omid): Init part for the new frame. */
+				part->suspended_for_frame = false;
+				parts.a[part_index] = parts.force[part_index];
+				parts.force[part_index] = v2(0, 0);
+
+				++part_index;
+			}
+		}
+
+		++entity_index;
+	}
+
+	build_collision_grid(game);
+}
+
+
+static bool
+spawn_next(struct game_state *game)
+{
+	if (game->next_spawn == game->end_spawn)
+		return false;
+
+	/* NOTE(omid): Everything that is due comes out in the same step. A full
+	   entity pool holds the rest back until something goes away. */
+	while (game->next_spawn < game->end_spawn) {
+		struct spawn_item item = level_set.spawns[game->next_spawn];
+		if (!(game->time > (item.time + game->tunnel_begin_t) && can_push_entity(game)))
+			break;
+
+		struct entity *entity = 0;
+		switch (item.type) {
+		case ENTITY_PLAYER:
+			entity = init_squid(game, push_entity(game), (u16)item.param);
+			entity->expiration_t = game->level_end_t;
+
+			game->player = entity->handle;
+			break;
+
+		case ENTITY_WORM:
+			entity = init_worm(game, push_entity(game));
+			entity->expiration_t = game->level_end_t;
+			break;
+
+		case ENTITY_SOCKET:
+			entity = init_socket(game, push_entity(game));
+			entity->expiration_t = game->level_end_t;
+			entity->parts->accept = (u8)item.param;
+			break;
+							
+		case ENTITY_SEED:
+			entity = init_seed(game, push_entity(game));
+			entity->expiration_t = game->level_end_t;
+			break;
+
+		case ENTITY_WATER:
+			entity = init_water(game, push_entity(game), (u16)item.param);
+			entity->expiration_t = game->level_end_t;
+			break;
+							
+		case ENTITY_WATER_EATER:
+			entity = init_water_eater(game, push_entity(game));
+			entity->expiration_t = game->level_end_t;
+			break;
+		}
+						
+		game->next_spawn++;
+	}
+
+	return true;
+}
+
+static bool
+check_win_condition(struct game_state *game)
+{
+	u32 socket_count = 0;
+	for (u32 i = game->first_spawn; i < game->end_spawn; ++i)
+		if (level_set.spawns[i].type == ENTITY_SOCKET)
+			socket_count++;
+	
+	for (u32 i = 0; i < game->entity_count; ++i)
+		if ((game->entities[i].type & ENTITY_SOCKET) && game->entities[i].parts->content && game->entities[i].z >= 1)
+			--socket_count;
+
+	return socket_count == 0;
+}
+
+static void
+run_level_scenario_control(struct game_state *game)
+{
+	if (game->time < game->level_begin_t)
+		game->tunnel_size = WINDOW_WIDTH * (game->time - game->tunnel_begin_t) / (game->level_begin_t - game->tunnel_begin_t);
+	else
+		game->tunnel_size = WINDOW_WIDTH;
+
+	if (game->time > game->level_end_t) {
+		if (check_win_condition(game))
+			goto_level(game, game->current_level + 1);
+		else
+			game->restart_level = true;
+	}
+
+	spawn_next(game);
+}
+
+static struct entity *
+find_player(struct game_state *game)
+{
+	return get_entity(game, game->player);
+}
+
+static void
+apply_user_input(struct game_state *game, const struct input_state *input)
+{
+	if (input->dstart > 0) {
+		if (game->time < game->level_begin_t) {
+			game->skip_to_begin = true;
+			game->time_speed_up = 31;
+		} else if (check_win_condition(game) && game->time < game->level_end_t) {
+			game->skip_to_end = true;
+			game->time_speed_up = 31;
+		}
+	}
+
+	struct entity *player = find_player(game);
+	if (player) {
+		struct part_span parts = get_part_span(game, player);
+		struct v2 *root_a = parts.a;
+
+		if (input->left)
+			root_a->x -= 2;
+
+		if (input->right)
+			root_a->x += 2;
+
+		if (input->up)
+			root_a->y -= 2;
+
+		if (input->down)
+			root_a->y += 2;
+
+		if (input->mouse_left) {
+			struct v2 m = v2((f32)input->mouse_x, (f32)input->mouse_y);
+			struct v2 d = sub_v2(m, parts.p[0]);
+			*root_a = add_v2(*root_a, scale_v2(normalize_v2(d), 2));
+		}
+	}
+}
+
+
+static bool
+target_nearest_entity_of_type(struct game_state *game, struct entity *entity, enum entity_type type, f32 max_dist) {
+	bool result = false;
+	
+	struct v2 head_p = get_part_span(game, entity).p[0];
+	
+	f32 min_dist = 100000000;
+	for (u32 i = 0; i < game->entity_count; ++i) {
+		struct entity *other = game->entities + i;
+		if (other->z < 1)
+			continue;
+
+		if (other->expiration_t > 0 && game->time > other->expiration_t)
+			continue;
+			
+		if (other->type & type) {
+			f32 dist = len_v2(sub_v2(head_p, get_part_span(game, other).p[0]));
+			if (dist > max_dist)
+				continue;
+			
+			if (dist < min_dist) {
+				min_dist = dist;
+				entity->target_entity = other->handle;
+				result = true;
+			}
+		}
+	}
+
+	return result;
+}
+
+static bool
+entity_should_check_target(struct game_state *game, struct entity *entity)
+{
+	struct v2 head_p = get_part_span(game, entity).p[0];
+
+	bool check_target = game->time > entity->next_target_check_t;
+	if (!check_target && entity->has_target) {
+		f32 dist = len_v2(sub_v2(head_p, entity->target));
+		if (isnan(dist) || dist < 10)
+			check_target = true;
+	}
+
+	return check_target;
+}
+
+static void
+update_roaming_ai(struct game_state *game, struct entity *entity)
+{	
+	f32 r1 = (f32)(random_int(&game->random, 0, WINDOW_WIDTH / 2));
+	f32 r2 = (f32)(random_int(&game->random, 0, WINDOW_HEIGHT / 2));
+	
+	f32 a = random_f32(&game->random) * 2 * 3.14f;
+	entity->target = add_v2(screen_center, v2(r1 * cosf(a), r2 * sinf(a)));
+	entity->has_target = true;
+}
+
+static void
+update_worm_ai(struct game_state *game, struct entity *entity)
+{
+	if (entity->z < 1)
+		return;
+
+	if (!entity_should_check_target(game, entity))
+		return;
+	
+	if (!target_nearest_entity_of_type(game, entity, ENTITY_FOOD, 200))
+		update_roaming_ai(game, entity);
+
+	entity->pull_of_target = 1.0f;
+	entity->next_target_check_t = game->time + 2;
+	wake_entity(entity);
+}
+
+static void
+update_water_eater_ai(struct game_state *game, struct entity *entity)
+{
+	if (entity->z < 1)
+		return;
+
+	if (!entity_should_check_target(game, entity))
+		return;
+	
+	if (!target_nearest_entity_of_type(game, entity, ENTITY_FOOD, 600))
+		update_roaming_ai(game, entity);
+
+	entity->pull_of_target = 1.0f;
+	entity->next_target_check_t = game->time + 2;
+	wake_entity(entity);
+}
+
+static void
+update_entity_ai(struct game_state *game)
+{
+	for (u32 entity_index = 0; entity_index < game->entity_count; ++entity_index) {
+		struct entity *entity = game->entities + entity_index;
+		struct part_span parts = get_part_span(game, entity);
+		assert(!entity->disposed);
+		assert(!entity->suspended_for_frame);
+		assert(entity->index == (u16)entity_index);					
+		
+		/* TODO(omid): Remove this? */
+		for (u32 part_index = 0; part_index < entity->part_count; ++part_index) {
+			struct entity_part *part = entity->parts + part_index;
+			assert(!part->disposed);
+			assert(!part->suspended_for_frame);
+			assert(part->index == (u16)part_index);
+
+			if (entity->expiration_t > 0 && game->time > entity->expiration_t)
+				part->color = 0;
+
+		}
+
+		bool reverse_z = entity->expiration_t > 0 && game->time > entity->expiration_t;
+		const f32 z_speed = 0.001f;
+		
+		while (reverse_z && entity->z > 1) {
+			entity->accum_z -= entity->z;
+			entity->z -= z_speed;
+		}
+
+		if (entity->z < 1 && entity->accum_z > 0) {
+			f32 zsqrd = entity->z * entity->z;
+			f32 r1 = zsqrd * WINDOW_WIDTH / 2.0f + 50;
+			f32 r2 = zsqrd * WINDOW_HEIGHT / 2.0f;
+
+			f32 phi = fmodf((f32)entity->seed, 2 * 3.14f);
+			
+			entity->target = add_v2(screen_center, v2(r1 * cosf(2048 * 3.14f * entity->z / entity->accum_z + phi), r2 * sinf(2048 * 3.14f * entity->z / entity->accum_z + phi)));
+			entity->pull_of_target = 1 / compute_relative_mass_of_entity_head(game, entity);
+			entity->has_target = true;
+			entity->z += reverse_z ? -z_speed : z_speed;
+			if (entity->z > 1)
+				entity->has_target = false;
+		} else if (entity->z < 2) {
+			entity->z += reverse_z ? -z_speed : z_speed;
+		}
+		
+		if (entity->z < 2)
+			entity->accum_z += reverse_z ? -entity->z : entity->z;
+
+		if (entity->z < 0) {
+			entity->z = 0;
+			entity->disposed = true;
+		}
+		if (entity->accum_z < 0)
+			entity->accum_z = 0;
+		
+
+		switch (entity->type) {
+		case ENTITY_WORM:
+			update_worm_ai(game, entity);
+			break;
+
+		case ENTITY_WATER_EATER:
+			update_water_eater_ai(game, entity);
+			break;
+		}
+		
+		struct entity *target = get_entity(game, entity->target_entity);
+		if (target) {
+			if (target->disposed || (target->expiration_t > 0 && game->time > target->expiration_t)) {
+				entity->has_target = false;
+				entity->target_entity.generation = 0;
+			} else {
+				entity->target = get_part_span(game, target).p[0];
+				entity->has_target = true;
+			}
+		} else if (entity->target_entity.generation) {
+			entity->has_target = false;
+			entity->target_entity.generation = 0;
+		}
+
+		if (entity->has_target) {
+			struct v2 d = normalize_v2(sub_v2(entity->target, parts.p[0]));
+			parts.a[0] = add_v2(parts.a[0], scale_v2(d, entity->pull_of_target));
+		}
+	}
+}
+
+static void
+build_spring_links(struct game_state *game)
+{
+	struct spring_links *links = &game->springs;
+	u32 count = 0;
+
+	for (u32 entity_index = 0; entity_index < game->entity_count; ++entity_index) {
+		const struct entity *entity = game->entities + entity_index;
+		links->first_link[entity_index] = count;
+		for (u32 part_index = 0; part_index < entity->part_count; ++part_index) {
+			const struct entity_part *part = entity->parts + part_index;
+			if (part_index == part->parent_index)
+				continue;
+
+			links->child[count] = entity->part_base + part_index;
+			links->parent[count] = entity->part_base + part->parent_index;
+			links->rest_length[count] = part->length;
+			links->k[count] = 10.0f + part->stiffness;
+			++count;
+		}
+	}
+
+	links->first_link[game->entity_count] = count;
+	links->count = count;
+	links->dirty = false;
+}
+
+static void
+compute_spring_links_scalar(const struct part_store *store, struct spring_links *links, u32 begin, u32 end)
+{
+	for (u32 i = begin; i < end; ++i) {
+		u32 child = links->child[i];
+		u32 parent = links->parent[i];
+
+		struct v2 child_p = store->p[child];
+		struct v2 parent_p = store->p[parent];
+
+		struct v2 offset = sub_v2(child_p, parent_p);
+		struct v2 ideal = add_v2(parent_p, scale_v2(normalize_v2(offset), links->rest_length[i]));
+		struct v2 d = sub_v2(ideal, child_p);
+
+		f32 force = len_v2(d) * links->k[i];
+		f32 child_scale = force * store->inv_mass[child];
+		f32 parent_scale = -force * store->inv_mass[parent];
+
+		links->child_ax[i] = d.x * child_scale;
+		links->child_ay[i] = d.y * child_scale;
+		links->parent_ax[i] = d.x * parent_scale;
+		links->parent_ay[i] = d.y * parent_scale;
+	}
+}
+
+#if defined(__SSE2__)
+/* NOTE(omid): Same operations in the same order as the scalar kernel, so the
+   results are bit-identical; normalize_v2's zero check becomes a mask. */
+static void
+compute_spring_links_sse2(const struct part_store *store, struct spring_links *links, u32 begin, u32 end)
+{
+	const f32 *p = (const f32 *)store->p;
+	const f32 *inv_mass = store->inv_mass;
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 sign = _mm_set1_ps(-0.0f);
+
+	u32 i = begin;
+	for (; i + 4 <= end; i += 4) {
+		const u32 *c = links->child + i;
+		const u32 *q = links->parent + i;
+
+		__m128 cx = _mm_set_ps(p[2 * c[3]], p[2 * c[2]], p[2 * c[1]], p[2 * c[0]]);
+		__m128 cy = _mm_set_ps(p[2 * c[3] + 1], p[2 * c[2] + 1], p[2 * c[1] + 1], p[2 * c[0] + 1]);
+		__m128 px = _mm_set_ps(p[2 * q[3]], p[2 * q[2]], p[2 * q[1]], p[2 * q[0]]);
+		__m128 py = _mm_set_ps(p[2 * q[3] + 1], p[2 * q[2] + 1], p[2 * q[1] + 1], p[2 * q[0] + 1]);
+		__m128 child_inv_mass = _mm_set_ps(inv_mass[c[3]], inv_mass[c[2]], inv_mass[c[1]], inv_mass[c[0]]);
+		__m128 parent_inv_mass = _mm_set_ps(inv_mass[q[3]], inv_mass[q[2]], inv_mass[q[1]], inv_mass[q[0]]);
+
+		__m128 ox = _mm_sub_ps(cx, px);
+		__m128 oy = _mm_sub_ps(cy, py);
+		__m128 len = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(ox, ox), _mm_mul_ps(oy, oy)));
+		__m128 nonzero = _mm_cmpneq_ps(len, zero);
+		__m128 nx = _mm_and_ps(_mm_div_ps(ox, len), nonzero);
+		__m128 ny = _mm_and_ps(_mm_div_ps(oy, len), nonzero);
+
+		__m128 rest_length = _mm_loadu_ps(links->rest_length + i);
+		__m128 dx = _mm_sub_ps(_mm_add_ps(px, _mm_mul_ps(nx, rest_length)), cx);
+		__m128 dy = _mm_sub_ps(_mm_add_ps(py, _mm_mul_ps(ny, rest_length)), cy);
+
+		__m128 force = _mm_mul_ps(_mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy))), _mm_loadu_ps(links->k + i));
+		__m128 child_scale = _mm_mul_ps(force, child_inv_mass);
+		__m128 parent_scale = _mm_mul_ps(_mm_xor_ps(force, sign), parent_inv_mass);
+
+		_mm_storeu_ps(links->child_ax + i, _mm_mul_ps(dx, child_scale));
+		_mm_storeu_ps(links->child_ay + i, _mm_mul_ps(dy, child_scale));
+		_mm_storeu_ps(links->parent_ax + i, _mm_mul_ps(dx, parent_scale));
+		_mm_storeu_ps(links->parent_ay + i, _mm_mul_ps(dy, parent_scale));
+	}
+
+	compute_spring_links_scalar(store, links, i, end);
+}
+
+__attribute__((target("avx2")))
+static void
+compute_spring_links_avx2(const struct part_store *store, struct spring_links *links, u32 begin, u32 end)
+{
+	const f32 *p = (const f32 *)store->p;
+	const f32 *inv_mass = store->inv_mass;
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256 sign = _mm256_set1_ps(-0.0f);
+	const __m256i one = _mm256_set1_epi32(1);
+
+	u32 i = begin;
+	for (; i + 8 <= end; i += 8) {
+		__m256i c = _mm256_loadu_si256((const __m256i *)(const void *)(links->child + i));
+		__m256i q = _mm256_loadu_si256((const __m256i *)(const void *)(links->parent + i));
+		__m256i c2 = _mm256_slli_epi32(c, 1);
+		__m256i q2 = _mm256_slli_epi32(q, 1);
+
+		__m256 cx = _mm256_i32gather_ps(p, c2, 4);
+		__m256 cy = _mm256_i32gather_ps(p, _mm256_add_epi32(c2, one), 4);
+		__m256 px = _mm256_i32gather_ps(p, q2, 4);
+		__m256 py = _mm256_i32gather_ps(p, _mm256_add_epi32(q2, one), 4);
+		__m256 child_inv_mass = _mm256_i32gather_ps(inv_mass, c, 4);
+		__m256 parent_inv_mass = _mm256_i32gather_ps(inv_mass, q, 4);
+
+		__m256 ox = _mm256_sub_ps(cx, px);
+		__m256 oy = _mm256_sub_ps(cy, py);
+		__m256 len = _mm256_sqrt_ps(_mm256_add_ps(_mm256_mul_ps(ox, ox), _mm256_mul_ps(oy, oy)));
+		__m256 nonzero = _mm256_cmp_ps(len, zero, _CMP_NEQ_UQ);
+		__m256 nx = _mm256_and_ps(_mm256_div_ps(ox, len), nonzero);
+		__m256 ny = _mm256_and_ps(_mm256_div_ps(oy, len), nonzero);
+
+		__m256 rest_length = _mm256_loadu_ps(links->rest_length + i);
+		__m256 dx = _mm256_sub_ps(_mm256_add_ps(px, _mm256_mul_ps(nx, rest_length)), cx);
+		__m256 dy = _mm256_sub_ps(_mm256_add_ps(py, _mm256_mul_ps(ny, rest_length)), cy);
+
+		__m256 force = _mm256_mul_ps(_mm256_sqrt_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy))), _mm256_loadu_ps(links->k + i));
+		__m256 child_scale = _mm256_mul_ps(force, child_inv_mass);
+		__m256 parent_scale = _mm256_mul_ps(_mm256_xor_ps(force, sign), parent_inv_mass);
+
+		_mm256_storeu_ps(links->child_ax + i, _mm256_mul_ps(dx, child_scale));
+		_mm256_storeu_ps(links->child_ay + i, _mm256_mul_ps(dy, child_scale));
+		_mm256_storeu_ps(links->parent_ax + i, _mm256_mul_ps(dx, parent_scale));
+		_mm256_storeu_ps(links->parent_ay + i, _mm256_mul_ps(dy, parent_scale));
+	}
+
+	compute_spring_links_scalar(store, links, i, end);
+}
+#endif
+
+static enum spring_kernel
+select_spring_kernel(void)
+{
+#if defined(__SSE2__)
+	if (SDL_HasAVX2())
+		return SPRING_KERNEL_AVX2;
+	return SPRING_KERNEL_SSE2;
+#else
+	return SPRING_KERNEL_SCALAR;
+#endif
+}
+
+static void
+compute_spring_links(const struct part_store *store, struct spring_links *links, enum spring_kernel kernel, u32 begin, u32 end)
+{
+	switch (kernel) {
+#if defined(__SSE2__)
+	case SPRING_KERNEL_AVX2:
+		compute_spring_links_avx2(store, links, begin, end);
+		break;
+
+	case SPRING_KERNEL_SSE2:
+		compute_spring_links_sse2(store, links, begin, end);
+		break;
+#endif
+	default:
+		compute_spring_links_scalar(store, links, begin, end);
+		break;
+	}
+}
+
+struct physics_job {
+	struct game_state *game;
+	enum spring_kernel kernel;
+	u32 chunk_entity_count;
+};
+
+/* NOTE(omid): A few jobs per worker to steal from, or one job for everything
+   when there is nobody to share with. */
+static struct physics_job
+make_physics_job(struct game_state *game)
+{
+	struct physics_job result = { .game = game, .kernel = spring_kernel };
+	if (job_pool.worker_count <= 1)
+		result.chunk_entity_count = game->entity_count;
+	else
+		result.chunk_entity_count = game->entity_count / (job_pool.worker_count * 4);
+	if (result.chunk_entity_count < PHYSICS_CHUNK_ENTITY_COUNT)
+		result.chunk_entity_count = PHYSICS_CHUNK_ENTITY_COUNT;
+	return result;
+}
+
+static u32
+physics_job_chunk_count(const struct physics_job *job)
+{
+	return (job->game->entity_count + job->chunk_entity_count - 1) / job->chunk_entity_count;
+}
+
+/* NOTE(omid): Springs never cross entities, so a run of entities owns all
+   the accelerations its links write. Within a run the passes go in the same
+   order as over the whole list, which keeps the result the same however the
+   entities are split up. */
+static void
+update_spring_run(struct game_state *game, enum spring_kernel kernel, u32 first_entity, u32 end_entity)
+{
+	struct part_store *store = &game->parts;
+	struct spring_links *links = &game->springs;
+	u32 begin = links->first_link[first_entity];
+	u32 end = links->first_link[end_entity];
+
+	compute_spring_links(store, links, kernel, begin, end);
+
+	/* NOTE(omid): Every part is the child of at most one link, so this pass
+	   has no conflicting writes. */
+	for (u32 i = begin; i < end; ++i) {
+		struct v2 *a = store->a + links->child[i];
+		a->x += links->child_ax[i];
+		a->y += links->child_ay[i];
+	}
+
+	/* NOTE(omid): Parents are shared between links, scatter the reactions serially. */
+	for (u32 i = begin; i < end; ++i) {
+		struct v2 *a = store->a + links->parent[i];
+		a->x += links->parent_ax[i];
+		a->y += links->parent_ay[i];
+	}
+
+	for (u32 entity_index = first_entity; entity_index < end_entity; ++entity_index) {
+		struct entity *entity = game->entities + entity_index;
+		struct part_span parts = get_part_span(game, entity);
+		for (u32 part_index = 0; part_index < entity->part_count; ++part_index)
+			parts.a[part_index] = sub_v2(parts.a[part_index], scale_v2(parts.v[part_index], 0.2f));
+	}
+}
+
+/* NOTE(omid): Runs of awake entities in the chunk, sleeping ones are skipped. */
+static void
+update_spring_chunk(void *data, u32 worker_index, u32 chunk_index)
+{
+	(void)worker_index;
+	struct physics_job *job = (struct physics_job *)data;
+	struct game_state *game = job->game;
+
+	u32 first_entity = chunk_index * job->chunk_entity_count;
+	u32 end_entity = (u32)min((s32)(first_entity + job->chunk_entity_count), (s32)game->entity_count);
+	u32 entity_index = first_entity;
+	while (entity_index < end_entity) {
+		if (game->entities[entity_index].asleep) {
+			++entity_index;
+			continue;
+		}
+
+		u32 run_end = entity_index + 1;
+		while (run_end < end_entity && !game->entities[run_end].asleep)
+			++run_end;
+		update_spring_run(game, job->kernel, entity_index, run_end);
+		entity_index = run_end;
+	}
+}
+
+static void
+update_spring_physics_(struct game_state *game, enum spring_kernel kernel)
+{
+	struct spring_links *links = &game->springs;
+
+	if (links->dirty)
+		build_spring_links(game);
+
+	struct physics_job job = make_physics_job(game);
+	job.kernel = kernel;
+	run_jobs(&job_pool, physics_job_chunk_count(&job), update_spring_chunk, &job);
+}
+
+static void
+update_spring_physics(struct game_state *game)
+{
+	update_spring_physics_(game, spring_kernel);
+}
+
+/* NOTE(omid): The original one link at a time solver, kept as the reference
+   the spring kernels are checked against in the benchmark. */
+static void
+update_spring_physics_reference(struct game_state *game)
+{
+	for (u32 entity_index = 0; entity_index < game->entity_count; ++entity_index) {
+		struct entity *entity = game->entities + entity_index;
+		struct part_span parts = get_part_span(game, entity);
+		for (u32 part_index = 0; part_index < entity->part_count; ++part_index) {
+			const struct entity_part *part = entity->parts + part_index;
+			if (part_index != part->parent_index) {
+				u32 parent_index = part->parent_index;
+        
+				struct v2 offset = sub_v2(parts.p[part_index], parts.p[parent_index]);
+				struct v2 ideal = add_v2(parts.p[parent_index], scale_v2(normalize_v2(offset), part->length));
+				struct v2 d = sub_v2(ideal, parts.p[part_index]);
+
+				const f32 K = 10.0f + part->stiffness;
+				f32 force = len_v2(d) * K;
+
+				parts.a[part_index] = add_v2(parts.a[part_index], scale_v2(d, force * parts.inv_mass[part_index]));
+				parts.a[parent_index] = add_v2(parts.a[parent_index], scale_v2(d, -force * parts.inv_mass[parent_index]));
+			}
+			parts.a[part_index] = sub_v2(parts.a[part_index], scale_v2(parts.v[part_index], 0.2f));
+		}
+	}
+}
+
+/* NOTE(omid): A part overlapping another, found by a newtonian job. Slots are
+   collision grid slots. The forces are what the collision response adds to
+   the two parts, zero unless both are solid. interaction is the
+   collision_interactions entry of the pair. */
+struct collision_contact {
+	struct v2 force;
+	struct v2 other_force;
+	u32 slot;
+	u32 other_slot;
+	b32 respond;
+	u32 interaction;
+};
+
+/* NOTE(omid): The contacts found by one worker, in the order it found them. */
+struct collision_contact_list {
+	struct collision_contact *contacts;
+	u32 count;
+	u32 capacity;
+};
+
+/* NOTE(omid): Where the contacts of a chunk of entities went. */
+struct collision_chunk {
+	u32 worker_index;
+	u32 first;
+	u32 count;
+};
+
+static struct collision_contact_list worker_contacts[MAX_WORKER_COUNT];
+static struct collision_chunk *collision_chunks;
+static u32 collision_chunk_capacity;
+
+static struct collision_contact *
+push_collision_contact(struct collision_contact_list *list)
+{
+	if (list->count == list->capacity) {
+		list->capacity = list->capacity ? list->capacity * 2 : 256;
+		list->contacts = realloc(list->contacts, list->capacity * sizeof(struct collision_contact));
+		assert(list->contacts);
+	}
+	return list->contacts + list->count++;
+}
+
+#define NARROWPHASE_BATCH_SIZE 64
+
+/* NOTE(omid): The contacts of the obstacles a part hit, in obstacle order. */
+static void
+push_collision_contacts(const struct game_state *game, const struct entity *entity, const struct entity_part *part, struct v2 v,
+                        const struct box_obstacle *obstacles, const u32 *obstacle_slots, const b32 *hits, u32 count,
+                        struct collision_contact_list *contacts)
+{
+	const struct part_store *store = &game->parts;
+	f32 mass = store->mass[entity->part_base + part->index];
+
+	for (u32 i = 0; i < count; ++i) {
+		if (!hits[i])
+			continue;
+
+		u32 slot = obstacle_slots[i];
+		const struct entity *other = game->entities + slot / MAX_ENTITY_PART_COUNT;
+		const struct entity_part *other_part = other->parts + slot % MAX_ENTITY_PART_COUNT;
+		u32 other_slot_index = other->part_base + other_part->index;
+
+		struct collision_contact *contact = push_collision_contact(contacts);
+		contact->slot = entity->index * MAX_ENTITY_PART_COUNT + part->index;
+		contact->other_slot = slot;
+		contact->respond = obstacles[i].respond;
+		contact->interaction = collision_interactions[collision_class_of_layer(part->collision_layer)][collision_class_of_layer(other_part->collision_layer)];
+		contact->force = v2(0, 0);
+		contact->other_force = v2(0, 0);
+
+		if (contact->respond) {
+			/* struct v2 d = normalize_v2(sub_v2(op->p, part->p)); */
+			struct v2 d = normalize_v2(v);
+			f32 v1 = dot_v2(v, d);
+			f32 v2 = dot_v2(store->v[other_slot_index], d);
+			f32 other_mass = store->mass[other_slot_index];
+			f32 total_mass = mass + other_mass;
+			f32 dv = v1 - v2;
+
+			f32 f1 = -dv * other_mass / total_mass * 2;
+			f32 f2 = dv * mass / total_mass * 2;
+
+#if 0
+			printf("Collision (%u,%u) <=> (%u,%u)\n", entity_index, part_index, other_index, other_part_index);
+			printf("\tV1: %f, V2: %f, M1: %f, M2: %f, DV: %f\n", (f64)v1, (f64)v2, (f64)part->mass, (f64)op->mass, (f64)dv);
+			printf("\tF1: %f, F2: %f\n", (f64)(f1), (f64)(f2));
+#endif
+			contact->force = scale_v2(d, f1);
+			contact->other_force = scale_v2(d, f2);
+		}
+	}
+}
+
+/* NOTE(omid): Runs on the job workers, against the grid and the part store
+   as they were when the pass started. Only new_p, the worker's candidate
+   bitset and its contact list are written; update_newtonian_physics applies
+   the contacts afterwards. */
+static void
+check_for_collisions_against_entities(const struct game_state *game, const struct entity *entity, const struct entity_part *part,
+                                      u64 *candidates, struct collision_contact_list *contacts, struct v2 *new_p, struct v2 v)
+{
+	const struct collision_grid *grid = &game->collision_grid;
+	const struct part_store *store = &game->parts;
+	u32 slot_index = entity->part_base + part->index;
+	struct v2 p = store->p[slot_index];
+	f32 size = store->size[slot_index];
+
+	struct box_obstacle obstacles[NARROWPHASE_BATCH_SIZE];
+	u32 obstacle_slots[NARROWPHASE_BATCH_SIZE];
+	b32 hits[NARROWPHASE_BATCH_SIZE];
+	u32 obstacle_count = 0;
+
+	/* NOTE(omid): Gather every part in the cells within reach into a bitset
+	   keyed by slot. Walking the set bits in order visits candidates in
+	   (entity, part) order, exactly like the brute force loop did. */
+	f32 reach = size + grid->max_part_size;
+	s32 min_x = collision_grid_coordinate(p.x - reach, COLLISION_GRID_WIDTH);
+	s32 max_x = collision_grid_coordinate(p.x + reach, COLLISION_GRID_WIDTH);
+	s32 min_y = collision_grid_coordinate(p.y - reach, COLLISION_GRID_HEIGHT);
+	s32 max_y = collision_grid_coordinate(p.y + reach, COLLISION_GRID_HEIGHT);
+
+	u32 min_word = grid->slot_count / 64;
+	u32 max_word = 0;
+	for (s32 y = min_y; y <= max_y; ++y) {
+		for (s32 x = min_x; x <= max_x; ++x) {
+			u32 slot = grid->first_in_cell[y * COLLISION_GRID_WIDTH + x];
+			while (slot != COLLISION_GRID_NONE) {
+				u32 word_index = slot / 64u;
+				candidates[word_index] |= 1ull << (slot % 64u);
+				if (word_index < min_word)
+					min_word = word_index;
+				if (word_index > max_word)
+					max_word = word_index;
+				slot = grid->next_in_cell[slot];
+			}
+		}
+	}
+
+	for (u32 word_index = min_word; word_index <= max_word; ++word_index) {
+		u64 word = candidates[word_index];
+		candidates[word_index] = 0;
+		while (word) {
+			u32 slot = word_index * 64 + (u32)__builtin_ctzll(word);
+			word &= word - 1;
+
+			u32 other_index = slot / MAX_ENTITY_PART_COUNT;
+			u32 other_part_index = slot % MAX_ENTITY_PART_COUNT;
+
+			if (other_index == entity->index && (!entity->internal_collisions || !part->internal_collisions))
+				continue;
+
+			const struct entity *other = game->entities + other_index;
+
+			if (other->z < 1)
+				continue;
+
+			if (other_index == entity->index && part->index == other_part_index)
+				continue;
+
+			const struct entity_part *other_part = other->parts + other_part_index;
+
+			if (other_index == entity->index && !other_part->internal_collisions)
+				continue;
+
+			/* NOTE(omid): Neither solid both nor able to interact, not worth a
+			   narrowphase test. */
+			if (!(part->collision_mask & other_part->collision_layer))
+				continue;
+
+			u32 other_slot_index = other->part_base + other_part_index;
+			struct box_obstacle *obstacle = obstacles + obstacle_count;
+			obstacle->p = store->p[other_slot_index];
+			obstacle->size = store->size[other_slot_index];
+			obstacle->respond = (part->collision_layer & other_part->collision_layer & COLLISION_LAYER_SOLID) != 0;
+			obstacle_slots[obstacle_count++] = slot;
+
+			if (obstacle_count == NARROWPHASE_BATCH_SIZE) {
+				collide_part_with_boxes(p, size, v, obstacles, obstacle_count, new_p, hits);
+				push_collision_contacts(game, entity, part, v, obstacles, obstacle_slots, hits, obstacle_count, contacts);
+				obstacle_count = 0;
+			}
+		}
+	}
+
+	collide_part_with_boxes(p, size, v, obstacles, obstacle_count, new_p, hits);
+	push_collision_contacts(game, entity, part, v, obstacles, obstacle_slots, hits, obstacle_count, contacts);
+}
+
+/* NOTE(omid): The events a contact triggers see the suspensions of the
+   contacts applied before it, same as when everything ran in one loop. */
+static void
+apply_collision_contact(struct game_state *game, const struct collision_contact *contact)
+{
+	struct part_store *store = &game->parts;
+	struct entity *entity = game->entities + contact->slot / MAX_ENTITY_PART_COUNT;
+	struct entity_part *part = entity->parts + contact->slot % MAX_ENTITY_PART_COUNT;
+	struct entity *other = game->entities + contact->other_slot / MAX_ENTITY_PART_COUNT;
+	struct entity_part *other_part = other->parts + contact->other_slot % MAX_ENTITY_PART_COUNT;
+
+	if (contact->interaction && check_suspension(entity, part, other, other_part)) {
+		interaction_function *function = interaction_functions[contact->interaction & ~(u32)INTERACTION_SWAPPED];
+		if (contact->interaction & INTERACTION_SWAPPED)
+			function(game, other, entity, part);
+		else
+			function(game, entity, other, other_part);
+	}
+
+	if (contact->respond) {
+		u32 slot_index = entity->part_base + part->index;
+		u32 other_slot_index = other->part_base + other_part->index;
+		store->force[slot_index] = add_v2(store->force[slot_index], contact->force);
+		store->force[other_slot_index] = add_v2(store->force[other_slot_index], contact->other_force);
+
+		if (other->asleep && dot_v2(contact->other_force, contact->other_force) > SLEEP_ACCELERATION * SLEEP_ACCELERATION)
+			wake_entity(other);
+	}
+}
+
+static void
+force_entity_part_within_bounds(struct v2 *p, struct v2 *v, struct v2 *a)
+{	
+	if (isnan(p->x))
+		p->x = 0;
+	if (isnan(p->y))
+		p->y = 0;
+			
+	if (p->x < 0) {
+		p->x = 0;
+		v->x = -v->x * 0.4f;
+		a->x = 0;
+	} else if (p->x > WINDOW_WIDTH) {
+		p->x = WINDOW_WIDTH;
+		v->x = -v->x * 0.4f;
+		a->x = 0;
+	}
+
+	if (p->y < 0) {
+		p->y = 0;
+		v->y = -v->y * 0.4f;
+		a->y = 0;
+	} else if (p->y > WINDOW_HEIGHT) {
+		p->y = WINDOW_HEIGHT;
+		v->y = -v->y * 0.4f;
+		a->y = 0;
+	}
+}
+
+/* NOTE(omid): Before the springs run, whatever input, AI or the collisions of
+   the last step pushed wakes up. */
+static void
+wake_pushed_entities(struct game_state *game)
+{
+	for (u32 entity_index = 0; entity_index < game->entity_count; ++entity_index) {
+		struct entity *entity = game->entities + entity_index;
+		if (!entity->asleep)
+			continue;
+
+		struct part_span parts = get_part_span(game, entity);
+		for (u32 part_index = 0; part_index < entity->part_count; ++part_index) {
+			if (dot_v2(parts.a[part_index], parts.a[part_index]) > SLEEP_ACCELERATION * SLEEP_ACCELERATION) {
+				wake_entity(entity);
+				break;
+			}
+		}
+	}
+}
+
+/* NOTE(omid): The parts of an entity are all tied together by springs, so
+   every entity is one island and sleeps as a whole. Called once it has
+   moved. */
+static void
+update_entity_sleep(struct game_state *game, struct entity *entity)
+{
+	if (entity->asleep)
+		return;
+
+	struct part_span parts = get_part_span(game, entity);
+	for (u32 part_index = 0; part_index < entity->part_count; ++part_index) {
+		if (dot_v2(parts.v[part_index], parts.v[part_index]) > SLEEP_VELOCITY * SLEEP_VELOCITY ||
+		    dot_v2(parts.a[part_index], parts.a[part_index]) > SLEEP_ACCELERATION * SLEEP_ACCELERATION) {
+			entity->still_frame_count = 0;
+			return;
+		}
+	}
+
+	if (++entity->still_frame_count < SLEEP_FRAME_COUNT)
+		return;
+
+	entity->asleep = true;
+	for (u32 part_index = 0; part_index < entity->part_count; ++part_index)
+		parts.v[part_index] = v2(0, 0);
+}
+
+static void
+integrate_newtonian_chunk(void *data, u32 worker_index, u32 chunk_index)
+{
+	struct physics_job *job = (struct physics_job *)data;
+	struct game_state *game = job->game;
+	struct part_store *store = &game->parts;
+	struct collision_contact_list *contacts = worker_contacts + worker_index;
+	u64 *candidates = game->collision_grid.candidates + worker_index * ((game->collision_grid.slot_count + 63) / 64);
+
+	struct collision_chunk *chunk = collision_chunks + chunk_index;
+	chunk->worker_index = worker_index;
+	chunk->first = contacts->count;
+
+	u32 first_entity = chunk_index * job->chunk_entity_count;
+	u32 end_entity = (u32)min((s32)(first_entity + job->chunk_entity_count), (s32)game->entity_count);
+	for (u32 entity_index = first_entity; entity_index < end_entity; ++entity_index) {
+		const struct entity *entity = game->entities + entity_index;
+		if (entity->asleep) {
+			for (u32 part_index = 0; part_index < entity->part_count; ++part_index) {
+				u32 slot_index = entity->part_base + part_index;
+				store->next_p[slot_index] = store->p[slot_index];
+				store->next_v[slot_index] = store->v[slot_index];
+			}
+			continue;
+		}
+
+		for (u32 part_index = 0; part_index < entity->part_count; ++part_index) {
+			const struct entity_part *part = entity->parts + part_index;
+			u32 slot_index = entity->part_base + part_index;
+			struct v2 orig_new_v = add_v2(store->v[slot_index], store->a[slot_index]);
+			struct v2 new_v = orig_new_v;
+			if (len_v2(new_v) > 10)
+				new_v = scale_v2(normalize_v2(new_v), 10);
+
+			struct v2 new_p = add_v2(store->p[slot_index], new_v);
+
+			if (entity->z > 1)
+				check_for_collisions_against_entities(game, entity, part, candidates, contacts, &new_p, new_v);
+
+			if (len_v2(new_v) > 10)
+				new_v = scale_v2(normalize_v2(new_v), 10);
+
+			store->next_p[slot_index] = new_p;
+			store->next_v[slot_index] = new_v;
+		}
+	}
+
+	chunk->count = contacts->count - chunk->first;
+}
+
+/* NOTE(omid): Two passes. The jobs integrate every part and collide it with
+   the others where they stood when the pass started, collecting contacts
+   per worker. Then the contacts are applied and the parts moved serially, in
+   entity order, so events and force sums come out the same for any number
+   of threads. */
+static void
+update_newtonian_physics(struct game_state *game)
+{
+	struct part_store *store = &game->parts;
+	struct physics_job job = make_physics_job(game);
+	u32 chunk_count = physics_job_chunk_count(&job);
+	if (chunk_count > collision_chunk_capacity) {
+		collision_chunk_capacity = chunk_count;
+		collision_chunks = realloc(collision_chunks, collision_chunk_capacity * sizeof(struct collision_chunk));
+		assert(collision_chunks);
+	}
+
+	for (u32 worker_index = 0; worker_index < MAX_WORKER_COUNT; ++worker_index)
+		worker_contacts[worker_index].count = 0;
+
+	run_jobs(&job_pool, chunk_count, integrate_newtonian_chunk, &job);
+
+	for (u32 chunk_index = 0; chunk_index < chunk_count; ++chunk_index) {
+		const struct collision_chunk *chunk = collision_chunks + chunk_index;
+		const struct collision_contact *contact = worker_contacts[chunk->worker_index].contacts + chunk->first;
+		const struct collision_contact *end_contact = contact + chunk->count;
+
+		u32 first_entity = chunk_index * job.chunk_entity_count;
+		u32 end_entity = (u32)min((s32)(first_entity + job.chunk_entity_count), (s32)game->entity_count);
+		for (u32 entity_index = first_entity; entity_index < end_entity; ++entity_index) {
+			struct entity *entity = game->entities + entity_index;
+			for (u32 part_index = 0; part_index < entity->part_count; ++part_index) {
+				u32 slot = entity_index * MAX_ENTITY_PART_COUNT + part_index;
+				for (; contact < end_contact && contact->slot == slot; ++contact)
+					apply_collision_contact(game, contact);
+
+				u32 slot_index = entity->part_base + part_index;
+				if (!entity->fixed) {
+					store->p[slot_index] = store->next_p[slot_index];
+					store->v[slot_index] = store->next_v[slot_index];
+				}
+
+				force_entity_part_within_bounds(store->p + slot_index, store->v + slot_index, store->a + slot_index);
+				collision_grid_move(&game->collision_grid, entity_index, part_index, store->p[slot_index], store->size[slot_index]);
+			}
+
+			update_entity_sleep(game, entity);
+		}
+		assert(contact == end_contact);
+	}
+
+	game->asleep_entity_count = 0;
+	for (u32 entity_index = 0; entity_index < game->entity_count; ++entity_index)
+		game->asleep_entity_count += game->entities[entity_index].asleep;
+	game->awake_entity_count = game->entity_count - game->asleep_entity_count;
+}
+
+static void
+process_seed_touch_water_events(struct game_state *game, const struct game_event_bucket *bucket)
+{
+	for (const struct game_event_block *block = bucket->first; block; block = block->next) {
+		for (u32 event_index = 0; event_index < block->count; ++event_index) {
+			const struct generic_collision_event *e = &block->events[event_index].seed_touch_water;
+			struct entity *seed = game->entities + e->e1;
+			struct entity *water = game->entities + e->e2;
+			struct entity_part *droplet = water->parts + e->p2;
+
+			droplet->disposed = true;
+			/* seed->disposed = true; */
+			/* struct entity *food = push_entity(game); */
+
+			struct v2 p = get_part_span(game, seed).p[0];
+			init_food(game, seed);
+			get_part_span(game, seed).p[0] = p;
+
+			/* food->parts->p = seed->parts->p; */
+			/* food->parts->v = seed->parts->v; */
+		}
+	}
+}
+
+static void
+process_worm_eat_food_events(struct game_state *game, const struct game_event_bucket *bucket)
+{
+	for (const struct game_event_block *block = bucket->first; block; block = block->next) {
+		for (u32 event_index = 0; event_index < block->count; ++event_index) {
+			const struct generic_collision_event *e = &block->events[event_index].worm_eat_food;
+			struct entity *worm = game->entities + e->e1;
+			struct entity *food = game->entities + e->e2;
+			struct entity_part *food_part = food->parts + e->p2;
+
+			food_part->disposed = true;
+
+			bool worm_full = true;
+			bool worm_hydrated = true;
+
+			for (u32 i = 0; i < worm->part_count; ++i) {
+				if (!worm->parts[i].content)
+					worm_full = false;
+				if (!worm->parts[i].hydration)
+					worm_hydrated = false;
+			}
+						
+			if (food_part->content_value) {
+				for (u32 i = 0; i < worm->part_count; ++i) {
+					if (!worm->parts[i].content) {
+						worm->parts[i].content = (u8)food_part->color;
+						worm->parts[i].content_value = food_part->content_value;
+						worm_full = i == (worm->part_count - 1);
+						break;
+					}
+				}
+			} else if (food->type & ENTITY_WATER) {
+				for (u32 i = 0; i < worm->part_count; ++i) {
+					if (!worm->parts[i].hydration) {
+						worm->parts[i].hydration = 1;
+						worm->parts[i].color = 4;
+						worm_hydrated = i == (worm->part_count - 1);
+						break;
+					}
+				}
+			}
+
+			if (worm_full && worm_hydrated) {
+#if 0
+				u32 score = 0;
+				u32 multiplier = 1;
+				for (u32 i = 0; i < worm->part_count; ++i) {
+					score += multiplier * worm->parts[i].content_value;
+					multiplier += worm->parts[i].content_value;
+					worm->parts[i].content = 0;
+					worm->parts[i].content_value = 0;
+					worm->parts[i].hydration = 0;
+					worm->parts[i].color = 2;
+				}
+				game->score += score;
+				/* push_worm_tail(worm); */
+#else
+				if (worm->part_count == 2) {
+					u8 poop = 0;
+					if (worm->parts[0].content == 2 &&
+					    worm->parts[1].content == 2) {
+						poop = 3;
+					} else if (worm->parts[0].content == 4 &&
+						   worm->parts[1].content == 4) {
+						poop = 5;
+					}
+
+					if (poop && can_push_entity(game)) {
+						struct entity *gem = init_gem(game, push_entity(game), poop);
+						gem->expiration_t = game->level_end_t;
+						gem->z = 1;
+						gem->accum_z = 1;
+
+						/* NOTE(omid): push_entity may have moved the entities. */
+						worm = game->entities + e->e1;
+
+						struct part_span worm_parts = get_part_span(game, worm);
+						struct part_span gem_parts = get_part_span(game, gem);
+
+						struct v2 d = sub_v2(worm_parts.p[worm->part_count - 1], worm_parts.p[worm->part_count - 2]);
+						gem_parts.p[0] = add_v2(worm_parts.p[worm->part_count - 1], d);
+						gem_parts.v[0] = scale_v2(d, 100);
+					}
+				}
+
+				for (u32 i = 0; i < worm->part_count; ++i) {
+					worm->parts[i].content = 0;
+					worm->parts[i].content_value = 0;
+					worm->parts[i].hydration = 0;
+					worm->parts[i].color = 2;
+				}
+
+				
+#endif
+				
+				
+				
+				/* end_level(game); */
+			}
+			/* push_worm_tail(worm); */
+		}
+	}
+}
+
+static void
+process_water_eater_eat_water_events(struct game_state *game, const struct game_event_bucket *bucket)
+{
+	for (const struct game_event_block *block = bucket->first; block; block = block->next) {
+		for (u32 event_index = 0; event_index < block->count; ++event_index) {
+			const struct generic_collision_event *e = &block->events[event_index].water_eater_eat_water;
+			struct entity *water = game->entities + e->e2;
+			struct entity_part *droplet = water->parts + e->p2;
+
+			droplet->disposed = true;
+		}
+	}
+}
+
+static void
+process_gem_touch_socket_events(struct game_state *game, const struct game_event_bucket *bucket)
+{
+	for (const struct game_event_block *block = bucket->first; block; block = block->next) {
+		for (u32 event_index = 0; event_index < block->count; ++event_index) {
+			const struct generic_collision_event *e = &block->events[event_index].gem_touch_socket;
+			struct entity *gem = game->entities + e->e1;
+			struct entity *socket = game->entities + e->e2;
+			struct entity_part *part = socket->parts + e->p2;
+
+			if (!part->content && part->accept == gem->parts->color) {
+				gem->disposed = true;
+				part->content = (u8)gem->parts->color;
+			}
+		}
+	}
+}
+
+/* NOTE(omid): One type after the other, in the order of game_event_type. */
+static void
+process_triggered_events(struct game_state *game)
+{
+	process_seed_touch_water_events(game, game->events + GAME_EVENT_SEED_TOUCH_WATER);
+	process_worm_eat_food_events(game, game->events + GAME_EVENT_WORM_EAT_FOOD);
+	process_water_eater_eat_water_events(game, game->events + GAME_EVENT_WATER_EATER_EAT_WATER);
+	process_gem_touch_socket_events(game, game->events + GAME_EVENT_GEM_TOUCH_SOCKET);
+}
+
+static u32 voice_budget = DEFAULT_VOICE_BUDGET;
+static u32 max_entity_count = DEFAULT_MAX_ENTITY_COUNT;
+
+static void
+init_voice_exchange(struct voice_exchange *voices)
+{
+	SDL_AtomicSet(&voices->published, 0);
+	voices->write_index = 1;
+	voices->read_index = 2;
+	voices->voice_budget = voice_budget;
+}
+
+static s32
+compare_voices_by_freq(const void *x, const void *y)
+{
+	const struct voice *a = (const struct voice *)x;
+	const struct voice *b = (const struct voice *)y;
+	if (a->freq != b->freq)
+		return a->freq < b->freq ? -1 : 1;
+	if (a->amp > b->amp)
+		return -1;
+	if (a->amp < b->amp)
+		return 1;
+	return a->slot < b->slot ? -1 : (a->slot > b->slot);
+}
+
+static s32
+compare_voices_by_amp(const void *x, const void *y)
+{
+	const struct voice *a = (const struct voice *)x;
+	const struct voice *b = (const struct voice *)y;
+	if (a->amp > b->amp)
+		return -1;
+	if (a->amp < b->amp)
+		return 1;
+	return a->slot < b->slot ? -1 : (a->slot > b->slot);
+}
+
+/* NOTE(omid): Voices are expected to be audible already. Voices on the same
+   freq merge into the loudest of them, then only the budget loudest are
+   kept. Returns the new count. */
+static u32
+cull_voices(struct voice *voices, u32 count, u32 budget)
+{
+	if (count == 0)
+		return 0;
+
+	qsort(voices, count, sizeof(struct voice), compare_voices_by_freq);
+
+	u32 merged_count = 1;
+	for (u32 i = 1; i < count; ++i) {
+		struct voice *last = voices + merged_count - 1;
+		if (voices[i].freq == last->freq)
+			last->amp += voices[i].amp;
+		else
+			voices[merged_count++] = voices[i];
+	}
+
+	if (merged_count > budget) {
+		qsort(voices, merged_count, sizeof(struct voice), compare_voices_by_amp);
+		merged_count = budget;
+	}
+
+	return merged_count;
+}
+
+static void
+publish_voice_table(struct voice_exchange *voices)
+{
+	s32 previous = SDL_AtomicSet(&voices->published, (s32)(voices->write_index | VOICE_TABLE_FRESH));
+	if (previous & VOICE_TABLE_FRESH)
+		voices->dropped_table_count++;
+	voices->write_index = (u32)previous & VOICE_TABLE_INDEX_MASK;
+}
+
+static struct voice_table *
+acquire_voice_table(struct voice_exchange *voices)
+{
+	if (SDL_AtomicGet(&voices->published) & VOICE_TABLE_FRESH) {
+		s32 previous = SDL_AtomicSet(&voices->published, (s32)voices->read_index);
+		voices->read_index = (u32)previous & VOICE_TABLE_INDEX_MASK;
+	}
+	return voices->tables + voices->read_index;
+}
+
+static void
+update_audio(struct game_state *game)
+{
+	if (game->time > game->next_note_t) {
+		game->next_note_t += 4;
+		if (game->note == 40)
+			game->note = 80;
+		else if (game->note == 80)
+			game->note = 60;
+		else
+			game->note = 40;
+	}
+	
+	struct voice_exchange *voices = &game->voices;
+	if (SDL_AtomicGet(&voices->mixing))
+		voices->game_contention_count++;
+	SDL_AtomicSet(&voices->writing, 1);
+
+	struct voice_table *table = voices->tables + voices->write_index;
+	table->sine_wave_count = 0;
+	table->saw_wave_count = 0;
+	table->noise_wave_count = 0;
+	u32 sine_count = 0;
+	u32 saw_count = 0;
+	u32 candidate_count = 0;
+	for (u32 entity_index = 0; entity_index < game->entity_count; ++entity_index) {
+		struct entity *entity = game->entities + entity_index;
+		struct part_span parts = get_part_span(game, entity);
+		for (u32 part_index = 0; part_index < entity->part_count; ++part_index) {
+			struct entity_part *part = entity->parts + part_index;
+			u32 slot = entity->part_base + part_index;
+		
+			struct voice sine, saw;
+			sine.pad_ = saw.pad_ = 0;
+
+			f32 v = len_v2(parts.v[part_index]);
+			
+			f32 sqrt_v = sqrtf(v);
+			
+			sine.amp = sqrt_v / 400.0f;
+			if (entity->z < 1)
+				sine.amp *= entity->z;
+
+			if (sine.amp > 0.25f)
+				sine.amp = 0.25f;
+			sine.freq = (u16)((roundf(v * 10 / parts.size[part_index])) * (f32)game->note);
+			sine.slot = slot;
+
+			saw.amp = sqrt_v / 400.0f; /* part->size / 1000.0f; */
+			if (entity->z < 1)
+				saw.amp *= entity->z;
+
+			if (saw.amp > 0.25f)
+				saw.amp = 0.25f;
+			
+			saw.freq = (u16)((roundf(v * 100 / parts.mass[part_index])) * 4 * (f32)game->note); /* (u16)(roundf(len_v2(part->v)) * 40); */
+			saw.slot = slot;
+
+			/* NOTE(omid): A voice at freq 0 is a constant offset, not a sound. */
+			candidate_count += 2;
+			if (sine.amp >= MIN_AUDIBLE_VOICE_AMP && sine.freq)
+				game->sine_scratch[sine_count++] = sine;
+			if (saw.amp >= MIN_AUDIBLE_VOICE_AMP && saw.freq)
+				game->saw_scratch[saw_count++] = saw;
+
+			if (part->audio_gen > 0) {
+				struct voice noise;
+				noise.pad_ = 0;
+				noise.amp = part->audio_gen * entity->z;
+				if (entity->z < 1)
+					noise.amp *= entity->z;
+				noise.freq = 0;
+				noise.slot = slot;
+
+				if (noise.amp >= MIN_AUDIBLE_VOICE_AMP && table->noise_wave_count < MAX_VOICE_COUNT)
+					table->noise_waves[table->noise_wave_count++] = noise;
+
+				part->audio_gen = 0;
+			}
+		}
+	}
+
+	/* NOTE(omid): The budget is shared between sines and saws by how many
+	   survived the threshold. */
+	u32 audible_count = sine_count + saw_count;
+	u32 sine_budget = voices->voice_budget;
+	if (audible_count > voices->voice_budget)
+		sine_budget = (u32)((u64)voices->voice_budget * sine_count / audible_count);
+	if (sine_budget > MAX_VOICE_COUNT)
+		sine_budget = MAX_VOICE_COUNT;
+
+	sine_count = cull_voices(game->sine_scratch, sine_count, sine_budget);
+	u32 saw_budget = voices->voice_budget - sine_count;
+	if (saw_budget > MAX_VOICE_COUNT)
+		saw_budget = MAX_VOICE_COUNT;
+	saw_count = cull_voices(game->saw_scratch, saw_count, saw_budget);
+
+	memcpy(table->sine_waves, game->sine_scratch, sine_count * sizeof(struct voice));
+	memcpy(table->saw_waves, game->saw_scratch, saw_count * sizeof(struct voice));
+	table->sine_wave_count = sine_count;
+	table->saw_wave_count = saw_count;
+
+	voices->candidate_voice_count = candidate_count;
+	voices->active_voice_count = table->sine_wave_count + table->saw_wave_count;
+
+	SDL_AtomicSet(&voices->writing, 0);
+	publish_voice_table(voices);
+}
+
+/* NOTE(omid): Reserves the arena for max_entities entities, but only
+   grows the entity storage to its first capacity. */
+static bool
+init_game_state(struct game_state *game, u64 seed, u32 max_entities)
+{
+	ZERO_STRUCT(*game);
+	if (max_entities == 0)
+		max_entities = 1;
+	if (max_entities > MAX_ENTITY_COUNT_LIMIT)
+		max_entities = MAX_ENTITY_COUNT_LIMIT;
+
+	/* NOTE(omid): With nothing to reserve, the emscripten build starts at
+	   max_entity_count and never grows, which commits the storage once
+	   instead of once per capacity on the way. */
+#if defined(__EMSCRIPTEN__)
+	u32 first_capacity = max_entities;
+#else
+	u32 first_capacity = next_entity_capacity(0, max_entities);
+#endif
+
+	u32 phase_slot_count = max_entities * MAX_ENTITY_PART_COUNT;
+	u32 fixed_size = 2 * ARENA_ARRAY_SIZE(u32, phase_slot_count) + frame_arena_size(max_entities);
+	u32 arena_size = fixed_size;
+	for (u32 capacity = first_capacity;; capacity = next_entity_capacity(capacity, max_entities)) {
+		arena_size += entity_storage_size(capacity);
+		if (capacity == max_entities)
+			break;
+	}
+
+	if (!reserve_arena(&game->arena, arena_size))
+		return false;
+	if (!commit_arena(&game->arena, fixed_size)) {
+		release_arena(&game->arena);
+		return false;
+	}
+	game->max_entity_count = max_entities;
+
+	seed_game_random(game, seed);
+	init_voice_exchange(&game->voices);
+	game->voices.phase_slot_count = phase_slot_count;
+	game->voices.sine_phase = PUSH_ARRAY(&game->arena, u32, phase_slot_count);
+	game->voices.saw_phase = PUSH_ARRAY(&game->arena, u32, phase_slot_count);
+
+	game->frame_arena.size = frame_arena_size(max_entities);
+	game->frame_arena.base = push_size(&game->arena, game->frame_arena.size);
+
+	grow_entity_storage(game, first_capacity);
+	return true;
+}
+
+static void
+release_game_state(struct game_state *game)
+{
+	release_arena(&game->arena);
+}
+
+/* NOTE(omid): The game state as of a step boundary. The audio thread's
+   share, the voice exchange, its phase stores and audio_random, stays out,
+   so keyframes are taken and restored while the mixer runs. The arena is
+   copied from the frame arena on and the pointers into it are kept as they
+   are, so a keyframe only restores into the game_state it came from. */
+struct game_keyframe {
+	struct game_state state;
+	u8 *arena_bytes;
+	u32 arena_offset;
+	u32 arena_capacity;
+};
+
+static void
+copy_game_state_range(struct game_state *dest, const struct game_state *source, umm begin, umm end)
+{
+	memcpy((u8 *)dest + begin, (const u8 *)source + begin, end - begin);
+}
+
+/* NOTE(omid): Every field but the arena itself, the voice exchange and
+   audio_random, keep in sync with the layout of game_state. */
+static void
+copy_simulation_state(struct game_state *dest, const struct game_state *source)
+{
+	copy_game_state_range(dest, source, offsetof(struct game_state, entities), offsetof(struct game_state, voices));
+	copy_game_state_range(dest, source, offsetof(struct game_state, frame_arena), offsetof(struct game_state, audio_random));
+	copy_game_state_range(dest, source, offsetof(struct game_state, collision_grid), sizeof(struct game_state));
+	dest->arena.used = source->arena.used;
+}
+
+/* NOTE(omid): Copies only the used part of the arena. The buffer is kept
+   and only grows when the entity storage has grown since the last take.
+   Out of memory leaves the keyframe empty, so it belongs to no game. */
+static b32
+take_game_keyframe(struct game_keyframe *keyframe, const struct game_state *game)
+{
+	u32 offset = (u32)((umm)game->frame_arena.base - (umm)game->arena.base);
+	u32 size = game->arena.used - offset;
+	if (keyframe->arena_capacity < size) {
+		free(keyframe->arena_bytes);
+		keyframe->arena_bytes = (u8 *)malloc(size);
+		keyframe->arena_capacity = keyframe->arena_bytes ? size : 0;
+		if (!keyframe->arena_bytes)
+			return false;
+	}
+	keyframe->arena_offset = offset;
+	memcpy(keyframe->arena_bytes, (const u8 *)game->arena.base + offset, size);
+	copy_simulation_state(&keyframe->state, game);
+	keyframe->state.arena.base = game->arena.base;
+	return true;
+}
+
+static void
+copy_game_keyframe(struct game_keyframe *dest, const struct game_keyframe *source)
+{
+	u32 size = source->state.arena.used - source->arena_offset;
+	if (dest->arena_capacity < size) {
+		dest->arena_capacity = size;
+		dest->arena_bytes = (u8 *)realloc(dest->arena_bytes, size);
+		assert(dest->arena_bytes);
+	}
+	memcpy(dest->arena_bytes, source->arena_bytes, size);
+	dest->arena_offset = source->arena_offset;
+	copy_simulation_state(&dest->state, &source->state);
+	dest->state.arena.base = source->state.arena.base;
+}
+
+static b32
+keyframe_belongs_to(const struct game_keyframe *keyframe, const struct game_state *game)
+{
+	return keyframe->arena_bytes && keyframe->state.arena.base == game->arena.base;
+}
+
+static void
+restore_game_keyframe(struct game_state *game, const struct game_keyframe *keyframe)
+{
+	assert(keyframe_belongs_to(keyframe, game));
+	u32 used = game->arena.used;
+	u32 keyframe_used = keyframe->state.arena.used;
+	b32 committed = commit_arena(&game->arena, keyframe_used);
+	assert(committed);
+	(void)committed;
+	memcpy((u8 *)game->arena.base + keyframe->arena_offset, keyframe->arena_bytes, keyframe_used - keyframe->arena_offset);
+
+	/* NOTE(omid): grow_entity_storage counts on the arena past used being
+	   zeroed. */
+	if (used > keyframe_used)
+		memset((u8 *)game->arena.base + keyframe_used, 0, used - keyframe_used);
+
+	copy_simulation_state(game, &keyframe->state);
+}
+
+static void
+free_game_keyframe(struct game_keyframe *keyframe)
+{
+	free(keyframe->arena_bytes);
+	keyframe->arena_bytes = 0;
+	keyframe->arena_capacity = 0;
+}
+
+/* NOTE(omid): Taken at the end of the step a level was set up in, and
+   restored instead of setting the level up again after failing it. serial
+   tells copies apart, frame_index goes back on every restart. */
+static struct game_keyframe level_start_keyframe;
+static u32 level_start_serial;
+
+#define SNAPSHOT_RING_SIZE 8
+#define SNAPSHOT_INTERVAL (5 * SIMULATION_HZ)
+
+/* NOTE(omid): The last SNAPSHOT_RING_SIZE snapshots of one game, oldest
+   first from next - count. */
+struct snapshot_ring {
+	struct game_keyframe snapshots[SNAPSHOT_RING_SIZE];
+	u32 next;
+	u32 count;
+};
+
+static void
+push_snapshot(struct snapshot_ring *ring, const struct game_state *game)
+{
+	if (!take_game_keyframe(ring->snapshots + ring->next, game))
+		return;
+	ring->next = (ring->next + 1) % SNAPSHOT_RING_SIZE;
+	if (ring->count < SNAPSHOT_RING_SIZE)
+		++ring->count;
+}
+
+/* NOTE(omid): back 0 is the latest. */
+static const struct game_keyframe *
+get_snapshot(const struct snapshot_ring *ring, u32 back)
+{
+	if (back >= ring->count)
+		return 0;
+	return ring->snapshots + (ring->next + SNAPSHOT_RING_SIZE - 1 - back) % SNAPSHOT_RING_SIZE;
+}
+
+/* NOTE(omid): Restores the latest snapshot and drops it, so the one before
+   is next. */
+static b32
+pop_snapshot(struct snapshot_ring *ring, struct game_state *game)
+{
+	const struct game_keyframe *snapshot = get_snapshot(ring, 0);
+	if (!snapshot || !keyframe_belongs_to(snapshot, game))
+		return false;
+	restore_game_keyframe(game, snapshot);
+	ring->next = (ring->next + SNAPSHOT_RING_SIZE - 1) % SNAPSHOT_RING_SIZE;
+	--ring->count;
+	return true;
+}
+
+static void
+free_snapshot_ring(struct snapshot_ring *ring)
+{
+	for (u32 i = 0; i < SNAPSHOT_RING_SIZE; ++i)
+		free_game_keyframe(ring->snapshots + i);
+	ring->next = 0;
+	ring->count = 0;
+}
+
+#define SNAPSHOT_VERSION 1
+
+static const char snapshot_magic[8] = "LD48SNP";
+
+/* NOTE(omid): A snapshot file is this header, the game_state as
+   copy_simulation_state sees it and the arena from arena_offset to
+   arena_used, then the same for the level start snapshot when
+   level_start_arena_used is not zero. All in the byte order and struct
+   layout of the build that wrote it. The pointers into the arena are
+   stored as offsets from its base, which never come out zero since the
+   voice phase stores come first. The event buckets only live through a
+   step and are stored empty. */
+struct snapshot_file_header {
+	char magic[8];
+	u32 version;
+	u32 state_size;
+	u32 arena_offset;
+	u32 arena_used;
+	u32 arena_size;
+	u32 max_entity_count;
+	u32 level_start_arena_used;
+	u32 pad_;
+};
+
+static void
+rebase_pointer(void *field, umm from, umm to)
+{
+	umm value;
+	memcpy(&value, field, sizeof(value));
+	if (value)
+		value = value - from + to;
+	memcpy(field, &value, sizeof(value));
+}
+
+/* NOTE(omid): Every pointer game_state holds into its arena, keep in sync
+   with grow_entity_storage. */
+static void
+rebase_game_state_pointers(struct game_state *game, umm from, umm to)
+{
+	struct part_store *store = &game->parts;
+	struct spring_links *links = &game->springs;
+	struct collision_grid *grid = &game->collision_grid;
+	void *fields[] = {
+		&game->entities, &game->entity_index_by_z,
+		&game->handles.index, &game->handles.generation, &game->handles.free_slots,
+		&game->sine_scratch, &game->saw_scratch,
+		&store->p, &store->v, &store->a, &store->force, &store->mass, &store->inv_mass, &store->size,
+		&store->prev_p, &store->render_p, &store->next_p, &store->next_v, &store->free_spans,
+		&links->child, &links->parent, &links->rest_length, &links->k,
+		&links->child_ax, &links->child_ay, &links->parent_ax, &links->parent_ay, &links->first_link,
+		&grid->candidates, &grid->next_in_cell, &grid->prev_in_cell, &grid->cell_of_slot,
+		&game->frame_arena.base,
+	};
+	for (u32 i = 0; i < ARRAY_COUNT(fields); ++i)
+		rebase_pointer(fields[i], from, to);
+}
+
+static b32
+write_snapshot_section(FILE *file, struct game_state *scratch, const struct game_state *source, umm base, const u8 *arena_bytes, u32 arena_size)
+{
+	ZERO_STRUCT(*scratch);
+	copy_simulation_state(scratch, source);
+	rebase_game_state_pointers(scratch, base, 0);
+	scratch->level_instr = 0;
+	for (u32 type = 0; type < GAME_EVENT_TYPE_COUNT; ++type)
+		ZERO_STRUCT(scratch->events[type]);
+
+	return fwrite(scratch, sizeof(struct game_state), 1, file) == 1 &&
+		fwrite(arena_bytes, 1, arena_size, file) == arena_size;
+}
+
+static b32
+save_game_snapshot(const struct game_state *game, const char *path)
+{
+	struct snapshot_file_header header;
+	ZERO_STRUCT(header);
+	memcpy(header.magic, snapshot_magic, sizeof(snapshot_magic));
+	header.version = SNAPSHOT_VERSION;
+	header.state_size = sizeof(struct game_state);
+	header.arena_offset = (u32)((umm)game->frame_arena.base - (umm)game->arena.base);
+	header.arena_used = game->arena.used;
+	header.arena_size = game->arena.size;
+	header.max_entity_count = game->max_entity_count;
+
+	const struct game_keyframe *level_start = &level_start_keyframe;
+	if (keyframe_belongs_to(level_start, game))
+		header.level_start_arena_used = level_start->state.arena.used;
+
+	struct game_state *scratch = (struct game_state *)malloc(sizeof(struct game_state));
+	if (!scratch)
+		return false;
+
+	b32 result = false;
+	umm base = (umm)game->arena.base;
+	FILE *file = fopen(path, "wb");
+	if (file) {
+		result = fwrite(&header, sizeof(header), 1, file) == 1 &&
+			write_snapshot_section(file, scratch, game, base, (const u8 *)base + header.arena_offset, header.arena_used - header.arena_offset);
+		if (result && header.level_start_arena_used)
+			result = write_snapshot_section(file, scratch, &level_start->state, base, level_start->arena_bytes, header.level_start_arena_used - header.arena_offset);
+		result = fclose(file) == 0 && result;
+	}
+	free(scratch);
+	return result;
+}
+
+/* NOTE(omid): Maps the file and copies it into the game, which is set up
+   again when it was reserved for another entity count. That also resets
+   the voice exchange, so only load into a game the mixer is not running
+   on yet. */
+static b32
+load_game_snapshot(struct game_state *game, const char *path)
+{
+	s32 fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	struct stat file_stat;
+	void *mapping = MAP_FAILED;
+	if (fstat(fd, &file_stat) == 0 && file_stat.st_size > 0)
+		mapping = mmap(0, (size_t)file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED)
+		return false;
+
+	umm file_size = (umm)file_stat.st_size;
+	const u8 *bytes = (const u8 *)mapping;
+	struct snapshot_file_header header;
+	b32 result = file_size >= sizeof(header);
+	if (result) {
+		memcpy(&header, bytes, sizeof(header));
+		umm level_start_size = 0;
+		if (header.level_start_arena_used)
+			level_start_size = sizeof(struct game_state) + (header.level_start_arena_used - header.arena_offset);
+		result = memcmp(header.magic, snapshot_magic, sizeof(snapshot_magic)) == 0 &&
+			header.version == SNAPSHOT_VERSION &&
+			header.state_size == sizeof(struct game_state) &&
+			header.arena_offset <= header.arena_used &&
+			header.arena_used <= header.arena_size &&
+			(!header.level_start_arena_used ||
+			 (header.arena_offset <= header.level_start_arena_used && header.level_start_arena_used <= header.arena_size)) &&
+			file_size >= sizeof(header) + sizeof(struct game_state) + (header.arena_used - header.arena_offset) + level_start_size;
+	}
+
+	if (result && (!game->arena.base || game->arena.size != header.arena_size || game->max_entity_count != header.max_entity_count)) {
+		if (game->arena.base)
+			release_game_state(game);
+		result = init_game_state(game, DEFAULT_RANDOM_SEED, header.max_entity_count) &&
+			game->arena.size == header.arena_size;
+	}
+	if (result)
+		result = (umm)game->frame_arena.base - (umm)game->arena.base == header.arena_offset;
+
+	if (result) {
+		umm base = (umm)game->arena.base;
+		const u8 *section = bytes + sizeof(header);
+		const u8 *level_start_section = section + sizeof(struct game_state) + (header.arena_used - header.arena_offset);
+
+		/* NOTE(omid): The level start snapshot goes through a keyframe, so
+		   it is taken as if from this game. */
+		struct game_keyframe *level_start = &level_start_keyframe;
+		level_start->state.arena.base = 0;
+		if (header.level_start_arena_used) {
+			u32 size = header.level_start_arena_used - header.arena_offset;
+			if (level_start->arena_capacity < size) {
+				level_start->arena_capacity = size;
+				level_start->arena_bytes = (u8 *)realloc(level_start->arena_bytes, size);
+				assert(level_start->arena_bytes);
+			}
+			memcpy(&level_start->state, level_start_section, sizeof(struct game_state));
+			rebase_game_state_pointers(&level_start->state, 0, base);
+			memcpy(level_start->arena_bytes, level_start_section + sizeof(struct game_state), size);
+			level_start->arena_offset = header.arena_offset;
+			level_start->state.arena.base = game->arena.base;
+			level_start->state.arena.used = header.level_start_arena_used;
+			level_start->state.level_instr = level_instruction(level_start->state.current_level);
+			++level_start_serial;
+		}
+
+		struct game_state *state = (struct game_state *)malloc(sizeof(struct game_state));
+		result = state != 0 && commit_arena(&game->arena, header.arena_used);
+		if (result) {
+			memcpy(state, section, sizeof(struct game_state));
+			rebase_game_state_pointers(state, 0, base);
+
+			u32 used = game->arena.used;
+			memcpy((u8 *)base + header.arena_offset, section + sizeof(struct game_state), header.arena_used - header.arena_offset);
+			if (used > header.arena_used)
+				memset((u8 *)base + header.arena_used, 0, used - header.arena_used);
+
+			copy_simulation_state(game, state);
+			game->level_instr = level_instruction(game->current_level);
+		}
+		free(state);
+	}
+
+	munmap(mapping, (size_t)file_stat.st_size);
+	return result;
+}
+
+/* NOTE(omid): Called before every simulation step, so render_game can
+   draw the parts between where they were and where they are. */
+static void
+save_previous_part_positions(struct game_state *game)
+{
+	struct part_store *store = &game->parts;
+	for (u32 entity_index = 0; entity_index < game->entity_count; ++entity_index) {
+		const struct entity *entity = game->entities + entity_index;
+		memcpy(store->prev_p + entity->part_base, store->p + entity->part_base, entity->part_count * sizeof(struct v2));
+	}
+}
+
+/* NOTE(omid): t is how far real time got into the next step, parts pushed
+   during the last step are drawn where they are. */
+static void
+interpolate_part_positions(struct game_state *game, f32 t)
+{
+	struct part_store *store = &game->parts;
+	for (u32 entity_index = 0; entity_index < game->entity_count; ++entity_index) {
+		const struct entity *entity = game->entities + entity_index;
+		for (u32 part_index = 0; part_index < entity->part_count; ++part_index) {
+			u32 slot = entity->part_base + part_index;
+			struct v2 prev_p = store->prev_p[slot];
+			struct v2 p = store->p[slot];
+			if (isnan(prev_p.x))
+				store->render_p[slot] = p;
+			else
+				store->render_p[slot] = add_v2(prev_p, scale_v2(sub_v2(p, prev_p), t));
+		}
+	}
+}
+
+static struct v2 *
+get_render_positions(struct game_state *game, const struct entity *entity)
+{
+	return game->parts.render_p + entity->part_base;
+}
+
+static void
+make_lightning_to_point(struct game_state *game, SDL_Renderer *renderer, struct entity *e1, struct v2 to)
+{
+	struct v2 from = get_render_positions(game, e1)[0];
+	struct v2 d = sub_v2(to, from);
+
+	u32 count = 0;
+	for (u32 i = 0; i < 8; ++i) {
+		f32 t = game->time * (f32)(i + 1) / 10.0f;
+		f32 r = fmodf(t, 1);
+		u8 alpha = e1->z < 1 ? (u8)(e1->z * 0x80) : 0x80;
+		struct color c = color((u8)(0xFF * (1 - r)), (u8)((1-r) * 0xFF), 0xFF, alpha);
+
+		while (r < 1) {
+			struct v2 p = add_v2(from, scale_v2(d, r));
+			struct v2 tangent = normalize_v2(v2(d.y, -d.x));
+			p = add_v2(p, scale_v2(tangent, sinf(r * 5 * 3.14f + t) * fmodf(t, 25)));
+					
+			fill_rect(renderer, (s32)p.x, (s32)p.y, 8, 8, c);
+			r += 0.01f + fmodf(t, 1) * 0.5f;
+
+			++count;
+		}
+	}
+
+	f32 power = (f32)count / 800;
+	if (game->game_over)
+		power = 1;
+	
+	e1->parts->audio_gen += power * 0.12f;
+}
+
+static void
+update_game(struct game_state *game,
+            const struct input_state *input)
+{
+	u64 t = profile_begin();
+	begin_game_frame(game);
+	t = profile_end(PROFILE_BEGIN_FRAME, t);
+
+	/* NOTE(omid): Run level scenario and timings. */
+	run_level_scenario_control(game);
+	t = profile_end(PROFILE_SCENARIO, t);
+	
+	/* NOTE(omid): Apply user input. */
+	apply_user_input(game, input);
+	t = profile_end(PROFILE_INPUT, t);
+	
+	/* NOTE(omid): Entity AI. */
+	update_entity_ai(game);
+	t = profile_end(PROFILE_AI, t);
+	
+	/* NOTE(omid): Spring physics. */
+	wake_pushed_entities(game);
+	update_spring_physics(game);
+	t = profile_end(PROFILE_SPRINGS, t);
+
+	/* NOTE(omid): Newtonian physics. */
+	update_newtonian_physics(game);
+	t = profile_end(PROFILE_NEWTONIAN, t);
+
+	/* NOTE(omid): Triggered events. */
+	process_triggered_events(game);
+	t = profile_end(PROFILE_EVENTS, t);
+
+	/* NOTE(omid): Audio generation. */
+	update_audio(game);
+	t = profile_end(PROFILE_AUDIO_UPDATE, t);
+
+	sort_entities_by_z(game);
+	profile_end(PROFILE_SORT, t);
+}
+
+
+/* NOTE(omid): min, avg and p99 in milliseconds per stage over the last
+   PROFILE_STATS_FRAME_COUNT finished frames that ran it. The audio lane
+   is over the last PROFILE_STATS_FRAME_COUNT callbacks. */
+static void
+draw_profiler_overlay(SDL_Renderer *renderer, struct glyph_atlas *small_font, s32 x, s32 y)
+{
+	struct color white = color(0xFF, 0xFF, 0xFF, 0xFF);
+	f64 ms_per_tick = 1000.0 / (f64)SDL_GetPerformanceFrequency();
+	f64 durations[PROFILE_STATS_FRAME_COUNT];
+
+	u32 frame_count = profiler.frame_count ? profiler.frame_count - 1 : 0;
+	if (frame_count > PROFILE_STATS_FRAME_COUNT)
+		frame_count = PROFILE_STATS_FRAME_COUNT;
+
+	draw_string_f(renderer, small_font, x, y, TEXT_ALIGN_LEFT, white, "STAGE               MIN     AVG     P99 (MS)");
+	y += SMALL_FONT_SIZE;
+
+	for (u32 stage = 0; stage <= PROFILE_STAGE_COUNT; ++stage) {
+		u32 count = 0;
+		if (stage < PROFILE_STAGE_COUNT) {
+			for (u32 i = 0; i < frame_count; ++i) {
+				const struct profile_frame *frame = profiler.frames + ((profiler.frame_count - 2 - i) % PROFILE_FRAME_COUNT);
+				if (frame->stages[stage].begin)
+					durations[count++] = (f64)frame->stages[stage].duration * ms_per_tick;
+			}
+		} else {
+			u32 callback_count = (u32)SDL_AtomicGet(&profiler.audio_callback_count);
+			for (u32 i = 0; i < callback_count && i < PROFILE_STATS_FRAME_COUNT; ++i)
+				durations[count++] = (f64)profiler.audio_callbacks[(callback_count - 1 - i) % PROFILE_AUDIO_CALLBACK_COUNT].duration * ms_per_tick;
+		}
+
+		if (!count)
+			continue;
+
+		f64 sum = 0;
+		for (u32 i = 0; i < count; ++i)
+			sum += durations[i];
+		qsort(durations, count, sizeof(f64), compare_f64);
+
+		const char *name = stage < PROFILE_STAGE_COUNT ? profile_stage_names[stage] : "mix_audio";
+		draw_string_f(renderer, small_font, x, y, TEXT_ALIGN_LEFT, white, "%-16s %7.3f %7.3f %7.3f",
+		              name, durations[0], sum / count, durations[(u32)((f64)(count - 1) * 0.99)]);
+		y += SMALL_FONT_SIZE;
+	}
+}
+
+/* NOTE(omid): Oldest frame number still in the ring. */
+static u32
+first_profiled_frame(void)
+{
+	return profiler.frame_count > PROFILE_FRAME_COUNT ? profiler.frame_count - PROFILE_FRAME_COUNT : 0;
+}
+
+static void
+write_profile_csv(const char *path)
+{
+	FILE *file = fopen(path, "w");
+	if (!file) {
+		fprintf(stderr, "could not write profile %s\n", path);
+		return;
+	}
+
+	f64 us_per_tick = 1000000.0 / (f64)SDL_GetPerformanceFrequency();
+	fprintf(file, "lane,frame,stage,begin_us,duration_us\n");
+
+	for (u32 frame_number = first_profiled_frame(); frame_number < profiler.frame_count; ++frame_number) {
+		const struct profile_frame *frame = profiler.frames + (frame_number % PROFILE_FRAME_COUNT);
+		for (u32 stage = 0; stage < PROFILE_STAGE_COUNT; ++stage) {
+			const struct profile_sample *sample = frame->stages + stage;
+			if (sample->begin)
+				fprintf(file, "game,%u,%s,%.3f,%.3f\n", frame_number, profile_stage_names[stage],
+				        (f64)(sample->begin - profiler.epoch) * us_per_tick, (f64)sample->duration * us_per_tick);
+		}
+	}
+
+	u32 callback_count = (u32)SDL_AtomicGet(&profiler.audio_callback_count);
+	u32 first_callback = callback_count > PROFILE_AUDIO_CALLBACK_COUNT ? callback_count - PROFILE_AUDIO_CALLBACK_COUNT : 0;
+	for (u32 callback = first_callback; callback < callback_count; ++callback) {
+		const struct profile_sample *sample = profiler.audio_callbacks + (callback % PROFILE_AUDIO_CALLBACK_COUNT);
+		if (sample->begin >= profiler.epoch)
+			fprintf(file, "audio,%u,mix_audio,%.3f,%.3f\n", callback,
+			        (f64)(sample->begin - profiler.epoch) * us_per_tick, (f64)sample->duration * us_per_tick);
+	}
+
+	fclose(file);
+}
+
+/* NOTE(omid): Chrome trace event format, for chrome://tracing or Perfetto.
+   The game and the audio callback get a thread each. */
+static void
+write_profile_trace(const char *path)
+{
+	FILE *file = fopen(path, "w");
+	if (!file) {
+		fprintf(stderr, "could not write profile %s\n", path);
+		return;
+	}
+
+	f64 us_per_tick = 1000000.0 / (f64)SDL_GetPerformanceFrequency();
+	fprintf(file, "{\"traceEvents\":[\n");
+	fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,\"args\":{\"name\":\"game\"}},\n");
+	fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":2,\"args\":{\"name\":\"audio\"}}");
+
+	for (u32 frame_number = first_profiled_frame(); frame_number < profiler.frame_count; ++frame_number) {
+		const struct profile_frame *frame = profiler.frames + (frame_number % PROFILE_FRAME_COUNT);
+		for (u32 stage = 0; stage < PROFILE_STAGE_COUNT; ++stage) {
+			const struct profile_sample *sample = frame->stages + stage;
+			if (sample->begin)
+				fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"frame\":%u}}",
+				        profile_stage_names[stage], (f64)(sample->begin - profiler.epoch) * us_per_tick, (f64)sample->duration * us_per_tick, frame_number);
+		}
+	}
+
+	u32 callback_count = (u32)SDL_AtomicGet(&profiler.audio_callback_count);
+	u32 first_callback = callback_count > PROFILE_AUDIO_CALLBACK_COUNT ? callback_count - PROFILE_AUDIO_CALLBACK_COUNT : 0;
+	for (u32 callback = first_callback; callback < callback_count; ++callback) {
+		const struct profile_sample *sample = profiler.audio_callbacks + (callback % PROFILE_AUDIO_CALLBACK_COUNT);
+		if (sample->begin >= profiler.epoch)
+			fprintf(file, ",\n{\"name\":\"mix_audio\",\"ph\":\"X\",\"pid\":1,\"tid\":2,\"ts\":%.3f,\"dur\":%.3f}",
+			        (f64)(sample->begin - profiler.epoch) * us_per_tick, (f64)sample->duration * us_per_tick);
+	}
+
+	fprintf(file, "\n]}\n");
+	fclose(file);
+}
+
+static void
+write_profile_exports(void)
+{
+	if (profile_csv_path)
+		write_profile_csv(profile_csv_path);
+	if (profile_trace_path)
+		write_profile_trace(profile_trace_path);
+}
+
+#define TUNNEL_SPIRAL_POINT_COUNT 4096
+
+/* NOTE(omid): The tunnel spiral always has the same shape: each step moves
+   out by 0.25 + 0.01 * sqrt(s) and turns by 0.1 * sqrt(s), where s is the
+   distance walked from the inner end. Only the inner radius, the outer cut
+   off and the rotation change from frame to frame, so the unit directions
+   are tabulated once and rotated with a single cosf/sinf per frame. The
+   table reaches WINDOW_WIDTH, which is the largest tunnel_size. */
+struct tunnel_spiral {
+	f32 s[TUNNEL_SPIRAL_POINT_COUNT];
+	f32 cos_a[TUNNEL_SPIRAL_POINT_COUNT];
+	f32 sin_a[TUNNEL_SPIRAL_POINT_COUNT];
+	u32 point_count;
+};
+
+struct tunnel_cell {
+	s32 x;
+	s32 y;
+	s32 size;
+	u8 alpha;
+	u8 pad_[3];
+};
+
+/* NOTE(omid): The cells of the last tunnel that was built. It is kept
+   until the rotation, radii, fade or colour move by enough to shift a cell,
+   so repeated display frames between simulation steps (and paused frames)
+   only resubmit the cells. Cells entirely outside the window are dropped
+   when the list is built. */
+struct tunnel_cache {
+	struct tunnel_cell cells[TUNNEL_SPIRAL_POINT_COUNT];
+	u32 cell_count;
+	b32 valid;
+	f32 angle;
+	f32 initial_r;
+	f32 tunnel_size;
+	f32 fade_progress;
+	u8 value;
+	u8 pad_[3];
+};
+
+static struct tunnel_spiral tunnel_spiral;
+static struct tunnel_cache tunnel_cache;
+
+static void
+build_tunnel_spiral(struct tunnel_spiral *spiral)
+{
+	f32 s = 0;
+	f32 a = 0;
+	spiral->point_count = 0;
+	while (s < WINDOW_WIDTH && spiral->point_count < TUNNEL_SPIRAL_POINT_COUNT) {
+		u32 index = spiral->point_count++;
+		spiral->s[index] = s;
+		spiral->cos_a[index] = cosf(a);
+		spiral->sin_a[index] = sinf(a);
+		s += 0.25f + sqrtf(s) * 0.01f;
+		a += sqrtf(s) * 0.1f;
+	}
+}
+
+static b32
+tunnel_cache_is_stale(const struct tunnel_cache *cache,
+                      f32 angle, f32 initial_r, f32 tunnel_size, f32 fade_progress, u8 value)
+{
+	if (!cache->valid || cache->value != value)
+		return true;
+	if (fade_progress < cache->fade_progress || fade_progress > cache->fade_progress)
+		return true;
+	/* NOTE(omid): Half a pixel of movement at the outer end. */
+	if (fabsf(angle - cache->angle) * tunnel_size >= 0.5f)
+		return true;
+	if (fabsf(initial_r - cache->initial_r) >= 0.5f || fabsf(tunnel_size - cache->tunnel_size) >= 0.5f)
+		return true;
+	return false;
+}
+
+static void
+build_tunnel_cells(struct tunnel_cache *cache, const struct tunnel_spiral *spiral,
+                   f32 angle, f32 initial_r, f32 tunnel_size, f32 fade_progress, u8 value,
+                   f32 len_o, b32 fading_in)
+{
+	cache->valid = true;
+	cache->angle = angle;
+	cache->initial_r = initial_r;
+	cache->tunnel_size = tunnel_size;
+	cache->fade_progress = fade_progress;
+	cache->value = value;
+	cache->cell_count = 0;
+
+	if (fade_progress <= 0)
+		return;
+
+	f32 cos_angle = cosf(angle);
+	f32 sin_angle = sinf(angle);
+	struct v2 o = add_v2(screen_center, scale_v2(screen_center, (1 - fade_progress) / fade_progress));
+	/* NOTE(omid): The batch scales by fade_progress, so this is the window
+	   in unscaled coordinates. */
+	f32 max_x = WINDOW_WIDTH / fade_progress;
+	f32 max_y = WINDOW_HEIGHT / fade_progress;
+
+	for (u32 index = 0; index < spiral->point_count; ++index) {
+		f32 r = initial_r + spiral->s[index];
+		if (r >= tunnel_size)
+			break;
+
+		f32 dx = cos_angle * spiral->cos_a[index] - sin_angle * spiral->sin_a[index];
+		f32 dy = sin_angle * spiral->cos_a[index] + cos_angle * spiral->sin_a[index];
+		struct v2 sp = add_v2(o, v2(r * dx, r * dy));
+		s32 size = (s32)(r / 5.0f);
+		f32 half_size = (f32)size * 0.5f + 1;
+		if (sp.x + half_size < 0 || sp.x - half_size > max_x ||
+		    sp.y + half_size < 0 || sp.y - half_size > max_y)
+			continue;
+
+		u8 max_alpha = (u8)(0xE0 * sqrtf(r / len_o));
+		u8 alpha = max_alpha;
+		if (fading_in)
+			alpha = (u8)(max_alpha * fade_progress);
+
+		struct tunnel_cell *cell = cache->cells + cache->cell_count++;
+		cell->x = (s32)sp.x;
+		cell->y = (s32)sp.y;
+		cell->size = size;
+		cell->alpha = alpha;
+	}
+}
+
+static void
+render_game(struct game_state *game,
+            SDL_Renderer *renderer,
+            struct glyph_atlas *font,
+            struct glyph_atlas *small_font,
+            f32 interpolation)
+{
+	interpolate_part_positions(game, interpolation);
+	u64 t = profile_begin();
+	begin_render_batch(renderer);
+	
+	struct color white = color(0xFF, 0xFF, 0xFF, 0xFF);
+
+	f32 elapsed_t = game->time - game->level_begin_t;
+	f32 level_progress = elapsed_t / (game->level_end_t - game->level_begin_t);
+	if (level_progress < 0)
+		level_progress = 0;
+	
+	struct v2 o = screen_center; /* v2(WINDOW_WIDTH / 2, WINDOW_HEIGHT / 2); */
+	f32 len_o = len_v2(o) + 100;
+	
+	set_render_blend_mode(renderer, SDL_BLENDMODE_BLEND);
+
+	/* NOTE(omid): Render tunnel. */
+	{
+		f32 fade_progress = 1.0f;
+		if (game->time < game->level_begin_t) {
+			f32 tunnel_d = game->level_begin_t - game->tunnel_begin_t;
+			fade_progress = (game->time - game->tunnel_begin_t) / tunnel_d;
+		}
+		
+		set_render_scale(fade_progress);
+		
+		f32 initial_r = len_o * level_progress * level_progress;
+		f32 a = 0.25f * game->time;
+		u8 c = (u8)(game->current_level + 9) % ARRAY_COUNT(BASE_COLORS);
+
+		if (!tunnel_spiral.point_count)
+			build_tunnel_spiral(&tunnel_spiral);
+		if (tunnel_cache_is_stale(&tunnel_cache, a, initial_r, game->tunnel_size, fade_progress, c))
+			build_tunnel_cells(&tunnel_cache, &tunnel_spiral, a, initial_r, game->tunnel_size, fade_progress, c,
+			                   len_o, game->time < game->level_begin_t);
+
+		for (u32 index = 0; index < tunnel_cache.cell_count; ++index) {
+			const struct tunnel_cell *cell = tunnel_cache.cells + index;
+			special_fill_cell_(renderer, c, cell->alpha, cell->x, cell->y, cell->size, cell->size);
+		}
+
+		set_render_scale(1);
+	}
+	t = profile_end(PROFILE_RENDER_TUNNEL, t);
+
+	/* NOTE(omid): Render shadows. */
+	for (u32 entity_index = 0; entity_index < game->entity_count; ++entity_index) {
+		const struct entity *entity = game->entities + entity_index;
+		struct v2 *render_p = get_render_positions(game, entity);
+		for (u32 part_index = 0; part_index < entity->part_count; ++part_index) {
+			const struct entity_part *part = entity->parts + part_index;
+
+			struct v2 ep = render_p[part->parent_index];
+			struct v2 pp = render_p[part_index];
+
+			struct v2 from_c = sub_v2(ep, o);
+			f32 dist_to_center = len_v2(from_c);
+			f32 scale = 2 * dist_to_center / len_o;
+
+			struct v2 offset = scale_v2(normalize_v2(from_c), 30);
+			struct v2 shadow = add_v2(pp, offset);
+
+			u8 max_alpha = (u8)(0xE0 * sqrtf(dist_to_center / len_o));
+			u8 alpha = max_alpha;
+			if (game->time < game->level_begin_t) {
+				f32 tunnel_d = game->level_begin_t - game->tunnel_begin_t;
+				f32 fade_progress = (game->time - game->tunnel_begin_t) / tunnel_d;
+				alpha = (u8)(max_alpha * fade_progress);
+			}
+		
+			struct color c = color(0x00, 0x00, 0x00, alpha);
+			render_rect(renderer, c, (s32)shadow.x, (s32)shadow.y, (s32)(part->render_size * scale), (s32)(part->render_size * scale), false);
+		}
+	}
+
+	t = profile_end(PROFILE_RENDER_SHADOWS, t);
+
+	/* NOTE(omid): Render entities. */
+	/* for (u32 entity_index = 0; entity_index < game->entity_count; ++entity_index) { */
+	for (u32 sort_list_index = 0; sort_list_index < game->entity_count; ++sort_list_index) {
+		u32 entity_index = game->entity_index_by_z[sort_list_index];
+		const struct entity *entity = game->entities + entity_index;
+		struct v2 *render_p = get_render_positions(game, entity);
+		
+		for (u32 part_index = 0; part_index < entity->part_count; ++part_index) {
+			const struct entity_part *part = entity->parts + (entity->part_count - part_index - 1);
+			
+
+			
+			struct v2 part_p = render_p[part->index];
+#if 0
+			struct v2 parent_p = render_p[part->parent_index];
+			struct v2 d = sub_v2(part_p, parent_p);       
+			u32 chain_count = (u32)(part->length / 20);
+#endif
+
+			u16 depth = compute_entity_part_depth(entity, part);
+			f32 z = entity->z - depth * 0.02f;
+			if (z < 0)
+				z = 0;
+			
+			if (z > 1) {
+#if 0
+				for (u32 chain_index = 1; chain_index < chain_count; ++chain_index) {
+					f32 r = (f32)chain_index / (f32)chain_count;
+					struct v2 p = add_v2(parent_p, scale_v2(d, r));
+					fill_cell(renderer, 3, (s32)p.x, (s32)p.y, 12, 12);
+				}
+#endif
+
+				u8 alpha = part->max_alpha ? part->max_alpha : 0xFF;
+				
+				fill_cell_(renderer, (u8)part->color, alpha, (s32)part_p.x, (s32)part_p.y, (s32)part->render_size, (s32)part->render_size);
+
+				if (part->content) {
+					fill_cell_(renderer, part->content, alpha, (s32)part_p.x, (s32)part_p.y, 10, 10);
+					draw_cell(renderer, 0, (s32)part_p.x, (s32)part_p.y, 10, 10);
+				}			
+
+				if (part->accept) {
+					fill_cell_(renderer, part->accept, 200, (s32)part_p.x, (s32)(part_p.y - part->render_size / 2.0f), (s32)part->render_size, 10);
+
+				}
+				
+			} else {
+				u8 max_alpha = (u8)(0xE0);
+				u8 alpha = (u8)(max_alpha * z);
+
+				set_render_scale(z);
+				s32 size = (s32)(part->render_size);
+				special_fill_cell_(renderer, (u8)(part->color), alpha, (s32)(part_p.x / z), (s32)(part_p.y / z), size, size);
+				set_render_scale(1);
+			}
+		}
+	}
+
+	t = profile_end(PROFILE_RENDER_ENTITIES, t);
+
+	for (u32 socket_index = 0; socket_index < game->entity_count; ++socket_index) {
+		 struct entity *e1 = game->entities + socket_index;
+		 if (!(e1->type & ENTITY_SOCKET) || !e1->parts->content)
+			continue;
+
+		make_lightning_to_point(game, renderer, e1, screen_center);
+		
+		for (u32 other_socket_index = 0; other_socket_index < game->entity_count; ++other_socket_index) {
+			if (other_socket_index == socket_index)
+				continue;
+			
+			 struct entity *e2 = game->entities + other_socket_index;
+
+			if (!(e2->type & ENTITY_SOCKET) || !e2->parts->content)
+				continue;
+
+			make_lightning_to_point(game, renderer, e1, get_render_positions(game, e2)[0]);
+		}
+	}
+	
+	
+	set_render_blend_mode(renderer, SDL_BLENDMODE_NONE);
+	t = profile_end(PROFILE_RENDER_LIGHTNING, t);
+
+	/* NOTE(omid): Render on-screen text. */
+	
+	/* draw_string(renderer, font, "LD48 - InvertedMinds", 5, 5, TEXT_ALIGN_LEFT, white); */
+#if 0
+	draw_string_f(renderer, small_font, 5, 5, TEXT_ALIGN_LEFT, white, "T: %f (%uX)", (f64)game->time, game->time_speed_up + 1);
+#endif
+	draw_string_f(renderer, small_font, WINDOW_WIDTH, WINDOW_HEIGHT - SMALL_FONT_SIZE, TEXT_ALIGN_RIGHT, white, "A game by Omid Ghavami Zeitooni");
+
+	if (show_render_stats) {
+		struct voice_exchange *voices = &game->voices;
+		draw_string_f(renderer, small_font, 5, 5, TEXT_ALIGN_LEFT, white, "DRAW CALLS: %u", render_batch.last_frame_draw_call_count);
+		draw_string_f(renderer, small_font, 5, 5 + SMALL_FONT_SIZE, TEXT_ALIGN_LEFT, white, "AUDIO WAITS AVOIDED: GAME %u MIXER %d, TABLES DROPPED %u",
+		              voices->game_contention_count, SDL_AtomicGet(&voices->mixer_contention_count), voices->dropped_table_count);
+		draw_string_f(renderer, small_font, 5, 5 + 2 * SMALL_FONT_SIZE, TEXT_ALIGN_LEFT, white, "VOICES: %u OF %u (BUDGET %u)",
+		              voices->active_voice_count, voices->candidate_voice_count, voices->voice_budget);
+		draw_string_f(renderer, small_font, 5, 5 + 3 * SMALL_FONT_SIZE, TEXT_ALIGN_LEFT, white, "EVENTS: SEED %u WORM %u EATER %u GEM %u",
+		              game->events[GAME_EVENT_SEED_TOUCH_WATER].count, game->events[GAME_EVENT_WORM_EAT_FOOD].count,
+		              game->events[GAME_EVENT_WATER_EATER_EAT_WATER].count, game->events[GAME_EVENT_GEM_TOUCH_SOCKET].count);
+		draw_string_f(renderer, small_font, 5, 5 + 4 * SMALL_FONT_SIZE, TEXT_ALIGN_LEFT, white, "ENTITIES: %u AWAKE %u ASLEEP",
+		              game->awake_entity_count, game->asleep_entity_count);
+	}
+
+	if (show_profiler)
+		draw_profiler_overlay(renderer, small_font, 5, 5 + 6 * SMALL_FONT_SIZE);
+
+	/* draw_string_f(renderer, font, WINDOW_WIDTH / 2, 0, TEXT_ALIGN_CENTER, white, "SCORE: %u", game->score); */
+	
+	if (game->time < game->tunnel_begin_t) {
+		f32 fade_in_d = 1;
+		f32 fade_in_start_t = game->last_level_end_t;
+		f32 fade_in_end_t = fade_in_start_t + fade_in_d;
+
+		f32 fade_out_d = 1;
+		f32 fade_out_start_t = game->tunnel_begin_t - fade_out_d;
+		f32 fade_out_end_t = game->tunnel_begin_t;
+
+		f32 alpha = 0xFF;
+		if (game->time >= fade_in_start_t && game->time <= fade_in_end_t)
+			alpha = (0xFF * (game->time - game->last_level_end_t) / fade_in_d);
+		if (game->time >= fade_out_start_t && game->time <= fade_out_end_t)
+			alpha = (0xFF * (1 - (game->time - fade_out_start_t) / fade_out_d));
+
+		if (alpha > 0xFF)
+			alpha = 0xFF;
+		else if (alpha < 0)
+			alpha = 0;
+
+		if (alpha > 1) {
+			struct color c = color(0xFF, 0xFF, 0xFF, (u8)alpha);
+
+			if (game->game_over) {
+				draw_string_f(renderer, font, WINDOW_WIDTH / 2, WINDOW_HEIGHT / 2 - 9, TEXT_ALIGN_CENTER, c, "CONGRATULATIONS, YOU WON!", game->current_level + 1);
+			} else {
+				draw_string_f(renderer, font, WINDOW_WIDTH / 2, WINDOW_HEIGHT / 2 - 9, TEXT_ALIGN_CENTER, c, "LEVEL %u", game->current_level + 1);
 
-	entity->type = ENTITY_PLAYER;
-	
-	p = push_entity_part(entity, 0, 50, 1, 0);
-	p->mass = 10000;
+				if (game->level_instr) {
+					draw_string_f(renderer, small_font, WINDOW_WIDTH / 2, WINDOW_HEIGHT / 2 -9 + FONT_SIZE, TEXT_ALIGN_CENTER, c, "%s", game->level_instr);
+				}
 
-	add_squid_leg(entity, 0, 6, leg_count, 20, 25, 0);
+				draw_string_f(renderer, font, WINDOW_WIDTH / 2, WINDOW_HEIGHT - FONT_SIZE, TEXT_ALIGN_CENTER, c, "PRESS 'SPACE' TO SKIP");
+			}
+		}
+	}
 
-	return entity;
-}
+	if (game->game_over) {
+		draw_string_f(renderer, font, WINDOW_WIDTH / 2, WINDOW_HEIGHT / 2 - 9, TEXT_ALIGN_CENTER, white, "CONGRATULATIONS, YOU WON!", game->current_level + 1);
+	} else if (check_win_condition(game)) {
+		draw_string_f(renderer, font, WINDOW_WIDTH / 2, WINDOW_HEIGHT / 2 - 9, TEXT_ALIGN_CENTER, white, "COMPLETED", game->current_level + 1);
 
-static bool
-find_entity_by_id(const struct game_state *game, u32 entity_id, u32 *index)
-{
-	u32 i = *index;
-	if (i < game->entity_count && game->entities[i].id == entity_id)
-		return true;
+		draw_string_f(renderer, font, WINDOW_WIDTH / 2, WINDOW_HEIGHT - FONT_SIZE, TEXT_ALIGN_CENTER, white, "PRESS 'SPACE' TO SKIP");
+	}
 
-	for (i = 0; i < game->entity_count; ++i) {
-		if (game->entities[i].id == entity_id) {
-			*index = i;
-			return true;
+
+#if 0
+	s32 y = 5 + SMALL_FONT_SIZE;
+	
+	for (u32 entity_index = 0; entity_index < game->entity_count; ++entity_index) {
+		const struct entity *entity = game->entities + entity_index;
+		struct part_span parts = get_part_span(game, entity);
+		draw_string_f(renderer, small_font, 5, y, TEXT_ALIGN_LEFT, white, "E (%u): HAS TARGET? %s [(%f, %f) * %f]", entity_index, entity->has_target ? "YES" : "NO", (f64)entity->target.x, (f64)entity->target.y, (f64)entity->pull_of_target);
+		y += SMALL_FONT_SIZE;
+		
+		for (u32 part_index = 0; part_index < entity->part_count; ++part_index) {
+			struct v2 part_p = parts.p[entity->part_count - part_index - 1];
+			draw_string_f(renderer, small_font, 25, y, TEXT_ALIGN_LEFT, white, "E (%u, %u): (%f, %f)", entity_index, part_index, (f64)part_p.x, (f64)part_p.y);
+			y += SMALL_FONT_SIZE;
 		}
 	}
+#endif
+	t = profile_end(PROFILE_RENDER_TEXT, t);
 	
-	return false;
+	end_render_batch(renderer);
+	SDL_RenderPresent(renderer);
+	profile_end(PROFILE_RENDER_PRESENT, t);
 }
 
+#define MIX_CHUNK_LENGTH 256
+
+#if defined(__SSE2__)
+static enum oscillator_kernel oscillator_kernel = OSCILLATOR_KERNEL_SSE2;
+#else
+static enum oscillator_kernel oscillator_kernel = OSCILLATOR_KERNEL_SCALAR;
+#endif
+
 static u32
-count_entity_of_type(const struct game_state *game, enum entity_type type)
+oscillator_increment(u16 freq)
 {
-	u32 result = 0;
-	for (u32 i = 0; i < game->entity_count; ++i)
-		result += (game->entities[i].type & type) > 0;
-	return result;
+	/* NOTE(omid): Wraps like the phase does, for voices above AUDIO_FREQ. */
+	return (u32)(((u64)freq << 32) / AUDIO_FREQ);
 }
 
-static u16
-compute_entity_part_depth(const struct entity *entity, const struct entity_part *part)
+/* NOTE(omid): Picks up each voice's phase from phases by slot, a slot that
+   was silent for a while resumes where it stopped. */
+static void
+load_oscillator_bank(struct oscillator_bank *bank, const struct voice *voices, u32 count, const u32 *phases)
 {
-	u16 depth = 0;
-	const struct entity_part *p = part;
-	while (p->parent_index != p->index) {
-		depth++;
+	for (u32 i = 0; i < count; ++i) {
+		bank->phase[i] = phases[voices[i].slot];
+		bank->increment[i] = oscillator_increment(voices[i].freq);
+		bank->amp[i] = voices[i].amp;
+		bank->slot[i] = voices[i].slot;
+	}
 
-		p = entity->parts + p->parent_index;
+	u32 padded_count = (count + OSCILLATOR_LANE_COUNT - 1) & ~(u32)(OSCILLATOR_LANE_COUNT - 1);
+	for (u32 i = count; i < padded_count; ++i) {
+		bank->increment[i] = 0;
+		bank->amp[i] = 0;
 	}
+	bank->voice_count = count;
+	bank->count = padded_count;
+}
 
-	return depth;
+static void
+store_oscillator_phases(const struct oscillator_bank *bank, u32 *phases)
+{
+	for (u32 i = 0; i < bank->voice_count; ++i)
+		phases[bank->slot[i]] = bank->phase[i];
 }
 
+/* NOTE(omid): Phase in [-0.5, 0.5) cycles, then a parabola refined to about
+   0.1% of full scale. No table lookups, so it vectorizes across voices. */
 static f32
-compute_entity_mass(const struct entity *entity)
+sine_of_phase(u32 phase)
 {
-	f32 mass = 0;
-	for (u32 i = 0; i < entity->part_count; ++i)
-		mass += entity->parts[i].mass;
-
-	return mass;
+	f32 x = (f32)((s32)phase >> 8) * (1.0f / 16777216.0f);
+	f32 y = 8.0f * x - 16.0f * x * fabsf(x);
+	return 0.225f * (y * fabsf(y) - y) + y;
 }
 
 static f32
-compute_relative_mass_of_entity_head(const struct entity *entity)
+saw_of_phase(u32 phase)
 {
-	f32 total_mass = compute_entity_mass(entity);
-	return entity->parts->mass / total_mass;
+	return (f32)(phase >> 8) * (1.0f / 16777216.0f) - 0.5f;
 }
 
+/* NOTE(omid): Voice v adds into lanes[i * OSCILLATOR_LANE_COUNT + v % OSCILLATOR_LANE_COUNT],
+   the SIMD kernels keep one voice per lane and so produce the same sums. */
 static void
-push_spawn_item(struct game_state *game, enum entity_type type, u32 param, f32 t)
+mix_oscillators_scalar(struct oscillator_bank *sine_bank, struct oscillator_bank *saw_bank, f32 *lanes, u32 length)
 {
-	struct spawn_item *item = game->spawn_bag + (game->spawn_bag_count++);
-	item->type = type;
-	item->param = param;
-	item->time = game->spawn_bag_count == 1 ? t : (game->spawn_bag[game->spawn_bag_count - 2].time + t);
+	for (u32 v = 0; v < sine_bank->count; ++v) {
+		u32 phase = sine_bank->phase[v];
+		u32 increment = sine_bank->increment[v];
+		f32 amp = sine_bank->amp[v];
+		f32 *lane = lanes + v % OSCILLATOR_LANE_COUNT;
+		for (u32 i = 0; i < length; ++i) {
+			lane[i * OSCILLATOR_LANE_COUNT] += sine_of_phase(phase) * amp;
+			phase += increment;
+		}
+		sine_bank->phase[v] = phase;
+	}
+
+	for (u32 v = 0; v < saw_bank->count; ++v) {
+		u32 phase = saw_bank->phase[v];
+		u32 increment = saw_bank->increment[v];
+		f32 amp = saw_bank->amp[v];
+		f32 *lane = lanes + v % OSCILLATOR_LANE_COUNT;
+		for (u32 i = 0; i < length; ++i) {
+			lane[i * OSCILLATOR_LANE_COUNT] += saw_of_phase(phase) * amp;
+			phase += increment;
+		}
+		saw_bank->phase[v] = phase;
+	}
 }
 
+#if defined(__SSE2__)
+/* NOTE(omid): Four voices per register, same operations in the same order as
+   sine_of_phase and saw_of_phase. */
 static void
-goto_level(struct game_state *game, u32 level)
+mix_oscillators_sse2(struct oscillator_bank *sine_bank, struct oscillator_bank *saw_bank, f32 *lanes, u32 length)
 {
-	game->spawn_bag_count = 0;
-	game->spawn_bag_offset = 0;
-
-	f32 level_length = 45;
-	if (level == 0) {
-		push_spawn_item(game, ENTITY_PLAYER, 0, 0);
-		
-		push_spawn_item(game, ENTITY_SOCKET, 3, 0);
-		push_spawn_item(game, ENTITY_WORM, 0, 0);
-
-		push_spawn_item(game, ENTITY_WATER, 2, 5);
-		
-		push_spawn_item(game, ENTITY_SEED, 0, 5);
-		push_spawn_item(game, ENTITY_SEED, 0, 2);
-
-		game->level_instr = "FEED THE WORM";
-	} else if (level == 1) {
-		push_spawn_item(game, ENTITY_PLAYER, 0, 0);
-		
-		push_spawn_item(game, ENTITY_SOCKET, 5, 0);
-		
-		push_spawn_item(game, ENTITY_SEED, 0, 1);
-		push_spawn_item(game, ENTITY_SEED, 0, 2);
-
-		push_spawn_item(game, ENTITY_WATER, 4, 5);
-
-		push_spawn_item(game, ENTITY_WORM, 0, 10);
-
-
-		game->level_instr = "WATER THE SEEDS";
-	} else if (level == 2) {
-		level_length = 75;
-
-		push_spawn_item(game, ENTITY_PLAYER, 4, 0);
-		
-		push_spawn_item(game, ENTITY_SOCKET, 3, 0);
-		push_spawn_item(game, ENTITY_WORM, 0, 0);
+	const __m128 sign = _mm_set1_ps(-0.0f);
+	const __m128 phase_scale = _mm_set1_ps(1.0f / 16777216.0f);
+	const __m128 half = _mm_set1_ps(0.5f);
+	const __m128 eight = _mm_set1_ps(8.0f);
+	const __m128 sixteen = _mm_set1_ps(16.0f);
+	const __m128 refine = _mm_set1_ps(0.225f);
+
+	for (u32 v = 0; v < sine_bank->count; v += 4) {
+		__m128i phase = _mm_loadu_si128((const __m128i *)(const void *)(sine_bank->phase + v));
+		__m128i increment = _mm_loadu_si128((const __m128i *)(const void *)(sine_bank->increment + v));
+		__m128 amp = _mm_loadu_ps(sine_bank->amp + v);
+		for (u32 i = 0; i < length; ++i) {
+			__m128 x = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(phase, 8)), phase_scale);
+			__m128 y = _mm_sub_ps(_mm_mul_ps(eight, x), _mm_mul_ps(_mm_mul_ps(sixteen, x), _mm_andnot_ps(sign, x)));
+			y = _mm_add_ps(_mm_mul_ps(refine, _mm_sub_ps(_mm_mul_ps(y, _mm_andnot_ps(sign, y)), y)), y);
+
+			f32 *lane = lanes + i * OSCILLATOR_LANE_COUNT;
+			_mm_storeu_ps(lane, _mm_add_ps(_mm_loadu_ps(lane), _mm_mul_ps(y, amp)));
+			phase = _mm_add_epi32(phase, increment);
+		}
+		_mm_storeu_si128((__m128i *)(void *)(sine_bank->phase + v), phase);
+	}
 
-		push_spawn_item(game, ENTITY_SEED, 0, 5);
-		push_spawn_item(game, ENTITY_SEED, 0, 2);
+	for (u32 v = 0; v < saw_bank->count; v += 4) {
+		__m128i phase = _mm_loadu_si128((const __m128i *)(const void *)(saw_bank->phase + v));
+		__m128i increment = _mm_loadu_si128((const __m128i *)(const void *)(saw_bank->increment + v));
+		__m128 amp = _mm_loadu_ps(saw_bank->amp + v);
+		for (u32 i = 0; i < length; ++i) {
+			__m128 y = _mm_sub_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(phase, 8)), phase_scale), half);
 
-		push_spawn_item(game, ENTITY_WATER, 4, 5);
-		
-		push_spawn_item(game, ENTITY_SOCKET, 5, 10);
+			f32 *lane = lanes + i * OSCILLATOR_LANE_COUNT;
+			_mm_storeu_ps(lane, _mm_add_ps(_mm_loadu_ps(lane), _mm_mul_ps(y, amp)));
+			phase = _mm_add_epi32(phase, increment);
+		}
+		_mm_storeu_si128((__m128i *)(void *)(saw_bank->phase + v), phase);
+	}
+}
+#endif
 
-		push_spawn_item(game, ENTITY_WATER, 4, 5);
-		push_spawn_item(game, ENTITY_SEED, 0, 0);
-		push_spawn_item(game, ENTITY_SEED, 0, 0);
+/* NOTE(omid): Adds length samples of both banks into out and advances their phases. */
+static void
+mix_oscillators(struct oscillator_bank *sine_bank, struct oscillator_bank *saw_bank, f32 *out, u32 length, enum oscillator_kernel kernel)
+{
+	f32 lanes[MIX_CHUNK_LENGTH * OSCILLATOR_LANE_COUNT];
+
+	for (u32 chunk_begin = 0; chunk_begin < length; chunk_begin += MIX_CHUNK_LENGTH) {
+		u32 chunk_length = length - chunk_begin;
+		if (chunk_length > MIX_CHUNK_LENGTH)
+			chunk_length = MIX_CHUNK_LENGTH;
+
+		zero_memory(lanes, chunk_length * OSCILLATOR_LANE_COUNT * sizeof(f32));
+		switch (kernel) {
+#if defined(__SSE2__)
+		case OSCILLATOR_KERNEL_SSE2:
+			mix_oscillators_sse2(sine_bank, saw_bank, lanes, chunk_length);
+			break;
+#endif
+		default:
+			mix_oscillators_scalar(sine_bank, saw_bank, lanes, chunk_length);
+			break;
+		}
 
-		push_spawn_item(game, ENTITY_WATER, 2, 10);
-		push_spawn_item(game, ENTITY_SEED, 0, 0);
-		push_spawn_item(game, ENTITY_SEED, 0, 1);
+		for (u32 i = 0; i < chunk_length; ++i) {
+			f32 *lane = lanes + i * OSCILLATOR_LANE_COUNT;
+			out[chunk_begin + i] += (lane[0] + lane[1]) + (lane[2] + lane[3]);
+		}
+	}
+}
 
-		game->level_instr = "HERD THE WORM";
-	} else if (level == 3) {
-		level_length = 90;
+/* NOTE(omid): The old per-sample sinf/fmodf mixer, with its 16 bit phase
+   that wraps every 65536 / AUDIO_FREQ cycles, kept for the benchmark. */
+static void
+mix_oscillators_reference(const struct voice_table *table, u16 *sine_t, u16 *saw_t, f32 *out, u32 length)
+{
+	for (u32 i = 0; i < length; ++i) {
+		f32 mix = 0;
+		for (u32 wave_index = 0; wave_index < table->sine_wave_count; ++wave_index) {
+			const struct voice *wave = table->sine_waves + wave_index;
+			u16 *t = sine_t + wave_index;
+			f32 w = sinf(*t * 2.0f * 3.14f / AUDIO_FREQ) * wave->amp;
+			mix += w;
+			*t += wave->freq;
+		}
 
-		push_spawn_item(game, ENTITY_PLAYER, 8, 0);
+		for (u32 wave_index = 0; wave_index < table->saw_wave_count; ++wave_index) {
+			const struct voice *wave = table->saw_waves + wave_index;
+			u16 *t = saw_t + wave_index;
+			f32 w = 0;
+			if (!IS_F32_ZERO(wave->amp))
+				w = fmodf(wave->amp * *t / AUDIO_FREQ, wave->amp) - wave->amp / 2;
 			
-		push_spawn_item(game, ENTITY_SOCKET, 3, 0);
-		push_spawn_item(game, ENTITY_SOCKET, 3, 0);
-		push_spawn_item(game, ENTITY_WORM, 0, 0);
-
-		push_spawn_item(game, ENTITY_SEED, 0, 5);
-		push_spawn_item(game, ENTITY_SEED, 0, 2);
-		
-		push_spawn_item(game, ENTITY_WATER, 8, 5);
-		
-		push_spawn_item(game, ENTITY_SOCKET, 5, 10);
-
-		push_spawn_item(game, ENTITY_WATER, 8, 5);
-		push_spawn_item(game, ENTITY_SEED, 0, 0);
-		push_spawn_item(game, ENTITY_SEED, 0, 0);
-
-		push_spawn_item(game, ENTITY_WATER, 8, 5);
-		push_spawn_item(game, ENTITY_SEED, 0, 0);
-		push_spawn_item(game, ENTITY_SEED, 0, 1);
-
-		game->level_instr = "HERD THE WORM, AGAIN";
-	} else if (level == 4) {
-		level_length = 30;
-
-		push_spawn_item(game, ENTITY_PLAYER, 0, 0);
-		
-		push_spawn_item(game, ENTITY_SOCKET, 3, 0);
-		push_spawn_item(game, ENTITY_WORM, 0, 0);
-		
-		push_spawn_item(game, ENTITY_SEED, 0, 5);
-		push_spawn_item(game, ENTITY_SEED, 0, 2);
-
-		push_spawn_item(game, ENTITY_WATER_EATER, 0, 5);
-		
-		push_spawn_item(game, ENTITY_WATER, 8, 5);
+			mix += w;
+			*t += wave->freq;
+		}
 
-		game->level_instr = "YOU ARE THE SHEPHERD";
-	} else {
-		game->game_over = true;
-		game->level_instr = 0;
+		out[i] += mix;
 	}
-
-	game->current_level = level;
-	game->last_level_end_t = game->level_end_t;
-
-	game->tunnel_begin_t = game->level_end_t + 5;
-	game->level_begin_t = game->tunnel_begin_t + 10;
-	game->level_end_t = game->level_begin_t + level_length;
-
-	game->next_spawn_t = game->tunnel_begin_t;
-	
-	game->tunnel_size = 0;
-
-	game->counter_1 = 0;
-
-	game->skip_to_begin = false;
-	game->skip_to_end = false;
-	game->time_speed_up = 0;
 }
 
-
 static void
-begin_game_frame(struct game_state *game)
+mix_audio(void *unused, Uint8 *stream, int len)
 {
-	game->event_count = 0;
-
-	/* NOTE(omid): Clean-up dead entities and initialize the live ones. */
-	
-	u32 entity_index = 0;
-	while (entity_index < game->entity_count) {
-		struct entity *entity = game->entities + entity_index;
-		entity->suspended_for_frame = false;
-
-		if (entity->part_count == 0)
-			entity->disposed = true;
-			
-		if (entity->disposed) {
-			game->entities[entity_index] = game->entities[--game->entity_count];
-			game->entities[entity_index].index = entity_index;
-			continue;
-		}
+	struct game_state *game = unused;
+	struct voice_exchange *voices = &game->voices;
+	u64 profile_t = profile_begin();
 
-		/* NOTE(omid): Recursively dispose child parts of disposed parents. */
-		for (;;) {
-			bool found_child_to_dispose = false;
-			for (u32 i = 0; i < entity->part_count; ++i) {
-				struct entity_part *part = entity->parts + i;
-				if (part->disposed)
-					continue;
+	SDL_AtomicSet(&voices->mixing, 1);
+	if (SDL_AtomicGet(&voices->writing))
+		SDL_AtomicAdd(&voices->mixer_contention_count, 1);
 
-				if (part->parent_index != part->index)
-					continue;
+	struct voice_table *table = acquire_voice_table(voices);
+	load_oscillator_bank(&voices->sine_bank, table->sine_waves, table->sine_wave_count, voices->sine_phase);
+	load_oscillator_bank(&voices->saw_bank, table->saw_waves, table->saw_wave_count, voices->saw_phase);
 
-				if (entity->parts[part->parent_index].disposed)
-					found_child_to_dispose = part->disposed = true;
-			}
+	u32 length = (u32)(len / 4);
+	f32 *s = (f32 *)(void *)stream;
 
-			if (!found_child_to_dispose)
-				break;
+	zero_memory(s, length * sizeof(f32));
+	mix_oscillators(&voices->sine_bank, &voices->saw_bank, s, length, oscillator_kernel);
+	store_oscillator_phases(&voices->sine_bank, voices->sine_phase);
+	store_oscillator_phases(&voices->saw_bank, voices->saw_phase);
+
+	f32 noise[MIX_CHUNK_LENGTH];
+	f32 noise_mix[MIX_CHUNK_LENGTH];
+
+	for (u32 chunk_begin = 0; chunk_begin < length; chunk_begin += MIX_CHUNK_LENGTH) {
+		u32 chunk_length = length - chunk_begin;
+		if (chunk_length > MIX_CHUNK_LENGTH)
+			chunk_length = MIX_CHUNK_LENGTH;
+
+		/* NOTE(omid): Noise waves only need white noise scaled by their
+		   amplitude, so they are summed a chunk at a time. */
+		zero_memory(noise_mix, chunk_length * sizeof(f32));
+		for (u32 wave_index = 0; wave_index < table->noise_wave_count; ++wave_index) {
+			struct voice *wave = table->noise_waves + wave_index;
+			random_fill_f32(&game->audio_random, noise, chunk_length);
+			for (u32 i = 0; i < chunk_length; ++i)
+				noise_mix[i] += wave->amp * noise[i];
 		}
 
-		u16 part_index = 0;
-		while (part_index < entity->part_count) {
-			struct entity_part *part = entity->parts + part_index;
-			if (part->disposed) {
-				for (u32 i = 0; i < entity->part_count; ++i)
-					if (entity->parts[i].parent_index == (entity->part_count - 1))
-						entity->parts[i].parent_index = part_index;
-
-				entity->parts[part_index] = entity->parts[--entity->part_count];
-				entity->parts[part_index].index = part_index;
-			} else {
-				/* NOTE(omid): Init part for the new frame. */
-				part->suspended_for_frame = false;
-				part->a = part->force;
-				part->force = v2(0, 0);
+		for (u32 i = 0; i < chunk_length; ++i) {
+			f32 mix = s[chunk_begin + i] + noise_mix[i];
+		
+			if (mix < -1.0f)
+				mix = -1.0f;
+			else if (mix > 1.0f)
+				mix = 1.0f;
 
-				++part_index;
-			}
+			s[chunk_begin + i] = mix;
 		}
-
-		++entity_index;
 	}
 
-	for (u32 i = 0; i < game->entity_count; i++)
-		game->entity_index_by_z[i] = i;
+	SDL_AtomicSet(&voices->mixing, 0);
+	profile_audio_callback(profile_t);
 }
 
 
+#define SPRING_BENCHMARK_ENTITY_COUNT 128
+
 static bool
-spawn_next(struct game_state *game)
+init_spring_benchmark_scene(struct game_state *game, u32 topology)
 {
-	u32 c = game->spawn_bag_count - game->spawn_bag_offset;
-	if (!c)
+	if (!init_game_state(game, DEFAULT_RANDOM_SEED + topology, SPRING_BENCHMARK_ENTITY_COUNT))
 		return false;
 
-	struct spawn_item item = game->spawn_bag[game->spawn_bag_offset];
-	if (game->time > (item.time + game->tunnel_begin_t)) {
-		struct entity *entity = 0;
-		switch (item.type) {
-		case ENTITY_PLAYER:
-			entity = init_squid(push_entity(game), (u16)item.param);
-			entity->expiration_t = game->level_end_t;
-
-			game->player_id = entity->id;
-			game->player_index = entity->index;
-			break;
-
-		case ENTITY_WORM:
-			entity = init_worm(push_entity(game));
-			entity->expiration_t = game->level_end_t;
+	for (u32 i = 0; i < SPRING_BENCHMARK_ENTITY_COUNT; ++i) {
+		struct entity *entity = push_entity(game);
+		switch (topology) {
+		case 0:
+			init_worm(game, entity);
 			break;
-
-		case ENTITY_SOCKET:
-			entity = init_socket(push_entity(game));
-			entity->expiration_t = game->level_end_t;
-			entity->parts->accept = (u8)item.param;
+		case 1:
+			init_squid(game, entity, 8);
 			break;
-							
-		case ENTITY_SEED:
-			entity = init_seed(push_entity(game));
-			entity->expiration_t = game->level_end_t;
+		default:
+			init_water_eater(game, entity);
 			break;
+		}
 
-		case ENTITY_WATER:
-			entity = init_water(push_entity(game), (u16)item.param);
-			entity->expiration_t = game->level_end_t;
-			break;
-							
-		case ENTITY_WATER_EATER:
-			entity = init_water_eater(push_entity(game));
-			entity->expiration_t = game->level_end_t;
-			break;
+		struct part_span parts = get_part_span(game, entity);
+		for (u32 part_index = 0; part_index < entity->part_count; ++part_index) {
+			parts.p[part_index] = v2(random_f32(&game->random) * WINDOW_WIDTH, random_f32(&game->random) * WINDOW_HEIGHT);
+			parts.v[part_index] = v2(random_f32(&game->random) * 20 - 10, random_f32(&game->random) * 20 - 10);
 		}
-						
-		game->spawn_bag_offset++;
 	}
-
 	return true;
 }
 
-static bool
-check_win_condition(struct game_state *game)
-{
-	u32 socket_count = 0;
-	for (u32 i = 0; i < game->spawn_bag_count; ++i)
-		if (game->spawn_bag[i].type == ENTITY_SOCKET)
-			socket_count++;
-	
-	for (u32 i = 0; i < game->entity_count; ++i)
-		if ((game->entities[i].type & ENTITY_SOCKET) && game->entities[i].parts->content && game->entities[i].z >= 1)
-			--socket_count;
-
-	return socket_count == 0;
-}
-
-static void
-run_level_scenario_control(struct game_state *game)
+static f32
+max_relative_acceleration_error(const struct game_state *game, const struct v2 *reference_a)
 {
-	if (game->time < game->level_begin_t)
-		game->tunnel_size = WINDOW_WIDTH * (game->time - game->tunnel_begin_t) / (game->level_begin_t - game->tunnel_begin_t);
-	else
-		game->tunnel_size = WINDOW_WIDTH;
-
-	if (game->time > game->level_end_t) {
-		if (check_win_condition(game))
-			goto_level(game, game->current_level + 1);
-		else
-			goto_level(game, game->current_level);
+	f32 result = 0;
+	for (u32 i = 0; i < game->parts.span_count * MAX_ENTITY_PART_COUNT; ++i) {
+		f32 scale = fmaxf(1.0f, len_v2(reference_a[i]));
+		f32 error = len_v2(sub_v2(game->parts.a[i], reference_a[i])) / scale;
+		if (error > result)
+			result = error;
 	}
-
-	spawn_next(game);
-}
-
-static struct entity *
-find_player(struct game_state *game)
-{
-	if (!find_entity_by_id(game, game->player_id, &game->player_index))
-		return 0;
-
-	return game->entities + game->player_index;
+	return result;
 }
 
-static void
-apply_user_input(struct game_state *game, const struct input_state *input)
+/* NOTE(omid): Measures links per second of the spring pass for the worm,
+   squid and water eater topologies, at SPRING_BENCHMARK_ENTITY_COUNT entities each, and
+   checks every kernel against the reference solver. */
+static s32
+run_spring_benchmark(void)
 {
-	if (input->dstart > 0) {
-		if (game->time < game->level_begin_t) {
-			game->skip_to_begin = true;
-			game->time_speed_up = 31;
-		} else if (check_win_condition(game) && game->time < game->level_end_t) {
-			game->skip_to_end = true;
-			game->time_speed_up = 31;
+	static const char *topology_names[] = { "worm", "squid", "water_eater" };
+	static const char *kernel_names[] = { "scalar", "sse2", "avx2" };
+
+	struct game_state *game = (struct game_state *)malloc(sizeof(struct game_state));
+	u32 slot_count = SPRING_BENCHMARK_ENTITY_COUNT * MAX_ENTITY_PART_COUNT;
+	struct v2 *reference_a = (struct v2 *)malloc(slot_count * sizeof(struct v2));
+	f64 frequency = (f64)SDL_GetPerformanceFrequency();
+	enum spring_kernel best_kernel = select_spring_kernel();
+
+	printf("topology,kernel,links,iterations,links_per_second,max_relative_error\n");
+
+	for (u32 topology = 0; topology < ARRAY_COUNT(topology_names); ++topology) {
+		if (!init_spring_benchmark_scene(game, topology))
+			return 1;
+		build_spring_links(game);
+
+		u32 link_count = game->springs.count;
+		u32 iterations = 20000000 / link_count;
+
+		zero_memory(game->parts.a, slot_count * sizeof(struct v2));
+		update_spring_physics_reference(game);
+		memcpy(reference_a, game->parts.a, slot_count * sizeof(struct v2));
+
+		u64 begin = SDL_GetPerformanceCounter();
+		for (u32 i = 0; i < iterations; ++i)
+			update_spring_physics_reference(game);
+		f64 seconds = (f64)(SDL_GetPerformanceCounter() - begin) / frequency;
+		printf("%s,reference,%u,%u,%.0f,0\n", topology_names[topology], link_count, iterations, (f64)link_count * iterations / seconds);
+
+		for (u32 kernel = SPRING_KERNEL_SCALAR; kernel <= best_kernel; ++kernel) {
+			zero_memory(game->parts.a, slot_count * sizeof(struct v2));
+			update_spring_physics_(game, (enum spring_kernel)kernel);
+			f32 error = max_relative_acceleration_error(game, reference_a);
+
+			begin = SDL_GetPerformanceCounter();
+			for (u32 i = 0; i < iterations; ++i)
+				update_spring_physics_(game, (enum spring_kernel)kernel);
+			seconds = (f64)(SDL_GetPerformanceCounter() - begin) / frequency;
+
+			printf("%s,%s,%u,%u,%.0f,%g\n", topology_names[topology], kernel_names[kernel], link_count, iterations, (f64)link_count * iterations / seconds, (f64)error);
 		}
-	}
 
-	struct entity *player = find_player(game);
-	if (player) {
-		struct entity_part *root = player->parts;
+		release_game_state(game);
+	}
 
-		if (input->left)
-			root->a.x -= 2;
+	free(reference_a);
+	free(game);
+	return 0;
+}
 
-		if (input->right)
-			root->a.x += 2;
 
-		if (input->up)
-			root->a.y -= 2;
+#define AUDIO_BENCHMARK_BUFFER_LENGTH 1024
+#define AUDIO_BENCHMARK_ERROR_BUFFER_COUNT 4
 
-		if (input->down)
-			root->a.y += 2;
+/* NOTE(omid): Mixes sine-only buffers from phase zero and returns the largest
+   deviation from an exact oscillator, relative to the summed amplitude.
+   kernel < 0 runs the reference mixer. */
+static f64
+measure_oscillator_error(struct voice_exchange *voices, struct voice_table *table, u16 *sine_t, u16 *saw_t, s32 kernel)
+{
+	u32 saw_wave_count = table->saw_wave_count;
+	table->saw_wave_count = 0;
+
+	zero_memory(sine_t, MAX_VOICE_COUNT * sizeof(u16));
+	zero_memory(voices->sine_phase, voices->phase_slot_count * sizeof(u32));
+	load_oscillator_bank(&voices->sine_bank, table->sine_waves, table->sine_wave_count, voices->sine_phase);
+	load_oscillator_bank(&voices->saw_bank, table->saw_waves, 0, voices->saw_phase);
+
+	f64 amp_sum = 0;
+	for (u32 v = 0; v < table->sine_wave_count; ++v)
+		amp_sum += (f64)table->sine_waves[v].amp;
+
+	f64 max_error = 0;
+	f32 out[AUDIO_BENCHMARK_BUFFER_LENGTH];
+	for (u32 buffer = 0; buffer < AUDIO_BENCHMARK_ERROR_BUFFER_COUNT; ++buffer) {
+		zero_memory(out, sizeof(out));
+		if (kernel < 0)
+			mix_oscillators_reference(table, sine_t, saw_t, out, AUDIO_BENCHMARK_BUFFER_LENGTH);
+		else
+			mix_oscillators(&voices->sine_bank, &voices->saw_bank, out, AUDIO_BENCHMARK_BUFFER_LENGTH, (enum oscillator_kernel)kernel);
+
+		for (u32 i = 0; i < AUDIO_BENCHMARK_BUFFER_LENGTH; ++i) {
+			u64 n = buffer * AUDIO_BENCHMARK_BUFFER_LENGTH + i;
+			f64 exact = 0;
+			for (u32 v = 0; v < table->sine_wave_count; ++v) {
+				const struct voice *wave = table->sine_waves + v;
+				f64 cycles = (f64)((wave->freq * n) % AUDIO_FREQ) / AUDIO_FREQ;
+				exact += sin(cycles * 6.283185307179586) * (f64)wave->amp;
+			}
 
-		s32 mouse_x, mouse_y;
-		u32 mouse_buttons = SDL_GetMouseState(&mouse_x, &mouse_y);
-		if (mouse_buttons & SDL_BUTTON(SDL_BUTTON_LEFT)) {
-			struct v2 m = v2((f32)mouse_x, (f32)mouse_y);
-			struct v2 d = sub_v2(m, root->p);
-			root->a = add_v2(root->a, scale_v2(normalize_v2(d), 2));
+			f64 error = fabs((f64)out[i] - exact) / amp_sum;
+			if (error > max_error)
+				max_error = error;
 		}
 	}
+
+	table->saw_wave_count = saw_wave_count;
+	return max_error;
 }
 
+/* NOTE(omid): Voices mixed per millisecond for AUDIO_BENCHMARK_BUFFER_LENGTH
+   sample buffers, for the old mixer and each oscillator kernel, at a few
+   voice counts up to MAX_VOICE_COUNT. */
+static s32
+run_audio_benchmark(void)
+{
+	static const u32 voice_counts[] = { 16, 256, MAX_VOICE_COUNT };
+	static const char *kernel_names[] = { "scalar", "sse2" };
+
+	struct voice_exchange *voices = (struct voice_exchange *)malloc(sizeof(struct voice_exchange));
+	u32 *phases = (u32 *)malloc(2 * MAX_VOICE_COUNT * sizeof(u32));
+	u16 *sine_t = (u16 *)malloc(MAX_VOICE_COUNT * sizeof(u16));
+	u16 *saw_t = (u16 *)malloc(MAX_VOICE_COUNT * sizeof(u16));
+	f32 out[AUDIO_BENCHMARK_BUFFER_LENGTH];
+	f64 frequency = (f64)SDL_GetPerformanceFrequency();
+
+	struct random_series random;
+	seed_random_series(&random, DEFAULT_RANDOM_SEED);
+
+	ZERO_STRUCT(*voices);
+	zero_memory(phases, 2 * MAX_VOICE_COUNT * sizeof(u32));
+	voices->phase_slot_count = MAX_VOICE_COUNT;
+	voices->sine_phase = phases;
+	voices->saw_phase = phases + MAX_VOICE_COUNT;
+	struct voice_table *table = voices->tables;
+
+	printf("kernel,voices,buffers,voices_per_ms,max_error\n");
+
+	for (u32 count_index = 0; count_index < ARRAY_COUNT(voice_counts); ++count_index) {
+		u32 voice_count = voice_counts[count_index];
+		for (u32 v = 0; v < voice_count; ++v) {
+			table->sine_waves[v].slot = v;
+			table->saw_waves[v].slot = v;
+			table->sine_waves[v].freq = (u16)random_int(&random, 40, 4000);
+			table->sine_waves[v].amp = random_f32(&random) * 0.25f;
+			table->saw_waves[v].freq = (u16)random_int(&random, 40, 4000);
+			table->saw_waves[v].amp = random_f32(&random) * 0.25f;
+		}
+		table->sine_wave_count = voice_count;
+		table->saw_wave_count = voice_count;
 
-static bool
-target_nearest_entity_of_type(struct game_state *game, struct entity *entity, enum entity_type type, f32 max_dist) {
-	bool result = false;
-	
-	struct entity_part *head = entity->parts;
-	
-	f32 min_dist = 100000000;
-	for (u32 i = 0; i < game->entity_count; ++i) {
-		struct entity *other = game->entities + i;
-		if (other->z < 1)
-			continue;
+		u32 buffer_count = (1 << 24) / (voice_count * AUDIO_BENCHMARK_BUFFER_LENGTH);
 
-		if (other->expiration_t > 0 && game->time > other->expiration_t)
-			continue;
-			
-		if (other->type & type) {
-			f32 dist = len_v2(sub_v2(head->p, other->parts->p));
-			if (dist > max_dist)
-				continue;
-			
-			if (dist < min_dist) {
-				min_dist = dist;
-				entity->target_entity_id = other->id;
-				entity->target_entity_index = i;
-				result = true;
-			}
-		}
-	}
+		for (s32 kernel = -1; kernel <= (s32)oscillator_kernel; ++kernel) {
+			f64 error = measure_oscillator_error(voices, table, sine_t, saw_t, kernel);
 
-	return result;
-}
+			load_oscillator_bank(&voices->sine_bank, table->sine_waves, table->sine_wave_count, voices->sine_phase);
+			load_oscillator_bank(&voices->saw_bank, table->saw_waves, table->saw_wave_count, voices->saw_phase);
 
-static bool
-entity_should_check_target(struct game_state *game, struct entity *entity)
-{
-	struct entity_part *head = entity->parts;
+			u64 begin = SDL_GetPerformanceCounter();
+			for (u32 buffer = 0; buffer < buffer_count; ++buffer) {
+				zero_memory(out, sizeof(out));
+				if (kernel < 0)
+					mix_oscillators_reference(table, sine_t, saw_t, out, AUDIO_BENCHMARK_BUFFER_LENGTH);
+				else
+					mix_oscillators(&voices->sine_bank, &voices->saw_bank, out, AUDIO_BENCHMARK_BUFFER_LENGTH, (enum oscillator_kernel)kernel);
+			}
+			f64 seconds = (f64)(SDL_GetPerformanceCounter() - begin) / frequency;
 
-	bool check_target = game->time > entity->next_target_check_t;
-	if (!check_target && entity->has_target) {
-		f32 dist = len_v2(sub_v2(head->p, entity->target));
-		if (isnan(dist) || dist < 10)
-			check_target = true;
+			/* NOTE(omid): A sine and a saw voice count as two voices. */
+			printf("%s,%u,%u,%.1f,%g\n", kernel < 0 ? "reference" : kernel_names[kernel],
+			       voice_count * 2, buffer_count, (f64)(voice_count * 2 * buffer_count) / (seconds * 1000), error);
+		}
 	}
 
-	return check_target;
+	free(saw_t);
+	free(sine_t);
+	free(phases);
+	free(voices);
+	return 0;
 }
 
-static void
-update_roaming_ai(struct entity *entity)
-{	
-	f32 r1 = (f32)(random_int(0, WINDOW_WIDTH / 2));
-	f32 r2 = (f32)(random_int(0, WINDOW_HEIGHT / 2));
-	
-	f32 a = (f32)random_f32() * 2 * 3.14f;
-	entity->target = add_v2(screen_center, v2(r1 * cosf(a), r2 * sinf(a)));
-	entity->has_target = true;
-}
 
 static void
-update_worm_ai(struct game_state *game, struct entity *entity)
+update_input_deltas(struct input_state *input, const struct input_state *prev_input)
 {
-	if (entity->z < 1)
-		return;
+	input->dleft = (s8)(input->left - prev_input->left);
+	input->dright = (s8)(input->right - prev_input->right);
+	input->dup = (s8)(input->up - prev_input->up);
+	input->ddown = (s8)(input->down - prev_input->down);
+	input->dstart = (s8)(input->start - prev_input->start);
 
-	if (!entity_should_check_target(game, entity))
-		return;
-	
-	if (!target_nearest_entity_of_type(game, entity, ENTITY_FOOD, 200))
-		update_roaming_ai(entity);
+	input->dspeed_up = (s8)(input->speed_up - prev_input->speed_up);
+	input->dspeed_down = (s8)(input->speed_down - prev_input->speed_down);
 
-	entity->pull_of_target = 1.0f;
-	entity->next_target_check_t = game->time + 2;
+	input->dmouse_left = (s8)(input->mouse_left - prev_input->mouse_left);
 }
 
+/* NOTE(omid): Everything a frame needs besides input sampling and
+   rendering, shared by the windowed and the headless loop. The caller
+   advances frame_index. */
 static void
-update_water_eater_ai(struct game_state *game, struct entity *entity)
+step_game(struct game_state *game, struct input_state *input)
 {
-	if (entity->z < 1)
-		return;
+	if (!game->game_over)
+		game->time = (f32)game->frame_index * (f32)SIMULATION_DT;
 
-	if (!entity_should_check_target(game, entity))
-		return;
-	
-	if (!target_nearest_entity_of_type(game, entity, ENTITY_FOOD, 600))
-		update_roaming_ai(entity);
+	if (game->time > game->level_begin_t && game->skip_to_begin) {
+		game->skip_to_begin = false;
+		game->time_speed_up = 0;
+	}
 
-	entity->pull_of_target = 1.0f;
-	entity->next_target_check_t = game->time + 2;
-}
+	if (game->time > game->level_end_t && game->skip_to_end) {
+		game->skip_to_end = false;
+		game->time_speed_up = 0;
+	}
 
-static void
-update_entity_ai(struct game_state *game)
-{
-	for (u32 entity_index = 0; entity_index < game->entity_count; ++entity_index) {
-		struct entity *entity = game->entities + entity_index;
-		struct entity_part *head = entity->parts;
-		assert(!entity->disposed);
-		assert(!entity->suspended_for_frame);
-		assert(entity->index == (u16)entity_index);					
-		
-		/* TODO(omid): Remove this? */
-		for (u32 part_index = 0; part_index < entity->part_count; ++part_index) {
-			struct entity_part *part = entity->parts + part_index;
-			assert(!part->disposed);
-			assert(!part->suspended_for_frame);
-			assert(part->index == (u16)part_index);
+	update_game(game, input);
 
-			if (entity->expiration_t > 0 && game->time > entity->expiration_t)
-				part->color = 0;
+	/* NOTE(omid): A failed level goes back to the state it started in. Without
+	   a snapshot of it, say after loading one from a file, it is set up
+	   again on top of what is left. */
+	if (game->restart_level) {
+		game->restart_level = false;
+		if (keyframe_belongs_to(&level_start_keyframe, game) &&
+		    level_start_keyframe.state.current_level == game->current_level)
+			restore_game_keyframe(game, &level_start_keyframe);
+		else
+			goto_level(game, game->current_level);
+	}
 
-		}
+	if (game->level_snapshot_pending) {
+		game->level_snapshot_pending = false;
+		take_game_keyframe(&level_start_keyframe, game);
+		++level_start_serial;
+	}
+}
 
-		bool reverse_z = entity->expiration_t > 0 && game->time > entity->expiration_t;
-		const f32 z_speed = 0.001f;
-		
-		while (reverse_z && entity->z > 1) {
-			entity->accum_z -= entity->z;
-			entity->z -= z_speed;
-		}
 
-		if (entity->z < 1 && entity->accum_z > 0) {
-			f32 zsqrd = entity->z * entity->z;
-			f32 r1 = zsqrd * WINDOW_WIDTH / 2.0f + 50;
-			f32 r2 = zsqrd * WINDOW_HEIGHT / 2.0f;
+struct input_keyframe {
+	u32 frame;
+	struct input_state input;
+};
 
-			f32 phi = fmodf((f32)entity->seed, 2 * 3.14f);
-			
-			entity->target = add_v2(screen_center, v2(r1 * cosf(2048 * 3.14f * entity->z / entity->accum_z + phi), r2 * sinf(2048 * 3.14f * entity->z / entity->accum_z + phi)));
-			entity->pull_of_target = 1 / compute_relative_mass_of_entity_head(entity);
-			entity->has_target = true;
-			entity->z += reverse_z ? -z_speed : z_speed;
-			if (entity->z > 1)
-				entity->has_target = false;
-		} else if (entity->z < 2) {
-			entity->z += reverse_z ? -z_speed : z_speed;
-		}
-		
-		if (entity->z < 2)
-			entity->accum_z += reverse_z ? -entity->z : entity->z;
+struct input_script {
+	struct input_keyframe *keyframes;
+	u32 count;
+	u32 next;
+};
 
-		if (entity->z < 0) {
-			entity->z = 0;
-			entity->disposed = true;
+/* NOTE(omid): One line per change of held input, "<frame> <key>...", keys
+   being left, right, up, down, start, speed_up, speed_down and mouse=X,Y
+   (which also holds the left button). The state holds until the next line.
+   Lines starting with '#' are skipped. */
+static b32
+load_input_script(struct input_script *script, const char *path)
+{
+	FILE *file = fopen(path, "r");
+	if (!file)
+		return false;
+
+	u32 capacity = 0;
+	u32 line_number = 0;
+	char line[256];
+	while (fgets(line, sizeof(line), file)) {
+		++line_number;
+		/* NOTE(omid): fgets splits a longer line, the rest would read as a
+		   keyframe of its own. */
+		if (!strchr(line, '\n') && !feof(file)) {
+			fprintf(stderr, "%s:%u: line too long\n", path, line_number);
+			fclose(file);
+			free(script->keyframes);
+			ZERO_STRUCT(*script);
+			return false;
 		}
-		if (entity->accum_z < 0)
-			entity->accum_z = 0;
-		
 
-		switch (entity->type) {
-		case ENTITY_WORM:
-			update_worm_ai(game, entity);
-			break;
+		char *token = strtok(line, " \t\r\n");
+		if (!token || token[0] == '#')
+			continue;
 
-		case ENTITY_WATER_EATER:
-			update_water_eater_ai(game, entity);
-			break;
-		}
-		
-		if (entity->target_entity_id && find_entity_by_id(game, entity->target_entity_id, &entity->target_entity_index)) {
-			struct entity *target = game->entities + entity->target_entity_index;
-			if (target->disposed || (target->expiration_t > 0 && game->time > target->expiration_t)) {
-				entity->has_target = false;
-				entity->target_entity_id = 0;
-			} else {
-				entity->target = target->parts[0].p;
-				entity->has_target = true;
-			}
-		} else if (entity->target_entity_id) {
-			entity->has_target = false;
-			entity->target_entity_id = 0;
+		if (script->count == capacity) {
+			capacity = capacity ? capacity * 2 : 64;
+			script->keyframes = (struct input_keyframe *)realloc(script->keyframes, capacity * sizeof(struct input_keyframe));
 		}
 
-		if (entity->has_target) {
-			struct v2 d = normalize_v2(sub_v2(entity->target, head->p));
-			head->a = add_v2(head->a, scale_v2(d, entity->pull_of_target));
+		struct input_keyframe *keyframe = script->keyframes + script->count++;
+		ZERO_STRUCT(*keyframe);
+		keyframe->frame = (u32)strtoul(token, 0, 10);
+
+		struct input_state *in = &keyframe->input;
+		while ((token = strtok(0, " \t\r\n"))) {
+			if (strcmp(token, "left") == 0)
+				in->left = 1;
+			else if (strcmp(token, "right") == 0)
+				in->right = 1;
+			else if (strcmp(token, "up") == 0)
+				in->up = 1;
+			else if (strcmp(token, "down") == 0)
+				in->down = 1;
+			else if (strcmp(token, "start") == 0)
+				in->start = 1;
+			else if (strcmp(token, "speed_up") == 0)
+				in->speed_up = 1;
+			else if (strcmp(token, "speed_down") == 0)
+				in->speed_down = 1;
+			else if (sscanf(token, "mouse=%d,%d", &in->mouse_x, &in->mouse_y) == 2)
+				in->mouse_left = 1;
+			else
+				fprintf(stderr, "%s: unknown input '%s'\n", path, token);
 		}
 	}
+
+	fclose(file);
+	return true;
 }
 
 static void
-update_spring_physics(struct game_state *game)
+sample_input_script(struct input_script *script, u32 frame_index, struct input_state *input)
 {
-	for (u32 entity_index = 0; entity_index < game->entity_count; ++entity_index) {
-		struct entity *entity = game->entities + entity_index;
-		for (u32 part_index = 0; part_index < entity->part_count; ++part_index) {
-			struct entity_part *part = entity->parts + part_index;
-			if (part_index != part->parent_index) {
-				struct entity_part *parent = entity->parts + part->parent_index;
-        
-				struct v2 offset = sub_v2(part->p, parent->p);
-				struct v2 ideal = add_v2(parent->p, scale_v2(normalize_v2(offset), part->length));
-				struct v2 d = sub_v2(ideal, part->p);
-
-				const f32 K = 10.0f + part->stiffness;
-				f32 force = len_v2(d) * K;
+	struct input_state prev_input = *input;
 
-				part->a = add_v2(part->a, scale_v2(d, force / part->mass));
-				parent->a = add_v2(parent->a, scale_v2(d, -force / parent->mass));
-			}
-			part->a = sub_v2(part->a, scale_v2(part->v, 0.2f));
-		}
+	if (script->count) {
+		while (script->next < script->count && script->keyframes[script->next].frame <= frame_index)
+			*input = script->keyframes[script->next++].input;
+	} else {
+		/* NOTE(omid): Without a script, wander around and tap start every ten seconds. */
+		ZERO_STRUCT(*input);
+		input->left = (frame_index / 97) % 3 == 0;
+		input->right = (frame_index / 131) % 3 == 1;
+		input->up = (frame_index / 71) % 2 == 1;
+		input->down = (frame_index / 53) % 3 == 2;
+		input->start = (frame_index % 600) < 3;
 	}
+
+	update_input_deltas(input, &prev_input);
 }
 
-static void
-check_for_collisions_against_entities(struct game_state *game, struct entity *entity, struct entity_part *part, struct v2 *new_p, struct v2 v)
-{
-	for (u32 other_index = 0; other_index < game->entity_count; ++other_index) {
-		if (other_index == entity->index && (!entity->internal_collisions || !part->internal_collisions))
-			continue;
 
-		struct entity *other = game->entities + other_index;
+#define REPLAY_VERSION 1
+#define REPLAY_KEYFRAME_INTERVAL 600
+#define REPLAY_SEEK_FRAMES (10 * SIMULATION_HZ)
+
+static const char replay_magic[8] = "LD48RPL";
+
+/* NOTE(omid): A replay file is this header followed by byte_count bytes of
+   changes to the held input, in the byte order of the machine that wrote
+   it. A change is the frames since the last change as a varint, the eight
+   buttons in a byte, then the mouse movement on x and y as zigzag varints.
+   The input holds from the frame of one change up to the next. */
+struct replay_header {
+	char magic[8];
+	u32 version;
+	u32 level;
+	u64 seed;
+	u32 max_entity_count;
+	u32 frame_count;
+	u32 byte_count;
+	u32 pad_;
+};
 
-		if (other->z < 1)
-			continue;
-				
-		for (u32 other_part_index = 0; other_part_index < other->part_count; ++other_part_index) {
-			if (other_index == entity->index && part->index == other_part_index)
-				continue;
+struct replay {
+	struct replay_header header;
+	u8 *bytes;
+	u32 capacity;
+
+	/* NOTE(omid): Recording only, the frame and held input of the last
+	   change written. */
+	u32 change_frame;
+	struct input_state input;
+};
 
-			struct entity_part *other_part = other->parts + other_part_index;
+/* NOTE(omid): How far playback got, input being the held input of the
+   change before offset. */
+struct replay_cursor {
+	u32 offset;
+	u32 change_frame;
+	struct input_state input;
+};
 
-			if (other_index == entity->index && !other_part->internal_collisions)
-				continue;
-			
-			bool do_collision_response = false;
-
-			struct v2 tmp = v;
-			struct v2 tmp_p = *new_p;
-			if (test_collision_against_box(other_part, part, part->p, &tmp_p, &tmp)) {
-				do_collision_response = !entity->passthrough && !other->passthrough && !part->passthrough && !other_part->passthrough;
-
-				if (!entity->suspended_for_frame && !part->suspended_for_frame && !other->suspended_for_frame && !other_part->suspended_for_frame) {
-					try_seed_touch_water(game, entity, part, other, other_part);
-					try_worm_eat_food(game, entity, part, other, other_part);
-					try_water_eater_eat_water(game, entity, part, other, other_part);
-					try_gem_touch_socket(game, entity, part, other, other_part);
-				}
-			}
+static u8
+pack_replay_buttons(const struct input_state *input)
+{
+	return (u8)((input->left != 0) |
+		    (input->right != 0) << 1 |
+		    (input->up != 0) << 2 |
+		    (input->down != 0) << 3 |
+		    (input->start != 0) << 4 |
+		    (input->speed_up != 0) << 5 |
+		    (input->speed_down != 0) << 6 |
+		    (input->mouse_left != 0) << 7);
+}
 
-			if (do_collision_response) {
-				*new_p = tmp_p;
-				/* struct v2 d = normalize_v2(sub_v2(op->p, part->p)); */
-				struct v2 d = normalize_v2(v);
-				f32 v1 = dot_v2(v, d);
-				f32 v2 = dot_v2(other_part->v, d);
-				f32 total_mass = part->mass + other_part->mass;
-				f32 dv = v1 - v2;
+static void
+unpack_replay_buttons(struct input_state *input, u8 buttons)
+{
+	input->left = buttons & 1;
+	input->right = (buttons >> 1) & 1;
+	input->up = (buttons >> 2) & 1;
+	input->down = (buttons >> 3) & 1;
+	input->start = (buttons >> 4) & 1;
+	input->speed_up = (buttons >> 5) & 1;
+	input->speed_down = (buttons >> 6) & 1;
+	input->mouse_left = (buttons >> 7) & 1;
+}
 
-				f32 f1 = -dv * other_part->mass / total_mass * 2;
-				f32 f2 = dv * part->mass / total_mass * 2;
+static u32
+zigzag_encode(s32 value)
+{
+	return ((u32)value << 1) ^ (u32)(value >> 31);
+}
 
-#if 0
-				printf("Collision (%u,%u) <=> (%u,%u)\n", entity_index, part_index, other_index, other_part_index);
-				printf("\tV1: %f, V2: %f, M1: %f, M2: %f, DV: %f\n", (f64)v1, (f64)v2, (f64)part->mass, (f64)op->mass, (f64)dv);
-				printf("\tF1: %f, F2: %f\n", (f64)(f1), (f64)(f2));
-#endif
-				part->force = add_v2(part->force, scale_v2(d, f1));
-				other_part->force = add_v2(other_part->force, scale_v2(d, f2));
-			}
-		}
+static s32
+zigzag_decode(u32 value)
+{
+	return (s32)(value >> 1) ^ -(s32)(value & 1);
+}
+
+static void
+push_replay_byte(struct replay *replay, u8 byte)
+{
+	if (replay->header.byte_count == replay->capacity) {
+		replay->capacity = replay->capacity ? replay->capacity * 2 : 4096;
+		replay->bytes = (u8 *)realloc(replay->bytes, replay->capacity);
+		assert(replay->bytes);
 	}
+	replay->bytes[replay->header.byte_count++] = byte;
 }
 
 static void
-force_entity_part_within_bounds(struct entity_part *part)
-{	
-	if (isnan(part->p.x))
-		part->p.x = 0;
-	if (isnan(part->p.y))
-		part->p.y = 0;
-			
-	if (part->p.x < 0) {
-		part->p.x = 0;
-		part->v.x = -part->v.x * 0.4f;
-		part->a.x = 0;
-	} else if (part->p.x > WINDOW_WIDTH) {
-		part->p.x = WINDOW_WIDTH;
-		part->v.x = -part->v.x * 0.4f;
-		part->a.x = 0;
+push_replay_varint(struct replay *replay, u32 value)
+{
+	while (value >= 0x80) {
+		push_replay_byte(replay, (u8)(value | 0x80));
+		value >>= 7;
 	}
+	push_replay_byte(replay, (u8)value);
+}
 
-	if (part->p.y < 0) {
-		part->p.y = 0;
-		part->v.y = -part->v.y * 0.4f;
-		part->a.y = 0;
-	} else if (part->p.y > WINDOW_HEIGHT) {
-		part->p.y = WINDOW_HEIGHT;
-		part->v.y = -part->v.y * 0.4f;
-		part->a.y = 0;
+/* NOTE(omid): Stops at the end of the bytes, load_replay makes sure no
+   change runs past it. */
+static u32
+read_replay_varint(const struct replay *replay, u32 *offset)
+{
+	u32 result = 0;
+	for (u32 shift = 0; *offset < replay->header.byte_count && shift < 32; shift += 7) {
+		u8 byte = replay->bytes[(*offset)++];
+		result |= (u32)(byte & 0x7F) << shift;
+		if (!(byte & 0x80))
+			break;
 	}
+	return result;
 }
 
 static void
-update_newtonian_physics(struct game_state *game)
+begin_replay_recording(struct replay *replay, u64 seed, u32 level, u32 max_entities)
 {
-	for (u32 entity_index = 0; entity_index < game->entity_count; ++entity_index) {
-		struct entity *entity = game->entities + entity_index;
-		
-		for (u32 part_index = 0; part_index < entity->part_count; ++part_index) {
-			struct entity_part *part = entity->parts + part_index;
-			struct v2 orig_new_v = add_v2(part->v, part->a);
-			struct v2 new_v = orig_new_v;
-			if (len_v2(new_v) > 10)
-				new_v = scale_v2(normalize_v2(new_v), 10);
-			
-			struct v2 new_p = add_v2(part->p, new_v);
-
-			if (entity->z > 1)
-				check_for_collisions_against_entities(game, entity, part, &new_p, new_v);
-
-			if (len_v2(new_v) > 10)
-				new_v = scale_v2(normalize_v2(new_v), 10);
-
-			if (!entity->fixed) {
-				part->p = new_p;
-				part->v = new_v;
-			}
-
-			force_entity_part_within_bounds(part);
-		}
-	}
+	ZERO_STRUCT(*replay);
+	memcpy(replay->header.magic, replay_magic, sizeof(replay_magic));
+	replay->header.version = REPLAY_VERSION;
+	replay->header.seed = seed;
+	replay->header.level = level;
+	replay->header.max_entity_count = max_entities;
 }
 
+/* NOTE(omid): Called with the held input of every step, in order. */
 static void
-process_triggered_events(struct game_state *game)
+record_replay_frame(struct replay *replay, const struct input_state *input)
 {
-	for (u32 event_index = 0; event_index < game->event_count; ++event_index) {
-		struct game_event *e = game->events + event_index;
-		switch (e->type) {
-		case GAME_EVENT_NONE:
-			break;
-			
-		case GAME_EVENT_SEED_TOUCH_WATER: {
-			struct entity *seed = game->entities + e->seed_touch_water.e1;
-			struct entity *water = game->entities + e->seed_touch_water.e2;
-			struct entity_part *droplet = water->parts + e->seed_touch_water.p2;
+	u32 frame = replay->header.frame_count++;
+	u8 buttons = pack_replay_buttons(input);
+	if (buttons == pack_replay_buttons(&replay->input) &&
+	    input->mouse_x == replay->input.mouse_x &&
+	    input->mouse_y == replay->input.mouse_y)
+		return;
 
-			droplet->disposed = true;
-			/* seed->disposed = true; */
-			/* struct entity *food = push_entity(game); */
+	push_replay_varint(replay, frame - replay->change_frame);
+	push_replay_byte(replay, buttons);
+	push_replay_varint(replay, zigzag_encode(input->mouse_x - replay->input.mouse_x));
+	push_replay_varint(replay, zigzag_encode(input->mouse_y - replay->input.mouse_y));
+
+	replay->change_frame = frame;
+	ZERO_STRUCT(replay->input);
+	unpack_replay_buttons(&replay->input, buttons);
+	replay->input.mouse_x = input->mouse_x;
+	replay->input.mouse_y = input->mouse_y;
+}
+
+static b32
+write_replay(const struct replay *replay, const char *path)
+{
+	FILE *file = fopen(path, "wb");
+	if (!file)
+		return false;
 
-			struct v2 p = seed->parts->p;
-			init_food(seed);
-			seed->parts->p = p;
+	b32 result = fwrite(&replay->header, sizeof(replay->header), 1, file) == 1 &&
+		fwrite(replay->bytes, 1, replay->header.byte_count, file) == replay->header.byte_count;
+	result = fclose(file) == 0 && result;
+	return result;
+}
 
-			/* food->parts->p = seed->parts->p; */
-			/* food->parts->v = seed->parts->v; */
-		} break;
+/* NOTE(omid): Reads the next change at or before frame_index into the
+   cursor, false when the next change is after it or there is none. */
+static b32
+read_replay_change(const struct replay *replay, struct replay_cursor *cursor, u32 frame_index)
+{
+	if (cursor->offset >= replay->header.byte_count)
+		return false;
 
-		case GAME_EVENT_WORM_EAT_FOOD: {
-			struct entity *worm = game->entities + e->worm_eat_food.e1;
-			struct entity *food = game->entities + e->worm_eat_food.e2;
-			struct entity_part *food_part = food->parts + e->worm_eat_food.p2;
+	u32 offset = cursor->offset;
+	u32 change_frame = cursor->change_frame + read_replay_varint(replay, &offset);
+	if (change_frame > frame_index || offset >= replay->header.byte_count)
+		return false;
 
-			food_part->disposed = true;
+	u8 buttons = replay->bytes[offset++];
+	s32 dx = zigzag_decode(read_replay_varint(replay, &offset));
+	s32 dy = zigzag_decode(read_replay_varint(replay, &offset));
 
-			bool worm_full = true;
-			bool worm_hydrated = true;
+	cursor->offset = offset;
+	cursor->change_frame = change_frame;
+	unpack_replay_buttons(&cursor->input, buttons);
+	cursor->input.mouse_x += dx;
+	cursor->input.mouse_y += dy;
+	return true;
+}
 
-			for (u32 i = 0; i < worm->part_count; ++i) {
-				if (!worm->parts[i].content)
-					worm_full = false;
-				if (!worm->parts[i].hydration)
-					worm_hydrated = false;
-			}
-						
-			if (food_part->content_value) {
-				for (u32 i = 0; i < worm->part_count; ++i) {
-					if (!worm->parts[i].content) {
-						worm->parts[i].content = (u8)food_part->color;
-						worm->parts[i].content_value = food_part->content_value;
-						worm_full = i == (worm->part_count - 1);
-						break;
-					}
-				}
-			} else if (food->type & ENTITY_WATER) {
-				for (u32 i = 0; i < worm->part_count; ++i) {
-					if (!worm->parts[i].hydration) {
-						worm->parts[i].hydration = 1;
-						worm->parts[i].color = 4;
-						worm_hydrated = i == (worm->part_count - 1);
-						break;
-					}
-				}
-			}
+static b32
+load_replay(struct replay *replay, const char *path)
+{
+	ZERO_STRUCT(*replay);
+	FILE *file = fopen(path, "rb");
+	if (!file)
+		return false;
 
-			if (worm_full && worm_hydrated) {
-#if 0
-				u32 score = 0;
-				u32 multiplier = 1;
-				for (u32 i = 0; i < worm->part_count; ++i) {
-					score += multiplier * worm->parts[i].content_value;
-					multiplier += worm->parts[i].content_value;
-					worm->parts[i].content = 0;
-					worm->parts[i].content_value = 0;
-					worm->parts[i].hydration = 0;
-					worm->parts[i].color = 2;
-				}
-				game->score += score;
-				/* push_worm_tail(worm); */
-#else
-				if (worm->part_count == 2) {
-					u8 poop = 0;
-					if (worm->parts[0].content == 2 &&
-					    worm->parts[1].content == 2) {
-						poop = 3;
-					} else if (worm->parts[0].content == 4 &&
-						   worm->parts[1].content == 4) {
-						poop = 5;
-					}
+	b32 result = fread(&replay->header, sizeof(replay->header), 1, file) == 1 &&
+		memcmp(replay->header.magic, replay_magic, sizeof(replay_magic)) == 0 &&
+		replay->header.version == REPLAY_VERSION;
+	/* NOTE(omid): byte_count is untrusted, it has to fit in what is left
+	   of the file. */
+	if (result) {
+		long file_size = fseek(file, 0, SEEK_END) == 0 ? ftell(file) : -1;
+		result = file_size >= (long)sizeof(replay->header) &&
+			(u64)replay->header.byte_count <= (u64)file_size - sizeof(replay->header) &&
+			fseek(file, (long)sizeof(replay->header), SEEK_SET) == 0;
+	}
+	if (result) {
+		replay->capacity = replay->header.byte_count;
+		replay->bytes = (u8 *)malloc(replay->capacity ? replay->capacity : 1);
+		result = replay->bytes && fread(replay->bytes, 1, replay->header.byte_count, file) == replay->header.byte_count;
+	}
+	fclose(file);
+
+	/* NOTE(omid): Every change has to decode in full and in order. */
+	struct replay_cursor cursor;
+	ZERO_STRUCT(cursor);
+	while (result && read_replay_change(replay, &cursor, replay->header.frame_count));
+	if (result && cursor.offset != replay->header.byte_count)
+		result = false;
+
+	if (!result) {
+		free(replay->bytes);
+		ZERO_STRUCT(*replay);
+	}
+	return result;
+}
 
-					if (poop) {
-						struct entity *gem = init_gem(push_entity(game), poop);
-						gem->expiration_t = game->level_end_t;
-						gem->z = 1;
-						gem->accum_z = 1;
+struct replay_keyframe {
+	struct game_keyframe game;
+	struct replay_cursor cursor;
+	struct input_state input;
+	u32 frame_index;
+	/* NOTE(omid): Into level_starts, ~0 for none. */
+	u32 level_start_index;
+};
 
-						struct v2 d = sub_v2(worm->parts[worm->part_count - 1].p, worm->parts[worm->part_count - 2].p);
-						gem->parts->p = add_v2(worm->parts[worm->part_count - 1].p, d);
-						gem->parts->v = scale_v2(d, 100);
-					}
-				}
+/* NOTE(omid): Plays a replay into a game, keeping a keyframe every
+   REPLAY_KEYFRAME_INTERVAL frames on the way, so seek_replay goes back
+   without replaying from the start. The game has to start out as
+   init_game_state and goto_level with the header's parameters left it.
+   frame_index counts replay frames, the game's goes back on level
+   restarts. Every level start snapshot a keyframe was taken with is kept
+   once, so the restarts after a seek come out the same. */
+struct replay_player {
+	struct replay replay;
+	struct replay_cursor cursor;
+	struct input_state input;
+
+	struct replay_keyframe *keyframes;
+	u32 keyframe_count;
+	u32 keyframe_capacity;
+
+	struct game_keyframe *level_starts;
+	u32 level_start_count;
+	u32 level_start_capacity;
 
-				for (u32 i = 0; i < worm->part_count; ++i) {
-					worm->parts[i].content = 0;
-					worm->parts[i].content_value = 0;
-					worm->parts[i].hydration = 0;
-					worm->parts[i].color = 2;
-				}
+	u32 frame_index;
+	u32 level_start_serial;
+};
 
-				
-#endif
-				
-				
-				
-				/* end_level(game); */
-			}
-			/* push_worm_tail(worm); */
-			
-		} break;
+static u32
+keep_level_start(struct replay_player *player, const struct game_state *game)
+{
+	if (!keyframe_belongs_to(&level_start_keyframe, game))
+		return ~0u;
+
+	if (!player->level_start_count || player->level_start_serial != level_start_serial) {
+		if (player->level_start_count == player->level_start_capacity) {
+			player->level_start_capacity = player->level_start_capacity ? player->level_start_capacity * 2 : 8;
+			player->level_starts = (struct game_keyframe *)realloc(player->level_starts, player->level_start_capacity * sizeof(struct game_keyframe));
+			assert(player->level_starts);
+		}
 
-		case GAME_EVENT_WATER_EATER_EAT_WATER: {
-			struct entity *water = game->entities + e->water_eater_eat_water.e2;
-			struct entity_part *droplet = water->parts + e->water_eater_eat_water.p2;
+		struct game_keyframe *level_start = player->level_starts + player->level_start_count++;
+		ZERO_STRUCT(*level_start);
+		copy_game_keyframe(level_start, &level_start_keyframe);
+		player->level_start_serial = level_start_serial;
+	}
+	return player->level_start_count - 1;
+}
 
-			droplet->disposed = true;
-		} break;
+/* NOTE(omid): One frame of playback, false once the replay is over. */
+static b32
+step_replay(struct replay_player *player, struct game_state *game)
+{
+	u32 frame = player->frame_index;
+	if (frame >= player->replay.header.frame_count)
+		return false;
 
-		case GAME_EVENT_GEM_TOUCH_SOCKET: {
-			struct entity *gem = game->entities + e->gem_touch_socket.e1;
-			struct entity *socket = game->entities + e->gem_touch_socket.e2;
-			struct entity_part *part = socket->parts + e->gem_touch_socket.p2;
+	if (frame % REPLAY_KEYFRAME_INTERVAL == 0 && frame / REPLAY_KEYFRAME_INTERVAL == player->keyframe_count) {
+		if (player->keyframe_count == player->keyframe_capacity) {
+			player->keyframe_capacity = player->keyframe_capacity ? player->keyframe_capacity * 2 : 16;
+			player->keyframes = (struct replay_keyframe *)realloc(player->keyframes, player->keyframe_capacity * sizeof(struct replay_keyframe));
+			assert(player->keyframes);
+		}
 
-			if (!part->content && part->accept == gem->parts->color) {
-				gem->disposed = true;
-				part->content = (u8)gem->parts->color;
-			}
-			
-		} break;
-			
+		/* NOTE(omid): Without memory for it, seeking plays forward from the
+		   keyframes there are. */
+		struct replay_keyframe *keyframe = player->keyframes + player->keyframe_count;
+		ZERO_STRUCT(*keyframe);
+		if (take_game_keyframe(&keyframe->game, game)) {
+			keyframe->cursor = player->cursor;
+			keyframe->input = player->input;
+			keyframe->frame_index = frame;
+			keyframe->level_start_index = keep_level_start(player, game);
+			++player->keyframe_count;
 		}
 	}
+
+	struct input_state prev_input = player->input;
+	while (read_replay_change(&player->replay, &player->cursor, frame));
+	player->input = player->cursor.input;
+	update_input_deltas(&player->input, &prev_input);
+
+	save_previous_part_positions(game);
+	step_game(game, &player->input);
+	++game->frame_index;
+	++player->frame_index;
+	return true;
 }
 
+/* NOTE(omid): Goes back to the last keyframe at or before frame_index when
+   that is behind or ahead of playback, then plays forward to it. */
 static void
-update_audio(struct game_state *game)
+seek_replay(struct replay_player *player, struct game_state *game, u32 frame_index)
 {
-	if (game->time > game->next_note_t) {
-		game->next_note_t += 4;
-		if (game->note == 40)
-			game->note = 80;
-		else if (game->note == 80)
-			game->note = 60;
+	if (frame_index > player->replay.header.frame_count)
+		frame_index = player->replay.header.frame_count;
+
+	u32 keyframe_index = frame_index / REPLAY_KEYFRAME_INTERVAL;
+	if (keyframe_index >= player->keyframe_count)
+		keyframe_index = player->keyframe_count - 1;
+
+	if (player->keyframe_count &&
+	    (frame_index < player->frame_index || keyframe_index * REPLAY_KEYFRAME_INTERVAL > player->frame_index)) {
+		const struct replay_keyframe *keyframe = player->keyframes + keyframe_index;
+		restore_game_keyframe(game, &keyframe->game);
+		player->cursor = keyframe->cursor;
+		player->input = keyframe->input;
+		player->frame_index = keyframe->frame_index;
+
+		if (keyframe->level_start_index != ~0u)
+			copy_game_keyframe(&level_start_keyframe, player->level_starts + keyframe->level_start_index);
 		else
-			game->note = 40;
+			level_start_keyframe.state.arena.base = 0;
+		++level_start_serial;
 	}
-	
-	SDL_LockAudioDevice(1);
-	game->noise_wave_count = 0;
-	u32 wave_index = 0;
-	for (u32 entity_index = 0; entity_index < game->entity_count; ++entity_index) {
-		struct entity *entity = game->entities + entity_index;
-		for (u32 part_index = 0; part_index < entity->part_count; ++part_index) {
-			struct entity_part *part = entity->parts + part_index;
-		
-			struct waveform *sine = game->sine_waves + wave_index;
-			struct waveform *saw = game->saw_waves + wave_index;
-
-			f32 v = len_v2(part->v);
-			
-			f32 sqrt_v = sqrtf(v);
-			
-			sine->amp = sqrt_v / 400.0f;
-			if (entity->z < 1)
-				sine->amp *= entity->z;
 
-			if (sine->amp > 0.25f)
-				sine->amp = 0.25f;
-			sine->freq = (u16)((roundf(v * 10 / part->size)) * (f32)game->note);
+	while (player->frame_index < frame_index && step_replay(player, game));
+}
 
-			saw->amp = sqrt_v / 400.0f; /* part->size / 1000.0f; */
-			if (entity->z < 1)
-				saw->amp *= entity->z;
+static void
+free_replay_player(struct replay_player *player)
+{
+	for (u32 i = 0; i < player->keyframe_count; ++i)
+		free_game_keyframe(&player->keyframes[i].game);
+	for (u32 i = 0; i < player->level_start_count; ++i)
+		free_game_keyframe(player->level_starts + i);
+	free(player->keyframes);
+	free(player->level_starts);
+	free(player->replay.bytes);
+	ZERO_STRUCT(*player);
+}
 
-			if (saw->amp > 0.25f)
-				saw->amp = 0.25f;
-			
-			saw->freq = (u16)((roundf(v * 100 / part->mass)) * 4 * (f32)game->note); /* (u16)(roundf(len_v2(part->v)) * 40); */
+/* NOTE(omid): --record and --replay, for the windowed and the headless loop
+   alike. */
+static const char *record_path;
+static const char *replay_path;
+static const char *snapshot_save_path;
+static const char *snapshot_load_path;
+static struct replay replay_recording;
+static struct replay_player replay_player;
+
+/* NOTE(omid): The windowed loop keeps a snapshot every SNAPSHOT_INTERVAL
+   frames, F5 takes one right away and F9 goes back to the latest. */
+static struct snapshot_ring snapshot_ring;
+
+/* NOTE(omid): Not while playing a replay, which drives the game, nor while
+   recording one, which a restored snapshot would no longer match. */
+static b32
+snapshots_enabled(void)
+{
+	return !replay_path && !record_path;
+}
 
-			if (part->audio_gen > 0) {
-				struct waveform *noise = game->noise_waves + (game->noise_wave_count++);
-				noise->amp = part->audio_gen * entity->z;
-				if (entity->z < 1)
-					noise->amp *= entity->z;
+static u64
+hash_game_state(struct game_state *game)
+{
+	u64 hash = 14695981039346656037ULL;
+	for (u32 entity_index = 0; entity_index < game->entity_count; ++entity_index) {
+		struct entity *entity = game->entities + entity_index;
+		struct part_span parts = get_part_span(game, entity);
 
-				part->audio_gen = 0;
-			}
-			
-		
-			++wave_index;
+		hash = (hash ^ entity->id) * 1099511628211ULL;
+		for (u32 part_index = 0; part_index < entity->part_count; ++part_index) {
+			u32 words[4];
+			memcpy(words, parts.p + part_index, sizeof(struct v2));
+			memcpy(words + 2, parts.v + part_index, sizeof(struct v2));
+			for (u32 i = 0; i < ARRAY_COUNT(words); ++i)
+				hash = (hash ^ words[i]) * 1099511628211ULL;
 		}
 	}
-	game->sine_wave_count = wave_index;
-	game->saw_wave_count = wave_index;
-	SDL_UnlockAudioDevice(1);
+	return hash;
 }
 
+/* NOTE(omid): Steps the simulation as fast as it goes, without a window,
+   renderer or audio device. Input comes from --replay, --input or a
+   built-in pattern. Prints timing statistics and a hash of the final
+   state, so two builds can be compared on the same script. With --seek,
+   a replay is then rewound to that frame and played to the end again,
+   which has to end in the same state. */
 static s32
-sort_entity_indices_by_z(const void *x, const void *y)
+run_headless(s32 argc, char **argv)
 {
-	struct entity *entities = global_game->entities; /* thunk; */
-	u32 i1 = *(const u32 *)x;
-	u32 i2 = *(const u32 *)y;
+	u32 frame_count = 20000;
+	b32 frame_count_given = false;
+	u32 level = 0;
+	const char *script_path = 0;
+	u64 seed = DEFAULT_RANDOM_SEED;
+	u32 max_entities = max_entity_count;
+	s64 seek_frame = -1;
+
+	for (s32 i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+			frame_count = (u32)strtoul(argv[++i], 0, 10);
+			frame_count_given = true;
+		} else if (strcmp(argv[i], "--seek") == 0 && i + 1 < argc)
+			seek_frame = (s64)strtoul(argv[++i], 0, 10);
+		else if (strcmp(argv[i], "--level") == 0 && i + 1 < argc)
+			level = (u32)strtoul(argv[++i], 0, 10);
+		else if (strcmp(argv[i], "--input") == 0 && i + 1 < argc)
+			script_path = argv[++i];
+		else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+			seed = strtoull(argv[++i], 0, 10);
+	}
 
-	if (entities[i1].z < entities[i2].z)
-		return -1;
-	return 1;
-}
+	struct input_script script;
+	ZERO_STRUCT(script);
+	if (script_path && !load_input_script(&script, script_path)) {
+		fprintf(stderr, "could not read input script %s\n", script_path);
+		return 1;
+	}
 
-static void
-make_lightning_to_point(struct game_state *game, SDL_Renderer *renderer, struct entity *e1, struct v2 to)
-{
-	struct v2 d = sub_v2(to, e1->parts->p);
+	struct replay_player *player = &replay_player;
+	if (replay_path) {
+		if (!load_replay(&player->replay, replay_path)) {
+			fprintf(stderr, "could not read replay %s\n", replay_path);
+			return 1;
+		}
+		seed = player->replay.header.seed;
+		level = player->replay.header.level;
+		max_entities = player->replay.header.max_entity_count;
+		if (!frame_count_given || frame_count > player->replay.header.frame_count)
+			frame_count = player->replay.header.frame_count;
+	}
 
-	u32 count = 0;
-	for (u32 i = 0; i < 8; ++i) {
-		f32 t = game->time * (f32)(i + 1) / 10.0f;
-		f32 r = fmodf(t, 1);
-		u8 alpha = e1->z < 1 ? (u8)(e1->z * 0x80) : 0x80;
-		struct color c = color((u8)(0xFF * (1 - r)), (u8)((1-r) * 0xFF), 0xFF, alpha);
+	if (frame_count == 0)
+		return 1;
 
-		while (r < 1) {
-			struct v2 p = add_v2(e1->parts->p, scale_v2(d, r));
-			struct v2 tangent = normalize_v2(v2(d.y, -d.x));
-			p = add_v2(p, scale_v2(tangent, sinf(r * 5 * 3.14f + t) * fmodf(t, 25)));
-					
-			fill_rect(renderer, (s32)p.x, (s32)p.y, 8, 8, c);
-			r += 0.01f + fmodf(t, 1) * 0.5f;
+	/* NOTE(omid): Replays start from a level, not from a snapshot. */
+	if (snapshot_load_path && (replay_path || record_path)) {
+		fprintf(stderr, "--load-snapshot does not go with --replay or --record\n");
+		return 1;
+	}
 
-			++count;
+	struct game_state *game = (struct game_state *)malloc(sizeof(struct game_state));
+	if (!init_game_state(game, seed, max_entities)) {
+		fprintf(stderr, "could not reserve memory for %u entities\n", max_entities);
+		return 1;
+	}
+	global_game = game;
+	if (snapshot_load_path) {
+		if (!load_game_snapshot(game, snapshot_load_path)) {
+			fprintf(stderr, "could not read snapshot %s\n", snapshot_load_path);
+			return 1;
 		}
+		level = game->current_level;
+	} else {
+		goto_level(game, level);
 	}
 
-	f32 power = (f32)count / 800;
-	if (game->game_over)
-		power = 1;
-	
-	e1->parts->audio_gen += power * 0.12f;
-}
+	/* NOTE(omid): Scripts and the built-in pattern go on from where a
+	   loaded snapshot left off. */
+	u32 first_frame = game->frame_index;
 
-static void
-update_game(struct game_state *game,
-            const struct input_state *input)
-{
-	begin_game_frame(game);
+	if (record_path)
+		begin_replay_recording(&replay_recording, seed, level, game->max_entity_count);
 
-	/* NOTE(omid): Run level scenario and timings. */
-	run_level_scenario_control(game);
-	
-	/* NOTE(omid): Apply user input. */
-	apply_user_input(game, input);
-	
-	/* NOTE(omid): Entity AI. */
-	update_entity_ai(game);
-	
-	/* NOTE(omid): Spring physics. */
-	update_spring_physics(game);
+	f64 *frame_seconds = (f64 *)malloc(frame_count * sizeof(f64));
+	if (!frame_seconds) {
+		fprintf(stderr, "could not allocate timings for %u frames\n", frame_count);
+		return 1;
+	}
+	f64 frequency = (f64)SDL_GetPerformanceFrequency();
+
+	struct input_state headless_input;
+	ZERO_STRUCT(headless_input);
+
+	u64 begin = SDL_GetPerformanceCounter();
+	for (u32 frame = 0; frame < frame_count; ++frame) {
+		u64 frame_begin = SDL_GetPerformanceCounter();
+
+		profile_begin_frame();
+		if (replay_path) {
+			step_replay(player, game);
+			headless_input = player->input;
+		} else {
+			sample_input_script(&script, first_frame + frame, &headless_input);
+			step_game(game, &headless_input);
+			++game->frame_index;
+		}
+		if (record_path)
+			record_replay_frame(&replay_recording, &headless_input);
 
-	/* NOTE(omid): Newtonian physics. */
-	update_newtonian_physics(game);
+		frame_seconds[frame] = (f64)(SDL_GetPerformanceCounter() - frame_begin) / frequency;
+	}
+	f64 seconds = (f64)(SDL_GetPerformanceCounter() - begin) / frequency;
+
+	qsort(frame_seconds, frame_count, sizeof(f64), compare_f64);
+
+	printf("frames: %u\n", frame_count);
+	printf("seconds: %.3f\n", seconds);
+	printf("frames_per_second: %.1f\n", (f64)frame_count / seconds);
+	printf("frame_ms: mean %.4f min %.4f p50 %.4f p99 %.4f max %.4f\n",
+	       seconds * 1000 / frame_count,
+	       frame_seconds[0] * 1000,
+	       frame_seconds[frame_count / 2] * 1000,
+	       frame_seconds[(u32)((f64)(frame_count - 1) * 0.99)] * 1000,
+	       frame_seconds[frame_count - 1] * 1000);
+	printf("events: seed_touch_water %u worm_eat_food %u water_eater_eat_water %u gem_touch_socket %u\n",
+	       game->event_totals[GAME_EVENT_SEED_TOUCH_WATER], game->event_totals[GAME_EVENT_WORM_EAT_FOOD],
+	       game->event_totals[GAME_EVENT_WATER_EATER_EAT_WATER], game->event_totals[GAME_EVENT_GEM_TOUCH_SOCKET]);
+	printf("sleep: awake %u asleep %u\n", game->awake_entity_count, game->asleep_entity_count);
+	printf("level: %u entities: %u state: %016llx\n",
+	       game->current_level, game->entity_count, (unsigned long long)hash_game_state(game));
+
+	s32 result = 0;
+	if (replay_path && seek_frame >= 0) {
+		u64 hash = hash_game_state(game);
+		u32 end_frame = player->frame_index;
+		u64 seek_begin = SDL_GetPerformanceCounter();
+		seek_replay(player, game, (u32)seek_frame);
+		f64 seek_seconds = (f64)(SDL_GetPerformanceCounter() - seek_begin) / frequency;
+		u32 seek_frame_index = player->frame_index;
+		seek_replay(player, game, end_frame);
+		b32 matches = hash_game_state(game) == hash;
+		printf("seek: frame %u in %.3f ms, back to frame %u state: %016llx matches %s\n",
+		       seek_frame_index, seek_seconds * 1000, player->frame_index,
+		       (unsigned long long)hash_game_state(game), matches ? "yes" : "no");
+		if (!matches)
+			result = 1;
+	}
 
-	/* NOTE(omid): Triggered events. */
-	process_triggered_events(game);
+	if (record_path && !write_replay(&replay_recording, record_path)) {
+		fprintf(stderr, "could not write replay %s\n", record_path);
+		result = 1;
+	}
 
-	/* NOTE(omid): Audio generation. */
-	update_audio(game);
+	if (snapshot_save_path) {
+		struct snapshot_ring ring;
+		ZERO_STRUCT(ring);
+		u64 hash = hash_game_state(game);
+
+		/* NOTE(omid): The first take allocates, the timed one reuses it. */
+		push_snapshot(&ring, game);
+		pop_snapshot(&ring, game);
+
+		u64 take_begin = SDL_GetPerformanceCounter();
+		push_snapshot(&ring, game);
+		u64 restore_begin = SDL_GetPerformanceCounter();
+		pop_snapshot(&ring, game);
+		u64 save_begin = SDL_GetPerformanceCounter();
+		b32 saved = save_game_snapshot(game, snapshot_save_path);
+		u64 save_end = SDL_GetPerformanceCounter();
+
+		printf("snapshot: %u arena bytes, take %.3f ms, restore %.3f ms, save %.3f ms, state matches %s\n",
+		       game->arena.used - (u32)((umm)game->frame_arena.base - (umm)game->arena.base),
+		       (f64)(restore_begin - take_begin) * 1000 / frequency,
+		       (f64)(save_begin - restore_begin) * 1000 / frequency,
+		       (f64)(save_end - save_begin) * 1000 / frequency,
+		       hash_game_state(game) == hash ? "yes" : "no");
+		if (!saved) {
+			fprintf(stderr, "could not write snapshot %s\n", snapshot_save_path);
+			result = 1;
+		}
+		free_snapshot_ring(&ring);
+	}
 
-	qsort(game->entity_index_by_z, game->entity_count, sizeof(u32), sort_entity_indices_by_z);
+	write_profile_exports();
+
+	free(frame_seconds);
+	free(script.keyframes);
+	free(replay_recording.bytes);
+	free_replay_player(player);
+	release_game_state(game);
+	free(game);
+	return result;
 }
 
 
-static void
-render_game(struct game_state *game,
-            SDL_Renderer *renderer,
-            TTF_Font *font,
-	    TTF_Font *small_font)
-{
-	SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
-	SDL_RenderClear(renderer);
-	
-	struct color white = color(0xFF, 0xFF, 0xFF, 0xFF);
+enum stress_scene {
+	STRESS_SCENE_WORM,
+	STRESS_SCENE_SQUID,
+	STRESS_SCENE_WATER,
+	STRESS_SCENE_WATER_EATER,
+	STRESS_SCENE_MIXED,
 
-	f32 elapsed_t = game->time - game->level_begin_t;
-	f32 level_progress = elapsed_t / (game->level_end_t - game->level_begin_t);
-	if (level_progress < 0)
-		level_progress = 0;
-	
-	struct v2 o = screen_center; /* v2(WINDOW_WIDTH / 2, WINDOW_HEIGHT / 2); */
-	f32 len_o = len_v2(o) + 100;
-	
-	SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND);
+	STRESS_SCENE_COUNT
+};
 
-	/* NOTE(omid): Render tunnel. */
-	{
-		f32 fade_progress = 1.0f;
-		if (game->time < game->level_begin_t) {
-			f32 tunnel_d = game->level_begin_t - game->tunnel_begin_t;
-			fade_progress = (game->time - game->tunnel_begin_t) / tunnel_d;
-		}
-		
-		SDL_RenderSetScale(renderer, fade_progress, fade_progress);
-		
-		f32 initial_r = len_o * level_progress * level_progress;
-		f32 r = initial_r;
-		f32 a = 0.25f * game->time;
-		while (r < game->tunnel_size) {
-			struct v2 p = add_v2(o, v2(r * cosf(a), r * sinf(a)));
+static const char *stress_scene_names[STRESS_SCENE_COUNT] = {
+	"worm",
+	"squid",
+	"water",
+	"water_eater",
+	"mixed",
+};
 
-			u8 max_alpha = (u8)(0xE0 * sqrtf(r / len_o));
-			u8 alpha = max_alpha;
-			if (game->time < game->level_begin_t)
-				alpha = (u8)(max_alpha * fade_progress);
+/* NOTE(omid): part_count is a target, water eaters always have the same
+   shape. The benchmarks reject anything past MAX_ENTITY_PART_COUNT. */
+static struct entity *
+push_stress_entity(struct game_state *game, enum stress_scene scene, u32 part_count)
+{
+	if (part_count < 2)
+		part_count = 2;
+	if (part_count > MAX_ENTITY_PART_COUNT)
+		part_count = MAX_ENTITY_PART_COUNT;
+
+	struct entity *entity = push_entity(game);
+	switch (scene) {
+	case STRESS_SCENE_WORM:
+		init_worm(game, entity);
+		while (entity->part_count < part_count)
+			push_worm_tail(game, entity);
+		break;
 
-			#if 0
-			special_fill_cell_(renderer, (u8)(game->current_level + 1), alpha, (s32)p.x, (s32)p.y, (s32)(r / 5.0f), (s32)(r / 5.0f));
-			#else
-			struct v2 sp = add_v2(p, scale_v2(screen_center, (1 - fade_progress) / fade_progress));
-			u8 c = (u8)(game->current_level + 9) % ARRAY_COUNT(BASE_COLORS);
-			special_fill_cell_(renderer, c, alpha, (s32)sp.x, (s32)sp.y, (s32)(r / 5.0f), (s32)(r / 5.0f));
-			#endif
+	case STRESS_SCENE_SQUID:
+		init_squid(game, entity, (u16)(part_count - 1));
+		break;
 
-			
-			/* r += 0.5f; */
-			r += 0.25f + sqrtf(r - initial_r) * 0.01f;
-			a += sqrtf(r - initial_r) * 0.1f;
-		}
+	case STRESS_SCENE_WATER:
+		init_water(game, entity, (u16)(part_count - 1));
+		break;
 
-		SDL_RenderSetScale(renderer, 1, 1);
+	default:
+		init_water_eater(game, entity);
+		break;
 	}
 
-	/* NOTE(omid): Render shadows. */
-	for (u32 entity_index = 0; entity_index < game->entity_count; ++entity_index) {
-		const struct entity *entity = game->entities + entity_index;
-		for (u32 part_index = 0; part_index < entity->part_count; ++part_index) {
-			const struct entity_part *part = entity->parts + part_index;
-			const struct entity_part *parent = entity->parts + part->parent_index;
+	/* NOTE(omid): In the play layer, neither surfacing nor sinking. */
+	entity->z = 2;
+	entity->accum_z = 1;
 
-			struct v2 ep = parent->p;
-			struct v2 pp = part->p;
+	struct part_span parts = get_part_span(game, entity);
+	for (u32 part_index = 0; part_index < entity->part_count; ++part_index) {
+		parts.p[part_index] = v2(random_f32(&game->random) * WINDOW_WIDTH, random_f32(&game->random) * WINDOW_HEIGHT);
+		parts.v[part_index] = v2(random_f32(&game->random) * 20 - 10, random_f32(&game->random) * 20 - 10);
+	}
 
-			struct v2 from_c = sub_v2(ep, o);
-			f32 dist_to_center = len_v2(from_c);
-			f32 scale = 2 * dist_to_center / len_o;
+	return entity;
+}
 
-			struct v2 offset = scale_v2(normalize_v2(from_c), 30);
-			struct v2 shadow = add_v2(pp, offset);
+/* NOTE(omid): A level that never starts, ends or spawns, holding only the
+   synthetic entities. The entity storage starts small and grows to fit. */
+static bool
+init_stress_scene(struct game_state *game, enum stress_scene scene, u32 entity_count, u32 part_count)
+{
+	if (!init_game_state(game, DEFAULT_RANDOM_SEED, entity_count))
+		return false;
+	game->tunnel_begin_t = -1;
+	game->level_begin_t = 0;
+	game->level_end_t = 1e9f;
+	game->tunnel_size = WINDOW_WIDTH;
+
+	for (u32 i = 0; i < entity_count; ++i) {
+		enum stress_scene kind = scene;
+		if (scene == STRESS_SCENE_MIXED)
+			kind = (enum stress_scene)(i % STRESS_SCENE_MIXED);
+		push_stress_entity(game, kind, part_count);
+	}
+	return true;
+}
 
-			u8 max_alpha = (u8)(0xE0 * sqrtf(dist_to_center / len_o));
-			u8 alpha = max_alpha;
-			if (game->time < game->level_begin_t) {
-				f32 tunnel_d = game->level_begin_t - game->tunnel_begin_t;
-				f32 fade_progress = (game->time - game->tunnel_begin_t) / tunnel_d;
-				alpha = (u8)(max_alpha * fade_progress);
+/* NOTE(omid): Runs synthetic scenes headless and prints, per update_game
+   stage, nanoseconds per live part per frame as CSV. Entities can be
+   eaten or dissolve along the way, so parts is the average live part
+   count over the run. */
+static s32
+run_stress_benchmark(s32 argc, char **argv)
+{
+	static const u32 default_entity_counts[] = { 16, 32, 64, 128 };
+
+	u32 frame_count = 600;
+	u32 part_count = 16;
+	u32 entity_count = 0;
+	s32 only_scene = -1;
+
+	for (s32 i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc)
+			frame_count = (u32)strtoul(argv[++i], 0, 10);
+		else if (strcmp(argv[i], "--parts") == 0 && i + 1 < argc) {
+			part_count = (u32)strtoul(argv[++i], 0, 10);
+			if (part_count > MAX_ENTITY_PART_COUNT) {
+				fprintf(stderr, "--parts is at most %u\n", MAX_ENTITY_PART_COUNT);
+				return 1;
+			}
+		}
+		else if (strcmp(argv[i], "--entities") == 0 && i + 1 < argc)
+			entity_count = (u32)strtoul(argv[++i], 0, 10);
+		else if (strcmp(argv[i], "--scene") == 0 && i + 1 < argc) {
+			++i;
+			for (u32 scene = 0; scene < STRESS_SCENE_COUNT; ++scene)
+				if (strcmp(argv[i], stress_scene_names[scene]) == 0)
+					only_scene = (s32)scene;
+			if (only_scene < 0) {
+				fprintf(stderr, "unknown scene %s\n", argv[i]);
+				return 1;
 			}
-		
-			struct color c = color(0x00, 0x00, 0x00, alpha);
-			render_rect(renderer, c, (s32)shadow.x, (s32)shadow.y, (s32)(part->render_size * scale), (s32)(part->render_size * scale), false);
 		}
 	}
 
-	/* NOTE(omid): Render entities. */
-	/* for (u32 entity_index = 0; entity_index < game->entity_count; ++entity_index) { */
-	for (u32 sort_list_index = 0; sort_list_index < game->entity_count; ++sort_list_index) {
-		u32 entity_index = game->entity_index_by_z[sort_list_index];
-		const struct entity *entity = game->entities + entity_index;
-		
-		for (u32 part_index = 0; part_index < entity->part_count; ++part_index) {
-			const struct entity_part *part = entity->parts + (entity->part_count - part_index - 1);
-			
-
-			
-			struct v2 part_p = part->p;
-#if 0
-			const struct entity_part *parent = entity->parts + part->parent_index;
-			struct v2 parent_p = parent->p;
-			struct v2 d = sub_v2(part_p, parent_p);       
-			u32 chain_count = (u32)(part->length / 20);
-#endif
+	if (entity_count > MAX_ENTITY_COUNT_LIMIT)
+		entity_count = MAX_ENTITY_COUNT_LIMIT;
+	if (frame_count == 0)
+		return 1;
 
-			u16 depth = compute_entity_part_depth(entity, part);
-			f32 z = entity->z - depth * 0.02f;
-			if (z < 0)
-				z = 0;
-			
-			if (z > 1) {
-#if 0
-				for (u32 chain_index = 1; chain_index < chain_count; ++chain_index) {
-					f32 r = (f32)chain_index / (f32)chain_count;
-					struct v2 p = add_v2(parent_p, scale_v2(d, r));
-					fill_cell(renderer, 3, (s32)p.x, (s32)p.y, 12, 12);
-				}
-#endif
+	struct game_state *game = (struct game_state *)malloc(sizeof(struct game_state));
+	f64 ns_per_tick = 1000000000.0 / (f64)SDL_GetPerformanceFrequency();
 
-				u8 alpha = part->max_alpha ? part->max_alpha : 0xFF;
-				
-				fill_cell_(renderer, (u8)part->color, alpha, (s32)part_p.x, (s32)part_p.y, (s32)part->render_size, (s32)part->render_size);
+	struct input_state stress_input;
+	ZERO_STRUCT(stress_input);
 
-				if (part->content) {
-					fill_cell_(renderer, part->content, alpha, (s32)part_p.x, (s32)part_p.y, 10, 10);
-					draw_cell(renderer, 0, (s32)part_p.x, (s32)part_p.y, 10, 10);
-				}			
+	printf("scene,entities,parts,frames,stage,ns_per_part_frame,ms_per_frame\n");
 
-				if (part->accept) {
-					fill_cell_(renderer, part->accept, 200, (s32)part_p.x, (s32)(part_p.y - part->render_size / 2.0f), (s32)part->render_size, 10);
+	for (u32 scene = 0; scene < STRESS_SCENE_COUNT; ++scene) {
+		if (only_scene >= 0 && scene != (u32)only_scene)
+			continue;
 
-				}
-				
-			} else {
-				u8 max_alpha = (u8)(0xE0);
-				u8 alpha = (u8)(max_alpha * z);
+		for (u32 count_index = 0; count_index < ARRAY_COUNT(default_entity_counts); ++count_index) {
+			u32 scene_entity_count = entity_count ? entity_count : default_entity_counts[count_index];
+			if (entity_count && count_index > 0)
+				break;
 
-				SDL_RenderSetScale(renderer, z, z);
-				s32 size = (s32)(part->render_size);
-				special_fill_cell_(renderer, (u8)(part->color), alpha, (s32)(part_p.x / z), (s32)(part_p.y / z), size, size);
-				SDL_RenderSetScale(renderer, 1, 1);
+			if (!init_stress_scene(game, (enum stress_scene)scene, scene_entity_count, part_count)) {
+				fprintf(stderr, "could not reserve memory for %u entities\n", scene_entity_count);
+				return 1;
 			}
-		}
-	}
+			global_game = game;
 
+			u64 stage_ticks[PROFILE_SORT + 1] = { 0 };
+			u64 part_frames = 0;
 
-	u32 sockets[MAX_ENTITY_COUNT] = { 0 };
-	u32 socket_count = 0;
-	for (u32 entity_index = 0; entity_index < game->entity_count; ++entity_index) {
-		const struct entity *entity = game->entities + entity_index;
-		if (entity->type & ENTITY_SOCKET)
-			sockets[socket_count++] = entity_index;
-	}
+			for (u32 frame = 0; frame < frame_count; ++frame) {
+				for (u32 entity_index = 0; entity_index < game->entity_count; ++entity_index)
+					part_frames += game->entities[entity_index].part_count;
 
-	for (u32 socket_index = 0; socket_index < socket_count; ++socket_index) {
-		 struct entity *e1 = game->entities + sockets[socket_index];
-		 if (!e1->parts->content)
-			continue;
+				profile_begin_frame();
+				step_game(game, &stress_input);
+				++game->frame_index;
 
-		make_lightning_to_point(game, renderer, e1, screen_center);
-		
-		for (u32 other_socket_index = 0; other_socket_index < socket_count; ++other_socket_index) {
-			if (other_socket_index == socket_index)
-				continue;
-			
-			 struct entity *e2 = game->entities + sockets[other_socket_index];
+				const struct profile_frame *profile = profiler.frames + ((profiler.frame_count - 1) % PROFILE_FRAME_COUNT);
+				for (u32 stage = 0; stage <= PROFILE_SORT; ++stage)
+					stage_ticks[stage] += profile->stages[stage].duration;
+			}
 
-			if (!e2->parts->content)
-				continue;
+			if (!part_frames)
+				part_frames = 1;
+
+			u64 total_ticks = 0;
+			for (u32 stage = 0; stage <= PROFILE_SORT; ++stage)
+				total_ticks += stage_ticks[stage];
+
+			f64 parts = (f64)part_frames / frame_count;
+			for (u32 stage = 0; stage <= PROFILE_SORT + 1; ++stage) {
+				u64 ticks = stage <= PROFILE_SORT ? stage_ticks[stage] : total_ticks;
+				printf("%s,%u,%.1f,%u,%s,%.2f,%.4f\n", stress_scene_names[scene], scene_entity_count, parts, frame_count,
+				       stage <= PROFILE_SORT ? profile_stage_names[stage] : "total",
+				       (f64)ticks * ns_per_tick / (f64)part_frames,
+				       (f64)ticks * ns_per_tick / 1000000.0 / frame_count);
+			}
 
-			make_lightning_to_point(game, renderer, e1, e2->parts->p);
+			release_game_state(game);
 		}
 	}
-	
-	
-	SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_NONE);
 
-	/* NOTE(omid): Render on-screen text. */
-	
-	/* draw_string(renderer, font, "LD48 - InvertedMinds", 5, 5, TEXT_ALIGN_LEFT, white); */
-#if 0
-	draw_string_f(renderer, small_font, 5, 5, TEXT_ALIGN_LEFT, white, "T: %f (%uX)", (f64)game->time, game->time_speed_up + 1);
-#endif
-	draw_string_f(renderer, small_font, WINDOW_WIDTH, WINDOW_HEIGHT - SMALL_FONT_SIZE, TEXT_ALIGN_RIGHT, white, "A game by Omid Ghavami Zeitooni");
+	write_profile_exports();
 
-	/* draw_string_f(renderer, font, WINDOW_WIDTH / 2, 0, TEXT_ALIGN_CENTER, white, "SCORE: %u", game->score); */
-	
-	if (game->time < game->tunnel_begin_t) {
-		f32 fade_in_d = 1;
-		f32 fade_in_start_t = game->last_level_end_t;
-		f32 fade_in_end_t = fade_in_start_t + fade_in_d;
+	free(game);
+	return 0;
+}
 
-		f32 fade_out_d = 1;
-		f32 fade_out_start_t = game->tunnel_begin_t - fade_out_d;
-		f32 fade_out_end_t = game->tunnel_begin_t;
+/* NOTE(omid): Runs one stress scene on 1, 2, 4... threads, up to the --threads
+   count, and prints the time the physics stages take and their speedup over
+   one thread as CSV. Every thread count has to end in the same state. */
+static s32
+run_thread_benchmark(s32 argc, char **argv)
+{
+	u32 frame_count = 200;
+	u32 part_count = 16;
+	u32 entity_count = 256;
+	enum stress_scene scene = STRESS_SCENE_WATER;
+
+	for (s32 i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc)
+			frame_count = (u32)strtoul(argv[++i], 0, 10);
+		else if (strcmp(argv[i], "--parts") == 0 && i + 1 < argc) {
+			part_count = (u32)strtoul(argv[++i], 0, 10);
+			if (part_count > MAX_ENTITY_PART_COUNT) {
+				fprintf(stderr, "--parts is at most %u\n", MAX_ENTITY_PART_COUNT);
+				return 1;
+			}
+		}
+		else if (strcmp(argv[i], "--entities") == 0 && i + 1 < argc)
+			entity_count = (u32)strtoul(argv[++i], 0, 10);
+		else if (strcmp(argv[i], "--scene") == 0 && i + 1 < argc) {
+			++i;
+			s32 found = -1;
+			for (u32 scene_index = 0; scene_index < STRESS_SCENE_COUNT; ++scene_index)
+				if (strcmp(argv[i], stress_scene_names[scene_index]) == 0)
+					found = (s32)scene_index;
+			if (found < 0) {
+				fprintf(stderr, "unknown scene %s\n", argv[i]);
+				return 1;
+			}
+			scene = (enum stress_scene)found;
+		}
+	}
 
-		f32 alpha = 0xFF;
-		if (game->time >= fade_in_start_t && game->time <= fade_in_end_t)
-			alpha = (0xFF * (game->time - game->last_level_end_t) / fade_in_d);
-		if (game->time >= fade_out_start_t && game->time <= fade_out_end_t)
-			alpha = (0xFF * (1 - (game->time - fade_out_start_t) / fade_out_d));
+	if (entity_count > MAX_ENTITY_COUNT_LIMIT)
+		entity_count = MAX_ENTITY_COUNT_LIMIT;
+	if (frame_count == 0 || entity_count == 0)
+		return 1;
 
-		if (alpha > 0xFF)
-			alpha = 0xFF;
-		else if (alpha < 0)
-			alpha = 0;
+	u32 max_threads = thread_count ? thread_count : default_thread_count();
+	if (max_threads > MAX_WORKER_COUNT)
+		max_threads = MAX_WORKER_COUNT;
 
-		if (alpha > 1) {
-			struct color c = color(0xFF, 0xFF, 0xFF, (u8)alpha);
+	struct game_state *game = (struct game_state *)malloc(sizeof(struct game_state));
+	f64 ms_per_tick = 1000.0 / (f64)SDL_GetPerformanceFrequency();
 
-			if (game->game_over) {
-				draw_string_f(renderer, font, WINDOW_WIDTH / 2, WINDOW_HEIGHT / 2 - 9, TEXT_ALIGN_CENTER, c, "CONGRATULATIONS, YOU WON!", game->current_level + 1);
-			} else {
-				draw_string_f(renderer, font, WINDOW_WIDTH / 2, WINDOW_HEIGHT / 2 - 9, TEXT_ALIGN_CENTER, c, "LEVEL %u", game->current_level + 1);
+	struct input_state stress_input;
+	ZERO_STRUCT(stress_input);
 
-				if (game->level_instr) {
-					draw_string_f(renderer, small_font, WINDOW_WIDTH / 2, WINDOW_HEIGHT / 2 -9 + FONT_SIZE, TEXT_ALIGN_CENTER, c, "%s", game->level_instr);
-				}
+	printf("scene,entities,frames,threads,springs_ms,newtonian_ms,speedup,state,matches\n");
 
-				draw_string_f(renderer, font, WINDOW_WIDTH / 2, WINDOW_HEIGHT - FONT_SIZE, TEXT_ALIGN_CENTER, c, "PRESS 'SPACE' TO SKIP");
-			}
-		}
-	}
+	s32 result = 0;
+	u64 single_thread_hash = 0;
+	f64 single_thread_ms = 0;
+	for (u32 count = 1;; count *= 2) {
+		if (count > max_threads)
+			count = max_threads;
+		shutdown_job_pool(&job_pool);
+		init_job_pool(&job_pool, count);
 
-	if (game->game_over) {
-		draw_string_f(renderer, font, WINDOW_WIDTH / 2, WINDOW_HEIGHT / 2 - 9, TEXT_ALIGN_CENTER, white, "CONGRATULATIONS, YOU WON!", game->current_level + 1);
-	} else if (check_win_condition(game)) {
-		draw_string_f(renderer, font, WINDOW_WIDTH / 2, WINDOW_HEIGHT / 2 - 9, TEXT_ALIGN_CENTER, white, "COMPLETED", game->current_level + 1);
+		if (!init_stress_scene(game, scene, entity_count, part_count)) {
+			fprintf(stderr, "could not reserve memory for %u entities\n", entity_count);
+			result = 1;
+			break;
+		}
+		global_game = game;
+
+		u64 spring_ticks = 0;
+		u64 newtonian_ticks = 0;
+		for (u32 frame = 0; frame < frame_count; ++frame) {
+			profile_begin_frame();
+			step_game(game, &stress_input);
+			++game->frame_index;
+
+			const struct profile_frame *profile = profiler.frames + ((profiler.frame_count - 1) % PROFILE_FRAME_COUNT);
+			spring_ticks += profile->stages[PROFILE_SPRINGS].duration;
+			newtonian_ticks += profile->stages[PROFILE_NEWTONIAN].duration;
+		}
 
-		draw_string_f(renderer, font, WINDOW_WIDTH / 2, WINDOW_HEIGHT - FONT_SIZE, TEXT_ALIGN_CENTER, white, "PRESS 'SPACE' TO SKIP");
-	}
+		u64 hash = hash_game_state(game);
+		f64 springs_ms = (f64)spring_ticks * ms_per_tick / frame_count;
+		f64 newtonian_ms = (f64)newtonian_ticks * ms_per_tick / frame_count;
+		if (count == 1) {
+			single_thread_hash = hash;
+			single_thread_ms = springs_ms + newtonian_ms;
+		}
+		if (hash != single_thread_hash)
+			result = 1;
 
+		printf("%s,%u,%u,%u,%.4f,%.4f,%.2f,%016llx,%s\n", stress_scene_names[scene], entity_count, frame_count, job_pool.worker_count,
+		       springs_ms, newtonian_ms, single_thread_ms / (springs_ms + newtonian_ms),
+		       (unsigned long long)hash, hash == single_thread_hash ? "yes" : "no");
 
-#if 0
-	s32 y = 5 + SMALL_FONT_SIZE;
-	
-	for (u32 entity_index = 0; entity_index < game->entity_count; ++entity_index) {
-		const struct entity *entity = game->entities + entity_index;
-		draw_string_f(renderer, small_font, 5, y, TEXT_ALIGN_LEFT, white, "E (%u): HAS TARGET? %s [(%f, %f) * %f]", entity_index, entity->has_target ? "YES" : "NO", (f64)entity->target.x, (f64)entity->target.y, (f64)entity->pull_of_target);
-		y += SMALL_FONT_SIZE;
-		
-		for (u32 part_index = 0; part_index < entity->part_count; ++part_index) {
-			const struct entity_part *part = entity->parts + (entity->part_count - part_index - 1);
-			draw_string_f(renderer, small_font, 25, y, TEXT_ALIGN_LEFT, white, "E (%u, %u): (%f, %f)", entity_index, part_index, (f64)part->p.x, (f64)part->p.y);
-			y += SMALL_FONT_SIZE;
-		}
+		release_game_state(game);
+		if (count == max_threads)
+			break;
 	}
-#endif
-	
-	
-	SDL_RenderPresent(renderer);
+
+	free(game);
+	return result;
 }
 
-static void
-mix_audio(void *unused, Uint8 *stream, int len)
+/* NOTE(omid): Records the narrowphase calls of the stress scenes and of
+   the first levels with a single worker, then times the swept box kernel
+   against test_collision_against_box_reference on them and prints, as
+   CSV, the nanoseconds per test of both and where they disagree. */
+static s32
+run_narrowphase_benchmark(void)
 {
-	struct game_state *game = unused;
+	enum { MAX_TEST_COUNT = 2 * 1024 * 1024 };
 
-	u32 length = (u32)(len / 4);
-	f32 *s = (f32 *)(void *)stream;
+	struct narrowphase_recording *recording = &narrowphase_recording;
+	recording->tests = (struct narrowphase_test *)malloc(MAX_TEST_COUNT * sizeof(struct narrowphase_test));
+	recording->count = 0;
+	recording->capacity = MAX_TEST_COUNT / 2;
 
-	for (u32 i = 0; i < length; ++i) {
-		f32 mix = 0;
-		for (u32 wave_index = 0; wave_index < game->sine_wave_count; ++wave_index) {
-			struct waveform *wave = game->sine_waves + wave_index;
-			f32 w = sinf(wave->t * 2.0f * 3.14f / AUDIO_FREQ) * wave->amp;
-			mix += w;
-			wave->t += wave->freq;
-		}
+	shutdown_job_pool(&job_pool);
+	init_job_pool(&job_pool, 1);
 
-		for (u32 wave_index = 0; wave_index < game->saw_wave_count; ++wave_index) {
-			struct waveform *wave = game->saw_waves + wave_index;
-			f32 w = 0;
-			if (!IS_F32_ZERO(wave->amp))
-				w = fmodf(wave->amp * wave->t / AUDIO_FREQ, wave->amp) - wave->amp / 2;
-			
-			mix += w;
-			wave->t += wave->freq;
+	struct game_state *game = (struct game_state *)malloc(sizeof(struct game_state));
+	struct input_state bench_input;
+	ZERO_STRUCT(bench_input);
+
+	for (u32 scene = 0; scene < STRESS_SCENE_COUNT; ++scene) {
+		if (!init_stress_scene(game, (enum stress_scene)scene, 128, 16))
+			continue;
+		global_game = game;
+		for (u32 frame = 0; frame < 300; ++frame) {
+			profile_begin_frame();
+			step_game(game, &bench_input);
+			++game->frame_index;
 		}
+		release_game_state(game);
+	}
 
-		for (u32 wave_index = 0; wave_index < game->noise_wave_count; ++wave_index) {
-			struct waveform *wave = game->noise_waves + wave_index;
-			f32 w = wave->amp * random_f32();
-			
-			mix += w;
-			wave->t += wave->freq;
+	/* NOTE(omid): The levels put parts against the walls and each other far
+	   more than the scenes, where they mostly fly past. */
+	struct input_script no_script;
+	ZERO_STRUCT(no_script);
+	recording->capacity = MAX_TEST_COUNT;
+	for (u32 level = 0; level < 4; ++level) {
+		if (!init_game_state(game, DEFAULT_RANDOM_SEED, max_entity_count))
+			continue;
+		global_game = game;
+		goto_level(game, level);
+		ZERO_STRUCT(bench_input);
+		for (u32 frame = 0; frame < 3000; ++frame) {
+			profile_begin_frame();
+			sample_input_script(&no_script, frame, &bench_input);
+			step_game(game, &bench_input);
+			++game->frame_index;
 		}
+		release_game_state(game);
+	}
+	free(game);
 
-		
-		if (mix < -1.0f)
-			mix = -1.0f;
-		else if (mix > 1.0f)
-			mix = 1.0f;
+	u32 test_count = recording->count;
+	recording->capacity = 0;
+	if (!test_count) {
+		free(recording->tests);
+		return 1;
+	}
 
-		s[i] = mix;
+	f64 ns_per_tick = 1000000000.0 / (f64)SDL_GetPerformanceFrequency();
+	u32 repeat_count = 8;
+	f32 checksum = 0;
+
+	u64 begin = SDL_GetPerformanceCounter();
+	for (u32 repeat = 0; repeat < repeat_count; ++repeat) {
+		for (u32 i = 0; i < test_count; ++i) {
+			const struct narrowphase_test *test = recording->tests + i;
+			struct v2 new_p = test->new_p;
+			struct v2 new_v = test->v;
+			if (test_collision_against_box_reference(test->obstacle_p, (u16)test->obstacle_size, (u16)test->size, test->p, &new_p, &new_v))
+				checksum += new_p.x + new_p.y;
+		}
+	}
+	u64 reference_ticks = SDL_GetPerformanceCounter() - begin;
+
+	begin = SDL_GetPerformanceCounter();
+	for (u32 repeat = 0; repeat < repeat_count; ++repeat) {
+		for (u32 i = 0; i < test_count; ++i) {
+			const struct narrowphase_test *test = recording->tests + i;
+			struct v2 new_p = test->new_p;
+			if (collide_part_with_box(test->obstacle_p, test->obstacle_size, test->size, test->p, &new_p))
+				checksum += new_p.x + new_p.y;
+		}
+	}
+	u64 swept_ticks = SDL_GetPerformanceCounter() - begin;
+
+	u32 reference_hit_count = 0;
+	u32 swept_hit_count = 0;
+	u32 hit_mismatch_count = 0;
+	u32 far_count = 0;
+	f32 max_error = 0;
+	for (u32 i = 0; i < test_count; ++i) {
+		const struct narrowphase_test *test = recording->tests + i;
+		struct v2 reference_p = test->new_p;
+		struct v2 reference_v = test->v;
+		struct v2 swept_p = test->new_p;
+		bool reference_hit = test_collision_against_box_reference(test->obstacle_p, (u16)test->obstacle_size, (u16)test->size, test->p, &reference_p, &reference_v);
+		bool swept_hit = collide_part_with_box(test->obstacle_p, test->obstacle_size, test->size, test->p, &swept_p);
+
+		reference_hit_count += reference_hit;
+		swept_hit_count += swept_hit;
+		if (reference_hit != swept_hit) {
+			++hit_mismatch_count;
+			continue;
+		}
+
+		f32 error = len_v2(sub_v2(reference_p, swept_p));
+		if (error > max_error)
+			max_error = error;
+		if (error > 0.01f)
+			++far_count;
 	}
+
+	f64 tests = (f64)test_count * repeat_count;
+	printf("kernel,tests,hits,ns_per_test,speedup,hit_mismatches,max_error,over_0.01\n");
+	printf("reference,%u,%u,%.3f,1.00,0,0,0\n", test_count, reference_hit_count, (f64)reference_ticks * ns_per_tick / tests);
+	printf("swept_box,%u,%u,%.3f,%.2f,%u,%.4f,%u\n", test_count, swept_hit_count, (f64)swept_ticks * ns_per_tick / tests,
+	       (f64)reference_ticks / (f64)swept_ticks, hit_mismatch_count, (f64)max_error, far_count);
+	fprintf(stderr, "checksum: %f\n", (f64)checksum);
+
+	free(recording->tests);
+	ZERO_STRUCT(*recording);
+	return 0;
 }
 
 
@@ -2507,10 +7490,18 @@ static SDL_AudioDeviceID audio;
 static const char *font_name;
 static TTF_Font *font;
 static TTF_Font *small_font;
+static struct glyph_atlas font_atlas;
+static struct glyph_atlas small_font_atlas;
 
 
 static struct input_state input;
+static struct input_state last_step_input;
 static bool quit;
+static bool vsync;
+
+/* NOTE(omid): Real time not yet simulated, in seconds. */
+static f64 step_accumulator;
+static u64 last_frame_counter;
 
 static s32 window_w, window_h, renderer_w, renderer_h;
 static f32 default_scale = 1;
@@ -2521,96 +7512,205 @@ update_and_render()
 {
 	struct game_state *game = global_game;
 
-	for (u32 i = 0; i < (game->time_speed_up + 1); ++i) {
-		SDL_Event e;
-		while (SDL_PollEvent(&e) != 0)
-			if (e.type == SDL_QUIT)
-				quit = true;
-
-		s32 key_count;
-		const u8 *key_states = SDL_GetKeyboardState(&key_count);
+	profile_begin_frame();
 
-		if (key_states[SDL_SCANCODE_ESCAPE])
+	SDL_Event e;
+	while (SDL_PollEvent(&e) != 0) {
+		if (e.type == SDL_QUIT)
 			quit = true;
-        
-		struct input_state prev_input = input;
-        
-		input.left = key_states[SDL_SCANCODE_LEFT];
-		input.right = key_states[SDL_SCANCODE_RIGHT];
-		input.up = key_states[SDL_SCANCODE_UP];
-		input.down = key_states[SDL_SCANCODE_DOWN];
-		input.start = key_states[SDL_SCANCODE_SPACE];
 
-		input.speed_up = key_states[SDL_SCANCODE_PAGEUP];
-		input.speed_down = key_states[SDL_SCANCODE_PAGEDOWN];
+		/* NOTE(omid): F2 toggles the render stats. */
+		if (e.type == SDL_KEYDOWN && !e.key.repeat && e.key.keysym.scancode == SDL_SCANCODE_F2)
+			show_render_stats = !show_render_stats;
+
+		/* NOTE(omid): F3 toggles the profiler. */
+		if (e.type == SDL_KEYDOWN && !e.key.repeat && e.key.keysym.scancode == SDL_SCANCODE_F3)
+			show_profiler = !show_profiler;
+
+		if (snapshots_enabled() && e.type == SDL_KEYDOWN && !e.key.repeat && e.key.keysym.scancode == SDL_SCANCODE_F5)
+			push_snapshot(&snapshot_ring, game);
+
+		if (snapshots_enabled() && e.type == SDL_KEYDOWN && !e.key.repeat && e.key.keysym.scancode == SDL_SCANCODE_F9) {
+			if (pop_snapshot(&snapshot_ring, game))
+				step_accumulator = 0;
+		}
+
+		/* NOTE(omid): Left and right seek a replay back and forth. */
+		if (replay_path && e.type == SDL_KEYDOWN &&
+		    (e.key.keysym.scancode == SDL_SCANCODE_LEFT || e.key.keysym.scancode == SDL_SCANCODE_RIGHT)) {
+			s64 frame = (s64)replay_player.frame_index + (e.key.keysym.scancode == SDL_SCANCODE_LEFT ? -REPLAY_SEEK_FRAMES : REPLAY_SEEK_FRAMES);
+			seek_replay(&replay_player, game, frame > 0 ? (u32)frame : 0);
+		}
+	}
+
+	s32 key_count;
+	const u8 *key_states = SDL_GetKeyboardState(&key_count);
+
+	if (key_states[SDL_SCANCODE_ESCAPE])
+		quit = true;
+
+	/* NOTE(omid): A replay plays as many steps as fit in a display frame
+	   and is drawn as it is after the last one. */
+	if (replay_path) {
+		u64 playback_begin = SDL_GetPerformanceCounter();
+		u64 playback_ticks = SDL_GetPerformanceFrequency() / 60;
+		b32 playing = false;
+		while (SDL_GetPerformanceCounter() - playback_begin < playback_ticks && step_replay(&replay_player, game))
+			playing = true;
 
-		input.dleft = (s8)(input.left - prev_input.left);
-		input.dright = (s8)(input.right - prev_input.right);
-		input.dup = (s8)(input.up - prev_input.up);
-		input.ddown = (s8)(input.down - prev_input.down);
-		input.dstart = (s8)(input.start - prev_input.start);
+		render_game(game, renderer, &font_atlas, &small_font_atlas, 1.0f);
 
-		input.dspeed_up = (s8)(input.speed_up - prev_input.speed_up);
-		input.dspeed_down = (s8)(input.speed_down - prev_input.speed_down);
+#if !defined(__EMSCRIPTEN__)
+		if (!playing && !vsync)
+			SDL_Delay(16);
+#endif
+		return;
+	}
+
+	input.left = key_states[SDL_SCANCODE_LEFT];
+	input.right = key_states[SDL_SCANCODE_RIGHT];
+	input.up = key_states[SDL_SCANCODE_UP];
+	input.down = key_states[SDL_SCANCODE_DOWN];
+	input.start = key_states[SDL_SCANCODE_SPACE];
+
+	input.speed_up = key_states[SDL_SCANCODE_PAGEUP];
+	input.speed_down = key_states[SDL_SCANCODE_PAGEDOWN];
+
+	u32 mouse_buttons = SDL_GetMouseState(&input.mouse_x, &input.mouse_y);
+	input.mouse_left = (mouse_buttons & SDL_BUTTON(SDL_BUTTON_LEFT)) ? 1 : 0;
+
+	f64 frequency = (f64)SDL_GetPerformanceFrequency();
+	u64 frame_counter = SDL_GetPerformanceCounter();
+	f64 elapsed = SIMULATION_DT;
+	if (last_frame_counter)
+		elapsed = (f64)(frame_counter - last_frame_counter) / frequency;
+	last_frame_counter = frame_counter;
+	if (elapsed > MAX_FRAME_SECONDS)
+		elapsed = MAX_FRAME_SECONDS;
+	step_accumulator += elapsed;
+
+	/* NOTE(omid): Input is sampled once per display frame, so only the first
+	   step after a change sees the press or release. */
+	while (step_accumulator >= SIMULATION_DT) {
+		step_accumulator -= SIMULATION_DT;
+
+		for (u32 i = 0; i < (game->time_speed_up + 1); ++i) {
+			struct input_state step_input = input;
+			update_input_deltas(&step_input, &last_step_input);
+			last_step_input = input;
+			if (record_path)
+				record_replay_frame(&replay_recording, &input);
 
 #if 0
-		if (input.dspeed_up > 0)
-			++game->time_speed_up;
-		else if (input.dspeed_down > 0 && game->time_speed_up)
-			--game->time_speed_up;
+			if (step_input.dspeed_up > 0)
+				++game->time_speed_up;
+			else if (step_input.dspeed_down > 0 && game->time_speed_up)
+				--game->time_speed_up;
 #endif
 #if 0
-		if (input.dspeed_up > 0)
-			goto_level(game, game->current_level + 1);
-		else if (input.dspeed_down > 0)
-			goto_level(game, game->current_level - 1);
+			if (step_input.dspeed_up > 0)
+				goto_level(game, game->current_level + 1);
+			else if (step_input.dspeed_down > 0)
+				goto_level(game, game->current_level - 1);
 		
 #endif
 
-		
-		if (!game->game_over)
-			game->time = (f32)game->frame_index * (1.0f / 60);
+			save_previous_part_positions(game);
+			step_game(game, &step_input);
+			++game->frame_index;
 
-		if (game->time > game->level_begin_t && game->skip_to_begin) {
-			game->skip_to_begin = false;
-			game->time_speed_up = 0;
+			if (snapshots_enabled() && game->frame_index % SNAPSHOT_INTERVAL == 0)
+				push_snapshot(&snapshot_ring, game);
 		}
+	}
 
-		if (game->time > game->level_end_t && game->skip_to_end) {
-			game->skip_to_end = false;
-			game->time_speed_up = 0;
-		}
-		
-#if !defined(__EMSCRIPTEN__)
-		if (i == 0) {
-			f32 real_time = (f32)(SDL_GetTicks()) / 1000.0f;
-			f32 elapsed_since_last_frame = real_time - game->last_frame_real_time;
-			if (elapsed_since_last_frame < 16)
-				SDL_Delay((u32)(16 - elapsed_since_last_frame));
-			game->last_frame_real_time = real_time;
-		}
-#endif
-		
-		update_game(game, &input);
-		if (i == 0)
-			render_game(game, renderer, font, small_font);
+	render_game(game, renderer, &font_atlas, &small_font_atlas, (f32)(step_accumulator / SIMULATION_DT));
 
-		++game->frame_index;
+#if !defined(__EMSCRIPTEN__)
+	/* NOTE(omid): Without vsync nothing would block, so sleep until the next
+	   step is due instead of drawing the same state again. */
+	if (!vsync) {
+		f64 frame_seconds = (f64)(SDL_GetPerformanceCounter() - frame_counter) / frequency;
+		f64 idle_seconds = SIMULATION_DT - step_accumulator - frame_seconds;
+		if (idle_seconds > 0.001)
+			SDL_Delay((u32)(idle_seconds * 1000));
 	}
+#endif
 }
 
 
 int
-main()
+main(int argc, char **argv)
 {
+	spring_kernel = select_spring_kernel();
+
+	const char *levels_path = 0;
+	for (s32 i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--max-entities") == 0 && i + 1 < argc) {
+			max_entity_count = (u32)strtoul(argv[++i], 0, 10);
+			if (max_entity_count == 0)
+				max_entity_count = 1;
+			if (max_entity_count > MAX_ENTITY_COUNT_LIMIT)
+				max_entity_count = MAX_ENTITY_COUNT_LIMIT;
+		} else if (strcmp(argv[i], "--max-voices") == 0 && i + 1 < argc) {
+			voice_budget = (u32)strtoul(argv[++i], 0, 10);
+			if (voice_budget > 2 * MAX_VOICE_COUNT)
+				voice_budget = 2 * MAX_VOICE_COUNT;
+		} else if (strcmp(argv[i], "--profile-csv") == 0 && i + 1 < argc) {
+			profile_csv_path = argv[++i];
+		} else if (strcmp(argv[i], "--profile-trace") == 0 && i + 1 < argc) {
+			profile_trace_path = argv[++i];
+		} else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+			thread_count = (u32)strtoul(argv[++i], 0, 10);
+			if (thread_count > MAX_WORKER_COUNT)
+				thread_count = MAX_WORKER_COUNT;
+		} else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+			record_path = argv[++i];
+		} else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+			replay_path = argv[++i];
+		} else if (strcmp(argv[i], "--save-snapshot") == 0 && i + 1 < argc) {
+			snapshot_save_path = argv[++i];
+		} else if (strcmp(argv[i], "--load-snapshot") == 0 && i + 1 < argc) {
+			snapshot_load_path = argv[++i];
+		} else if (strcmp(argv[i], "--levels") == 0 && i + 1 < argc) {
+			levels_path = argv[++i];
+		}
+	}
+
+	if (!load_level_set(levels_path)) {
+		fprintf(stderr, "could not load levels from %s\n", levels_path ? levels_path : "the defaults");
+		return 10;
+	}
+
+	init_job_pool(&job_pool, thread_count ? thread_count : default_thread_count());
+
+	for (s32 i = 1; i < argc; ++i) {
+		s32 result = -1;
+		if (strcmp(argv[i], "--bench-springs") == 0)
+			result = run_spring_benchmark();
+		else if (strcmp(argv[i], "--bench-audio") == 0)
+			result = run_audio_benchmark();
+		else if (strcmp(argv[i], "--headless") == 0)
+			result = run_headless(argc, argv);
+		else if (strcmp(argv[i], "--bench-stress") == 0)
+			result = run_stress_benchmark(argc, argv);
+		else if (strcmp(argv[i], "--bench-threads") == 0)
+			result = run_thread_benchmark(argc, argv);
+		else if (strcmp(argv[i], "--bench-narrowphase") == 0)
+			result = run_narrowphase_benchmark();
+
+		if (result >= 0) {
+			shutdown_job_pool(&job_pool);
+			return result;
+		}
+	}
+
 	if (SDL_Init(SDL_INIT_VIDEO) < 0)
 		return 1;
 
 	if (TTF_Init() < 0)
 		return 2;
 
-	srand(120);
-
 	window_w = WINDOW_WIDTH;
 	window_h = WINDOW_HEIGHT;
 	
@@ -2629,6 +7729,10 @@ main()
 
 	SDL_GetRendererOutputSize(renderer, &renderer_w, &renderer_h);
 
+	SDL_RendererInfo renderer_info;
+	if (SDL_GetRendererInfo(renderer, &renderer_info) == 0)
+		vsync = (renderer_info.flags & SDL_RENDERER_PRESENTVSYNC) != 0;
+
 	printf("Render Size: %u, %u\n", renderer_w, renderer_h);
 	
 	default_scale = (f32)renderer_w / (f32)window_w;
@@ -2637,11 +7741,40 @@ main()
 	font_name = "novem___.ttf";
 	font = TTF_OpenFont(font_name, FONT_SIZE);
 	small_font = TTF_OpenFont(font_name, SMALL_FONT_SIZE);
+	if (!font || !small_font)
+		return 4;
+
+	if (!build_glyph_atlas(&font_atlas, renderer, font) ||
+	    !build_glyph_atlas(&small_font_atlas, renderer, small_font))
+		return 5;
+
+	u64 seed = DEFAULT_RANDOM_SEED;
+	u32 level = 0;
+	u32 max_entities = max_entity_count;
+	if (replay_path) {
+		if (!load_replay(&replay_player.replay, replay_path))
+			return 7;
+		seed = replay_player.replay.header.seed;
+		level = replay_player.replay.header.level;
+		max_entities = replay_player.replay.header.max_entity_count;
+	}
+
+	if (snapshot_load_path && (replay_path || record_path))
+		return 8;
 
 	global_game = (struct game_state *)malloc(sizeof(struct game_state));
-	ZERO_STRUCT(*global_game);
+	if (!init_game_state(global_game, seed, max_entities))
+		return 6;
 	/* game->level_end_t = -5; */
-	goto_level(global_game, 0);	
+	if (snapshot_load_path) {
+		if (!load_game_snapshot(global_game, snapshot_load_path))
+			return 9;
+	} else {
+		goto_level(global_game, level);
+	}
+
+	if (record_path)
+		begin_replay_recording(&replay_recording, seed, level, global_game->max_entity_count);
 	
 	ZERO_STRUCT(input);
 
@@ -2670,10 +7803,21 @@ main()
 #endif
 	
 	SDL_CloseAudio();
+	write_profile_exports();
+
+	if (record_path && !write_replay(&replay_recording, record_path))
+		fprintf(stderr, "could not write replay %s\n", record_path);
+	free(replay_recording.bytes);
+	free_replay_player(&replay_player);
+	free_snapshot_ring(&snapshot_ring);
 
 	
+	destroy_glyph_atlas(&font_atlas);
+	destroy_glyph_atlas(&small_font_atlas);
 	TTF_CloseFont(font);
+	TTF_CloseFont(small_font);
 	SDL_DestroyRenderer(renderer);
+	shutdown_job_pool(&job_pool);
 	SDL_Quit();
 
 	return 0;